@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mutex>
+
+#include "main.hh"
+#include "ano.hh"
+
+#define ANO_CHUNK 4096
+
+/* Records are gathered by each sweep thread in chunks of columns of
+   its own, and only take a lock to hand over a chunk once it is full
+   or the thread is done */
+struct anoChunk {
+	double lat[ANO_CHUNK], lon[ANO_CHUNK];
+	float azimuth[ANO_CHUNK], elevation[ANO_CHUNK], value[ANO_CHUNK];
+	uint8_t blocked[ANO_CHUNK];
+	int count;
+	struct anoChunk *next;
+};
+
+static thread_local struct anoChunk *current = NULL;
+static struct anoChunk *chunks = NULL;
+static std::mutex chunkMutex;
+
+/* All the records, in columns, while they are sorted */
+static double *all_lat, *all_lon;
+
+void AnoRecord(double lat, double lon, double azimuth, double elevation,
+	       double value, bool blocked)
+{
+	int i;
+
+	if (current == NULL) {
+		current = new struct anoChunk;
+		current->count = 0;
+	}
+
+	i = current->count++;
+	current->lat[i] = lat;
+	current->lon[i] = lon;
+	current->azimuth[i] = (float)azimuth;
+	current->elevation[i] = (float)elevation;
+	current->value[i] = (float)value;
+	current->blocked[i] = (blocked ? 1 : 0);
+
+	if (current->count == ANO_CHUNK)
+		AnoFlush();
+}
+
+void AnoFlush(void)
+{
+	/* Hands over the chunk this thread is filling, if any.  Sweep
+	   threads call this as they finish. */
+
+	if (current == NULL)
+		return;
+
+	if (current->count == 0)
+		delete current;
+	else {
+		std::lock_guard<std::mutex> lock(chunkMutex);
+		current->next = chunks;
+		chunks = current;
+	}
+
+	current = NULL;
+}
+
+static int CompareRecords(const void *a, const void *b)
+{
+	/* North to south, then east to west, then as recorded */
+
+	size_t p = *(const size_t *)a, q = *(const size_t *)b;
+
+	if (all_lat[p] != all_lat[q])
+		return (all_lat[p] > all_lat[q] ? -1 : 1);
+
+	if (all_lon[p] != all_lon[q])
+		return (all_lon[p] < all_lon[q] ? -1 : 1);
+
+	return (p < q ? -1 : p > q ? 1 : 0);
+}
+
+static void WriteColumn(FILE *fd, const void *column, size_t size,
+			const size_t *order, size_t count)
+{
+	/* Writes count values of size bytes from column, in order,
+	   padded to a multiple of 8 */
+
+	static const uint8_t zero[8] = {0};
+	uint8_t buffer[ANO_CHUNK * sizeof(double)];
+	size_t i, n;
+
+	for (i = 0; i < count; i += n) {
+		for (n = 0; n < ANO_CHUNK && i + n < count; n++)
+			memcpy(buffer + n * size,
+			       (const uint8_t *)column + order[i + n] * size, size);
+
+		fwrite(buffer, size, n, fd);
+	}
+
+	if ((count * size) & 7)
+		fwrite(zero, 1, 8 - ((count * size) & 7), fd);
+}
+
+int WriteAno(FILE *fd)
+{
+	/* Joins up the chunks of every thread, sorts the records into
+	   a fixed order and writes them out after the header */
+
+	struct ano_header header;
+	struct anoChunk *chunk, *next;
+	float *azimuth, *elevation, *value;
+	uint8_t *blocked;
+	size_t i, count = 0, *order;
+	uint64_t offset;
+	int c;
+
+	AnoFlush();
+
+	for (chunk = chunks; chunk != NULL; chunk = chunk->next)
+		count += chunk->count;
+
+	all_lat = new double[count + 1];
+	all_lon = new double[count + 1];
+	azimuth = new float[count + 1];
+	elevation = new float[count + 1];
+	value = new float[count + 1];
+	blocked = new uint8_t[count + 1];
+	order = new size_t[count + 1];
+
+	/* The chunks are listed newest first */
+
+	for (chunk = chunks, i = count; chunk != NULL; chunk = next) {
+		i -= chunk->count;
+		memcpy(all_lat + i, chunk->lat, chunk->count * sizeof(double));
+		memcpy(all_lon + i, chunk->lon, chunk->count * sizeof(double));
+		memcpy(azimuth + i, chunk->azimuth, chunk->count * sizeof(float));
+		memcpy(elevation + i, chunk->elevation, chunk->count * sizeof(float));
+		memcpy(value + i, chunk->value, chunk->count * sizeof(float));
+		memcpy(blocked + i, chunk->blocked, chunk->count);
+
+		next = chunk->next;
+		delete chunk;
+	}
+
+	chunks = NULL;
+
+	for (i = 0; i < count; i++)
+		order[i] = i;
+
+	qsort(order, count, sizeof(size_t), CompareRecords);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ANO_MAGIC, sizeof(header.magic));
+	header.version = ANO_VERSION;
+	header.value_type = (LR.erp == 0.0 ? ANO_LOSS : dbm ? ANO_DBM : ANO_DBUV);
+	header.count = count;
+	header.max_west = max_west;
+	header.min_west = min_west;
+	header.max_north = max_north;
+	header.min_north = min_north;
+	header.frq_mhz = LR.frq_mhz;
+
+	for (c = 0, offset = sizeof(header); c < ANO_COLUMNS; c++) {
+		header.offset[c] = offset;
+		offset += (count * (c <= ANO_LON ? sizeof(double) :
+				    c == ANO_BLOCKED ? 1 : sizeof(float)) + 7) & ~(uint64_t)7;
+	}
+
+	fwrite(&header, sizeof(header), 1, fd);
+
+	WriteColumn(fd, all_lat, sizeof(double), order, count);
+	WriteColumn(fd, all_lon, sizeof(double), order, count);
+	WriteColumn(fd, azimuth, sizeof(float), order, count);
+	WriteColumn(fd, elevation, sizeof(float), order, count);
+	WriteColumn(fd, value, sizeof(float), order, count);
+	WriteColumn(fd, blocked, 1, order, count);
+
+	delete [] order;
+	delete [] blocked;
+	delete [] value;
+	delete [] elevation;
+	delete [] azimuth;
+	delete [] all_lon;
+	delete [] all_lat;
+
+	return (ferror(fd) ? EIO : 0);
+}
@@ -0,0 +1,46 @@
+#ifndef _ANO_HH_
+#define _ANO_HH_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* A binary alternative to the alphanumeric (.ano) output: the same
+   records, each pixel's latitude, longitude (degrees west), azimuth,
+   elevation, value and whether the path to it was blocked, stored
+   as columns rather than lines.  The header is followed by each
+   column in turn, starting at its offset, a multiple of 8 from the
+   start of the file, so that a reader can map the file and use the
+   columns in place.  Records run north to south and then east to
+   west.  Values are path loss (dB, without the antenna pattern),
+   received power (dBm) or field strength (dBuV/m), as with the text
+   file. */
+
+#define ANO_MAGIC "SSAN"
+#define ANO_VERSION 1
+#define ANO_LOSS 0
+#define ANO_DBM 1
+#define ANO_DBUV 2
+
+enum { ANO_LAT, ANO_LON, ANO_AZIMUTH, ANO_ELEVATION, ANO_VALUE,
+	ANO_BLOCKED, ANO_COLUMNS };
+
+struct ano_header {
+	char magic[4];
+	int32_t version;
+	int32_t value_type;	/* ANO_LOSS, _DBM or _DBUV */
+	int32_t reserved;
+	uint64_t count;		/* records */
+	double max_west, min_west, max_north, min_north;
+	double frq_mhz;
+	uint64_t offset[ANO_COLUMNS];	/* double lat, lon; float azimuth,
+					   elevation, value; uint8 blocked */
+};
+
+void AnoRecord(double lat, double lon, double azimuth, double elevation,
+	       double value, bool blocked);
+void AnoFlush(void);
+int WriteAno(FILE *fd);
+
+#endif /* _ANO_HH_ */
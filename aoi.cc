@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+
+#include "main.hh"
+#include "aoi.hh"
+
+#define AOI_MAX_DEPTH 16
+
+/* Whether each pixel of the pages in use lies in the area of
+   interest, laid out like dem[].mask.  NULL unless -aoi is set. */
+static bool ***aoiPlanes = NULL;
+
+/* The rings as read, longitudes east positive, only kept while
+   they are being rasterized */
+static double *ring_lat = NULL, *ring_lon = NULL;
+static int *ring_first = NULL, vertices = 0, rings = 0;
+
+static void AddVertex(double lon, double lat)
+{
+	if ((vertices & 1023) == 0) {
+		ring_lat = (double *)realloc(ring_lat, (vertices + 1024) * sizeof(double));
+		ring_lon = (double *)realloc(ring_lon, (vertices + 1024) * sizeof(double));
+	}
+
+	ring_lat[vertices] = lat;
+	ring_lon[vertices] = lon;
+	vertices++;
+}
+
+static void AddRing(int first)
+{
+	/* Closes the ring of the vertices from first on, dropping a
+	   repeated closing vertex and anything that is not an area */
+
+	if (vertices - first > 1 && ring_lat[vertices - 1] == ring_lat[first]
+	    && ring_lon[vertices - 1] == ring_lon[first])
+		vertices--;
+
+	if (vertices - first < 3) {
+		vertices = first;
+		return;
+	}
+
+	if ((rings & 63) == 0)
+		ring_first = (int *)realloc(ring_first, (rings + 65) * sizeof(int));
+
+	ring_first[rings++] = first;
+	ring_first[rings] = vertices;
+}
+
+static void ParseRings(char *text)
+{
+	/* Collects the rings of WKT or GeoJSON text.  A bracket that
+	   holds numbers directly is either a GeoJSON position of two
+	   or three of them, whose enclosing bracket is then a ring,
+	   or a WKT ring of comma separated "lon lat" tuples.  Quoted
+	   strings are skipped. */
+
+	int depth = 0, numbers = 0, x, points[AOI_MAX_DEPTH],
+	    first[AOI_MAX_DEPTH], size = 0;
+	double *value = NULL;
+	bool *starts = NULL, tuple = true, quoted = false;
+	char *p = text, *end;
+
+	while (*p) {
+		if (quoted) {
+			if (*p == '\\' && p[1])
+				p++;
+			else if (*p == '"')
+				quoted = false;
+		}
+
+		else if (*p == '"')
+			quoted = true;
+
+		else if (*p == '(' || *p == '[') {
+			if (depth < AOI_MAX_DEPTH) {
+				points[depth] = 0;
+				first[depth] = vertices;
+			}
+
+			depth++;
+			numbers = 0;
+			tuple = true;
+		}
+
+		else if ((*p == ')' || *p == ']') && depth > 0) {
+			depth--;
+
+			if (depth < AOI_MAX_DEPTH) {
+				if (numbers >= 2 && numbers <= 3) {
+					/* A GeoJSON position */
+
+					AddVertex(value[0], value[1]);
+
+					if (depth > 0)
+						points[depth - 1]++;
+				}
+
+				else if (numbers > 3) {
+					/* A WKT ring, first two of each tuple */
+
+					for (x = 0; x + 1 < numbers; x++)
+						if (starts[x] && !starts[x + 1])
+							AddVertex(value[x], value[x + 1]);
+
+					AddRing(first[depth]);
+				}
+
+				else if (points[depth] > 0)
+					AddRing(first[depth]);
+			}
+
+			numbers = 0;
+		}
+
+		else if (*p == ',')
+			tuple = true;
+
+		else if (depth > 0 && (isdigit((unsigned char)*p) || *p == '-'
+				       || *p == '+' || *p == '.')) {
+			if (numbers == size) {
+				size += 1024;
+				value = (double *)realloc(value, size * sizeof(double));
+				starts = (bool *)realloc(starts, size * sizeof(bool));
+			}
+
+			value[numbers] = strtod(p, &end);
+
+			if (end > p) {
+				starts[numbers++] = tuple;
+				tuple = false;
+				p = end;
+				continue;
+			}
+		}
+
+		p++;
+	}
+
+	free(value);
+	free(starts);
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+static void Rasterize(void)
+{
+	/* Scan converts the rings into aoiPlanes, a row of pixels at
+	   a time: a pixel is inside when an odd number of ring edges
+	   cross its row to the west of it */
+
+	int indx, x, y, r, i, j, crossings, c;
+	double lat, lon, *cross = new double[vertices];
+
+	aoiPlanes = allocPlanes<bool>(false);
+
+	for (indx = 0; indx < MAXPAGES; indx++) {
+		if (aoiPlanes[indx] == NULL)
+			continue;
+
+		for (x = 0; x < ippd; x++) {
+			lat = dem[indx].min_north + (double)x / ppd;
+
+			for (r = 0, crossings = 0; r < rings; r++)
+				for (i = ring_first[r], j = ring_first[r + 1] - 1;
+				     i < ring_first[r + 1]; j = i++)
+					if ((ring_lat[i] > lat) != (ring_lat[j] > lat))
+						cross[crossings++] = ring_lon[i] +
+						    (lat - ring_lat[i]) *
+						    (ring_lon[j] - ring_lon[i]) /
+						    (ring_lat[j] - ring_lat[i]);
+
+			qsort(cross, crossings, sizeof(double), CompareDouble);
+
+			/* East longitude grows as y falls */
+
+			for (y = mpi, c = 0; y >= 0; y--) {
+				lon = -(dem[indx].max_west - (double)(mpi - y) / yppd);
+
+				if (lon < -180.0)
+					lon += 360.0;
+
+				while (c < crossings && cross[c] < lon)
+					c++;
+
+				aoiPlanes[indx][x][y] = ((c & 1) == 1);
+			}
+		}
+	}
+
+	delete [] cross;
+}
+
+int LoadAOI(char *filename)
+{
+	/* Reads the rings of the area of interest and rasterizes them
+	   over the terrain pages, which must already be loaded */
+
+	char *text;
+	long size;
+	FILE *fd;
+
+	if ((fd = fopen(filename, "rb")) == NULL)
+		return errno;
+
+	fseek(fd, 0, SEEK_END);
+	size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+
+	if (size < 0 || (text = (char *)malloc(size + 1)) == NULL) {
+		fclose(fd);
+		return ENOMEM;
+	}
+
+	size = (long)fread(text, 1, size, fd);
+	text[size] = 0;
+	fclose(fd);
+
+	ParseRings(text);
+	free(text);
+
+	if (rings == 0) {
+		fprintf(stderr, "%s holds no polygon\n", filename);
+		FreeAOI();
+		return EINVAL;
+	}
+
+	if (debug)
+		fprintf(stderr, "Area of interest: %d rings, %d vertices\n",
+			rings, vertices);
+
+	Rasterize();
+
+	free(ring_lat);
+	free(ring_lon);
+	free(ring_first);
+	ring_lat = ring_lon = NULL;
+	ring_first = NULL;
+	vertices = rings = 0;
+
+	return 0;
+}
+
+void FreeAOI(void)
+{
+	freePlanes(aoiPlanes);
+	aoiPlanes = NULL;
+
+	free(ring_lat);
+	free(ring_lon);
+	free(ring_first);
+	ring_lat = ring_lon = NULL;
+	ring_first = NULL;
+	vertices = rings = 0;
+}
+
+bool InAOI(double lat, double lon)
+{
+	/* Whether lat/lon is in the area of interest, always when
+	   there is none, never off the terrain */
+
+	int x, y, indx;
+
+	if (aoiPlanes == NULL)
+		return true;
+
+	for (indx = 0; indx < MAXPAGES; indx++) {
+		x = (int)rint(ppd * (lat - dem[indx].min_north));
+		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
+
+		if (x >= 0 && x <= mpi && y >= 0 && y <= mpi)
+			return (aoiPlanes[indx] != NULL && aoiPlanes[indx][x][y]);
+	}
+
+	return false;
+}
+
+int AOIPathLength(double *lat, double *lon, int length, int stride)
+{
+	/* The length to cut a path of samples stride apart to, so
+	   that it ends just past the last one in the area of
+	   interest.  A ray goes no further once it has left it
+	   for good. */
+
+	int y;
+
+	if (aoiPlanes == NULL)
+		return length;
+
+	for (y = length - 1; y >= 0; y--)
+		if (InAOI(lat[y * stride], lon[y * stride]))
+			break;
+
+	return (y + 2 >= length ? length : MAX(y + 2, 2));
+}
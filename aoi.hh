@@ -0,0 +1,17 @@
+#ifndef _AOI_HH_
+#define _AOI_HH_
+
+#include "common.h"
+
+/* An area of interest is a set of polygon rings, read as the
+   coordinates of a WKT (MULTI)POLYGON or of a GeoJSON geometry,
+   longitude first and east positive.  A point is inside when it
+   is inside an odd number of rings, so holes and several parts
+   work as expected.  Rings may not cross the antimeridian. */
+
+int LoadAOI(char *filename);
+void FreeAOI(void);
+bool InAOI(double lat, double lon);
+int AOIPathLength(double *lat, double *lon, int length, int stride);
+
+#endif /* _AOI_HH_ */
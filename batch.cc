@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <Windows.h>
+#include <atomic>
+#include <mutex>
+
+#include "main.hh"
+#include "batch.hh"
+#include "outputs.hh"
+#include "models/los.hh"
+
+namespace {
+	struct batchJob {
+		struct site *sites;
+		int *channels;
+		int count;
+		double altitude;
+		int propmodel, knifeedge, pmenv, packet;
+		bool polar, use_threads;
+		unsigned char geo, kml, ngs;
+		bool best_server, interference;
+		std::atomic<int> next;
+		std::atomic<int> result;
+	};
+
+	std::mutex renderMutex;
+
+	/* Best server state of every pixel, packed so that one
+	   compare-and-swap updates it: bits 0-7 hold the best signal
+	   byte, 8-15 the second best and 16-31 the best site's index.
+	   A signal byte of 0 means no coverage, as in dem[].signal. */
+	std::atomic<uint32_t> ***bestServer = NULL;
+
+	/* Interference state: the received power (mW) of every channel
+	   group summed over its sites, and the strongest single site
+	   packed as its power's float bits above its channel group.
+	   Powers are never negative, so their bits order like them. */
+	int channelGroups = 0;
+	std::atomic<float> ****groupPower = NULL;
+	std::atomic<uint64_t> ***strongest = NULL;
+
+	inline bool better(unsigned a, unsigned b)
+	{
+		/* Path loss bytes are better when lower */
+
+		if (LR.erp == 0.0)
+			return a != 0 && (b == 0 || a < b);
+
+		return a > b;
+	}
+
+	void bestServerPlane(int shift)
+	{
+		/* Copies the best (shift 0) or second best (shift 8)
+		   signal bytes into dem[].signal for the renderers */
+
+		int i, j, k;
+
+		for (i = 0; i < MAXPAGES; i++) {
+			if (bestServer[i] == NULL)
+				continue;
+
+			for (j = 0; j < ippd; j++)
+				for (k = 0; k < ippd; k++)
+					dem[i].signal[j][k] =
+					    (unsigned char)(bestServer[i][j][k] >> shift);
+		}
+	}
+
+	double serverId(int indx, int x, int y)
+	{
+		uint32_t state = bestServer[indx][x][y];
+
+		return (state & 0xff) ? (double)(state >> 16) : -1.0;
+	}
+
+	double noiseFloor;
+
+	double interferenceDB(int indx, int x, int y, bool noise)
+	{
+		/* C/I, or with noise SINR, in dB: the strongest site over
+		   the rest of its channel group (and the noise floor) */
+
+		uint64_t state = strongest[indx][x][y];
+		uint32_t bits = (uint32_t)(state >> 32);
+		float carrier;
+		double interference;
+
+		memcpy(&carrier, &bits, sizeof(carrier));
+
+		if (carrier <= 0.0f)
+			return -9999.0;
+
+		interference = groupPower[(int)(state & 0xffffffff)][indx][x][y] - carrier;
+
+		if (interference < 0.0)
+			interference = 0.0;	/* Rounding in the sum */
+
+		if (noise)
+			interference += pow(10.0, noiseFloor / 10.0);
+
+		if (interference <= 0.0)
+			return -9999.0;		/* No co-channel site */
+
+		return 10.0 * log10(carrier / interference);
+	}
+
+	double carrierToInterference(int indx, int x, int y)
+	{
+		return interferenceDB(indx, x, y, false);
+	}
+
+	double signalToNoise(int indx, int x, int y)
+	{
+		return interferenceDB(indx, x, y, true);
+	}
+
+	int writeGrid(char *filename, double (*value)(int, int, int),
+		      const char *format, double nodata)
+	{
+		/* Writes value() at every pixel of the map as an ESRI ASCII
+		   grid, north row first, with nodata off the terrain */
+
+		int indx, x, y, x0, y0;
+		char found;
+		double lat, lon, north, south, west;
+		FILE *fd;
+
+		if ((fd = fopen(filename, "w")) == NULL)
+			return errno;
+
+		north = (double)max_north - dpp;
+		south = (double)min_north;
+		west = (double)(max_west < 180 ? -max_west : 360 - max_west);
+
+		fprintf(fd, "ncols %d\nnrows %d\nxllcorner %.8f\nyllcorner %.8f\n"
+			"cellsize %.10f\nNODATA_value ", width, height,
+			west, south, dpp);
+		fprintf(fd, format, nodata);
+		fprintf(fd, "\n");
+
+		for (y = 0, lat = north; y < (int)height;
+		     y++, lat = north - (dpp * (double)y)) {
+			for (x = 0, lon = max_west; x < (int)width;
+			     x++, lon = max_west - (dpp * (double)x)) {
+				if (lon < 0.0)
+					lon += 360.0;
+
+				for (indx = 0, found = 0, x0 = y0 = 0;
+				     indx < MAXPAGES && found == 0;) {
+					x0 = (int)rint(ppd * (lat - (double)dem[indx].min_north));
+					y0 = mpi - (int)rint(ppd * (LonDiff((double)dem[indx].max_west, lon)));
+
+					if (x0 >= 0 && x0 <= mpi && y0 >= 0 && y0 <= mpi)
+						found = 1;
+					else
+						indx++;
+				}
+
+				if (x > 0)
+					fprintf(fd, " ");
+
+				fprintf(fd, format, (found ? value(indx, x0, y0) : nodata));
+			}
+			fprintf(fd, "\n");
+		}
+
+		fclose(fd);
+
+		return 0;
+	}
+
+	void addInterference(struct layer *l)
+	{
+		/* Adds the received power of a swept site to the sum of
+		   its channel group and keeps it where it is strongest.
+		   Workers do this concurrently, hence the atomics. */
+
+		int i, j, k;
+		float mW, sum;
+		uint32_t bits;
+		uint64_t state, next;
+
+		for (i = 0; i < MAXPAGES; i++) {
+			if (l->power[i] == NULL)
+				continue;
+
+			for (j = 0; j < ippd; j++)
+				for (k = 0; k < ippd; k++) {
+					if (!((mW = l->power[i][j][k]) > 0.0f))
+						continue;
+
+					std::atomic<float> &total = groupPower[l->channel][i][j][k];
+
+					sum = total;
+					while (!total.compare_exchange_weak(sum, sum + mW));
+
+					memcpy(&bits, &mW, sizeof(bits));
+					next = ((uint64_t)bits << 32) | (uint32_t)l->channel;
+
+					std::atomic<uint64_t> &cell = strongest[i][j][k];
+
+					state = cell;
+					while ((state >> 32) < bits &&
+					       !cell.compare_exchange_weak(state, next));
+				}
+		}
+	}
+
+	int renderSite(batchJob *job, struct site *site)
+	{
+		/* Draws the current dem[] signal planes for one site,
+		   exactly as main() does for a single site */
+
+		char mapfile[255];
+		int result = 0;
+
+		strncpy(mapfile, site->filename, 254);
+		mapfile[254] = 0;
+
+		if (LR.erp == 0.0)
+			DoPathLoss(mapfile, job->geo, job->kml, job->ngs, site, 1);
+		else if (dbm)
+			DoRxdPwr(mapfile, job->geo, job->kml, job->ngs, site, 1);
+		else
+			result = DoSigStr(mapfile, job->geo, job->kml, job->ngs, site, 1);
+
+		fprintf(stderr, "%s|%.6f|%.6f|%.6f|%.6f|\n", site->filename,
+			max_north, east, min_north, west);
+
+		return result;
+	}
+
+	void* batchWorker(void *parameters)
+	{
+		/* Sweeps sites from the job until none are left.  Each
+		   worker writes into a layer of its own, so the terrain is
+		   the only thing the sweeps share, and it is read only.
+		   Rendering uses globals, so only one site draws at once. */
+
+		batchJob *job = (batchJob*)parameters;
+		struct layer *l;
+		char ano_filename[1] = {0};
+		int i, result;
+
+		if (job->use_threads) {
+			alloc_elev();
+			alloc_path();
+		}
+
+		l = alloc_layer(job->interference);
+		site_layer = l;
+
+		while ((i = job->next++) < job->count) {
+			struct site *site = &job->sites[i];
+
+			/* The map markings are copied from dem[].mask, which
+			   a site being drawn has swapped for its own plane */
+
+			{
+				std::lock_guard<std::mutex> lock(renderMutex);
+				clear_layer(l);
+			}
+
+			if (job->best_server)
+				l->site = i;
+
+			if (job->interference)
+				l->channel = job->channels[i];
+
+			PlotPropagation(*site, job->altitude, ano_filename,
+					job->propmodel, job->knifeedge, 0,
+					job->pmenv, false, job->packet,
+					job->polar);
+
+			// nearfield void
+
+			for (float x = -0.001; x < 0.001; x = x + 0.0001) {
+				for (float y = -0.001; y < 0.001; y = y + 0.0001) {
+					if (GetSignal(site->lat + y, site->lon + x) <= 0)
+						PutSignal(site->lat + y, site->lon + x, l->hottest);
+				}
+			}
+
+			if (job->interference)
+				addInterference(l);
+
+			/* Composites are written once all sites are in */
+
+			if (job->best_server || job->interference)
+				continue;
+
+			std::lock_guard<std::mutex> lock(renderMutex);
+
+			swap_layer(l);
+			result = renderSite(job, site);
+			swap_layer(l);
+
+			if (result != 0)
+				job->result = result;
+		}
+
+		site_layer = NULL;
+		free_layer(l);
+
+		if (job->use_threads) {
+			free_elev();
+			free_path();
+		}
+
+		return NULL;
+	}
+}
+
+void MergeBestServer(int indx, int x, int y, int site, unsigned char signal)
+{
+	/* Called by PutSignal() whenever a site's own signal at a pixel
+	   improves.  If the site already is the best server only its
+	   level moves; otherwise it may displace the best server, which
+	   then becomes the second best, or just improve the second. */
+
+	std::atomic<uint32_t> &cell = bestServer[indx][x][y];
+	uint32_t state = cell, next;
+	unsigned best, second, id;
+
+	do {
+		best = state & 0xff;
+		second = (state >> 8) & 0xff;
+		id = state >> 16;
+
+		if (best != 0 && id == (unsigned)site) {
+			if (!better(signal, best))
+				return;
+			best = signal;
+		}
+
+		else if (better(signal, best)) {
+			second = best;
+			best = signal;
+			id = site;
+		}
+
+		else if (better(signal, second))
+			second = signal;
+
+		else
+			return;
+
+		next = best | (second << 8) | (id << 16);
+	} while (!cell.compare_exchange_weak(state, next));
+}
+
+int PlotBatch(struct site *sites, int *channels, int count, double altitude,
+	      int propmodel, int knifeedge, int pmenv, int packet, bool polar,
+	      bool use_threads, unsigned char geo, unsigned char kml,
+	      unsigned char ngs, char *mapfile, bool best_server,
+	      bool interference, double noise_floor)
+{
+	/* This function runs the coverage of every site in the list
+	   against the terrain already loaded, up to BATCH_THREADS
+	   sites at a time, and writes each to its own output file.
+	   Each sweep runs on a single thread; the parallelism is
+	   across sites.
+
+	   With best_server the sites are instead merged as they go
+	   into one composite of the best and second best signal at
+	   each pixel, drawn to mapfile and mapfile_2nd, with the
+	   index of the best site written to mapfile_server.asc.
+
+	   With interference the received power of every site is
+	   summed per channel group as they go, and the C/I and SINR
+	   (against noise_floor dBm) of the strongest site at each
+	   pixel are written to mapfile_ci.asc and mapfile_sinr.asc. */
+
+	HANDLE threads[BATCH_THREADS];
+	int i, workers = 0;
+	char filename[255];
+	struct site composite;
+	batchJob job;
+
+	job.sites = sites;
+	job.channels = channels;
+	job.count = count;
+	job.altitude = altitude;
+	job.propmodel = propmodel;
+	job.knifeedge = knifeedge;
+	job.pmenv = pmenv;
+	job.packet = packet;
+	job.polar = polar;
+	job.use_threads = use_threads;
+	job.geo = geo;
+	job.kml = kml;
+	job.ngs = ngs;
+	job.best_server = best_server;
+	job.interference = interference;
+	job.next = 0;
+	job.result = 0;
+
+	if (best_server)
+		bestServer = allocPlanes<std::atomic<uint32_t> >(0);
+
+	if (interference) {
+		for (i = 0, channelGroups = 1; i < count; i++)
+			if (channels[i] >= channelGroups)
+				channelGroups = channels[i] + 1;
+
+		groupPower = new std::atomic<float> ***[channelGroups];
+		for (i = 0; i < channelGroups; i++)
+			groupPower[i] = allocPlanes<std::atomic<float> >(0);
+
+		strongest = allocPlanes<std::atomic<uint64_t> >(0);
+		noiseFloor = noise_floor;
+	}
+
+	if (use_threads) {
+		for (i = 0; i < BATCH_THREADS && i < count; i++) {
+			threads[workers] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ batchWorker(arg); return 0; }, &job, 0, 0);
+			if (threads[workers] == nullptr)
+				fprintf(stderr,"ERROR; return code from pthread_create() is %d\n", 0);
+			else
+				++workers;
+		}
+	}
+
+	/* Without threads, or if none started, sweep them all here */
+
+	if (workers == 0) {
+		job.use_threads = false;
+		batchWorker(&job);
+	}
+
+	for (i = 0; i < workers; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+
+	if (best_server) {
+		/* The composite takes its colours from the -o file name */
+
+		composite = sites[0];
+		strncpy(composite.filename, mapfile, 254);
+
+		bestServerPlane(0);
+		job.result = renderSite(&job, &composite);
+
+		if (job.result == 0) {
+			snprintf(composite.filename, sizeof(composite.filename),
+				 "%s_2nd", mapfile);
+			bestServerPlane(8);
+			job.result = renderSite(&job, &composite);
+		}
+
+		snprintf(filename, sizeof(filename), "%s_server.asc", mapfile);
+
+		if (job.result == 0 &&
+		    (job.result = writeGrid(filename, serverId, "%.0f", -1.0)) != 0)
+			fprintf(stderr, "Error writing server ids to %s\n", filename);
+
+		freePlanes(bestServer);
+		bestServer = NULL;
+	}
+
+	if (interference) {
+		snprintf(filename, sizeof(filename), "%s_ci.asc", mapfile);
+
+		if (job.result == 0 &&
+		    (job.result = writeGrid(filename, carrierToInterference, "%.2f", -9999.0)) != 0)
+			fprintf(stderr, "Error writing C/I to %s\n", filename);
+
+		snprintf(filename, sizeof(filename), "%s_sinr.asc", mapfile);
+
+		if (job.result == 0 &&
+		    (job.result = writeGrid(filename, signalToNoise, "%.2f", -9999.0)) != 0)
+			fprintf(stderr, "Error writing SINR to %s\n", filename);
+
+		for (i = 0; i < channelGroups; i++)
+			freePlanes(groupPower[i]);
+		delete [] groupPower;
+		freePlanes(strongest);
+		groupPower = NULL;
+		strongest = NULL;
+	}
+
+	return job.result;
+}
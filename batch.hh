@@ -0,0 +1,19 @@
+#ifndef _BATCH_HH_
+#define _BATCH_HH_
+
+#include "common.h"
+
+/* Largest number of sites swept at once in batch mode */
+#define BATCH_THREADS 4
+
+/* Server ids are held in 16 bits of the best server state */
+#define MAX_BEST_SERVER 65535
+
+int PlotBatch(struct site *sites, int *channels, int count, double altitude,
+	      int propmodel, int knifeedge, int pmenv, int packet, bool polar,
+	      bool use_threads, unsigned char geo, unsigned char kml,
+	      unsigned char ngs, char *mapfile, bool best_server,
+	      bool interference, double noise_floor);
+void MergeBestServer(int indx, int x, int y, int site, unsigned char signal);
+
+#endif /* _BATCH_HH_ */
@@ -26,6 +26,30 @@
 #define FOUR_THIRDS	1.3333333333333
 
 #define MAX(x,y)((x)>(y)?(x):(y))
+#define MIN(x,y)((x)<(y)?(x):(y))
+
+/* The dB antenna pattern is float dB by default. Define COMPACT_PATTERN
+   to hold it as int16 centi-dB instead, halving the table to ~700 KB. */
+#ifdef COMPACT_PATTERN
+typedef short pattern_db_t;
+#define PATTERN_DB_SCALE 100.0
+#define PATTERN_DB_ROUND(x) rint(x)
+#else
+typedef float pattern_db_t;
+#define PATTERN_DB_SCALE 1.0
+#define PATTERN_DB_ROUND(x) (x)
+#endif
+
+#define PATTERN_DB(az,el) ((double)LR.antenna_pattern_db[(az)][(el)] / PATTERN_DB_SCALE)
+
+/* Largest number of receiver heights in one -rxh list */
+#define MAX_RX_HEIGHTS 8
+
+/* Largest number of frequencies in one -f list */
+#define MAX_BANDS 8
+
+/* Largest number of percentiles in one -rel list */
+#define MAX_PERCENTILES 8
 
 struct dem {
 	float min_north;
@@ -39,6 +63,19 @@ struct dem {
 	unsigned char **signal;
 };
 
+/* Result planes for one site, laid out like dem[].mask and
+   dem[].signal, so that several sites can be swept at once over
+   the same terrain.  Pages that are not loaded are left NULL. */
+struct layer {
+	unsigned char ***mask;
+	unsigned char ***signal;
+	bool ***processed;
+	unsigned char hottest;
+	int site;	/* index in the best server raster, or -1 */
+	int channel;	/* channel group for interference, or -1 */
+	float ***power;	/* strongest received mW per pixel, or NULL */
+};
+
 struct site {
 	double lat;
 	double lon;
@@ -66,6 +103,7 @@ struct LR {
 	int radio_climate;
 	int pol;
 	float antenna_pattern[361][1001];
+	pattern_db_t antenna_pattern_db[361][1001];
 };
 
 struct region {
@@ -92,6 +130,7 @@ extern int loops;
 extern int jgets;
 extern int width;
 extern int height;
+extern int hottest;
 
 extern double earthradius;
 extern double north;
@@ -111,8 +150,23 @@ extern thread_local double *elev;
 extern double westoffset;
 extern double eastoffset;
 extern double delta;
-extern double cropLat;
-extern double cropLon;
+extern double et_margin;
+extern double et_distance;
+extern bool early_termination;
+extern bool angle_map;
+extern bool ano_binary;
+extern bool sector;
+extern double sector_start;
+extern double sector_end;
+extern double rx_heights[];
+extern int rx_height_count;
+extern struct layer *height_layers[];
+extern double frequencies[];
+extern int band_count;
+extern struct layer *band_layers[];
+extern double reliabilities[];
+extern int rel_count;
+extern struct layer *rel_layers[];
 
 extern char string[];
 extern char sdf_path[];
@@ -124,6 +178,7 @@ extern unsigned char metric;
 extern unsigned char dbm;
 
 extern struct dem *dem;
+extern thread_local struct layer *site_layer;
 extern thread_local struct path path;
 extern struct LR LR;
 extern struct region region;
@@ -0,0 +1,746 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "main.hh"
+#include "inputs.hh"
+#include "contours.hh"
+#include <Windows.h>
+
+#define CONTOUR_THREADS 4
+#define CONTOUR_LEVELS 129
+
+enum { CONTOUR_LOSS, CONTOUR_SIGNAL, CONTOUR_POWER };
+
+/* Paths through the edges between pixel centres, as chains of edge
+   numbers: rings, or where they cross into another band of rows,
+   open chains from one seam to another */
+struct contourPaths {
+	int64_t *edge;
+	int edges;
+	int *first;		/* chain i is edge[first[i]] to edge[first[i + 1] - 1] */
+	bool *closed;
+	int chains;
+};
+
+/* A band of rows traced by one thread, every level in turn */
+struct contourBand {
+	int r0, r1;		/* cells traced: rows r0 to r1 - 1 */
+	uint8_t *keys;		/* signal bytes of grid rows r0 to r1 */
+	int *start;		/* the segment leaving each edge of the band */
+	uint8_t *ends;		/* whether a segment reaches each edge */
+	int64_t *from, *to;	/* the segments of the level being traced */
+	int segments;
+	struct contourPaths *paths;	/* those of each level */
+};
+
+/* The rings of a level, as simplified */
+struct contourRings {
+	double *lon, *lat;
+	int vertices;
+	int *first;
+	int rings;
+};
+
+struct openChain {
+	int64_t head, tail;
+	struct contourPaths *paths;
+	int chain;
+	bool used;
+};
+
+static int mode, levels, level[CONTOUR_LEVELS];
+static uint8_t colour[CONTOUR_LEVELS][3];
+static int8_t segmentTable[16][4];
+
+/* The grid traced is the map with a border of no signal, so every
+   path closes: row r and column c of it are map row r - 1 and
+   column c - 1.  across is its width. */
+static int across;
+static double origin_lon;	/* East longitude of map column 0 */
+
+static inline int64_t HorizontalEdge(int r, int c)
+{
+	/* The edge from grid pixel (r, c) to (r, c + 1) */
+
+	return 2 * ((int64_t)r * across + c);
+}
+
+static inline int64_t VerticalEdge(int r, int c)
+{
+	/* The edge from grid pixel (r, c) to (r + 1, c) */
+
+	return 2 * ((int64_t)r * across + c) + 1;
+}
+
+static void EdgePoint(int64_t edge, double *lon, double *lat)
+{
+	/* The middle of an edge, which for a pixel in and a pixel
+	   out of the area is where their pixels meet.  Grid pixel
+	   (r, c) is map row r - 1, sampled at max_north - dpp * r,
+	   and map column c - 1, at origin_lon + dpp * (c - 1). */
+
+	int64_t n = edge >> 1;
+	int r = (int)(n / across), c = (int)(n % across);
+
+	if (edge & 1) {
+		*lat = max_north - dpp * (r + 0.5);
+		*lon = origin_lon + dpp * (c - 1);
+	} else {
+		*lat = max_north - dpp * r;
+		*lon = origin_lon + dpp * (c - 0.5);
+	}
+}
+
+static inline bool Inside(uint8_t key, int l)
+{
+	/* Whether a signal byte is at least as good as level l */
+
+	if (key == 0)
+		return false;
+
+	return (mode == CONTOUR_LOSS ? key <= level[l] :
+		mode == CONTOUR_SIGNAL ? key - 100 >= level[l] :
+		key - 200 >= level[l]);
+}
+
+static void BuildTable(void)
+{
+	/* The segments marching squares draws across a cell for each
+	   case of corners inside (top left 1, top right 2, bottom
+	   right 4, bottom left 8), as pairs of sides (top 0, right 1,
+	   bottom 2, left 3) from and to.  Going round the cell from
+	   corner to corner, each side where the inside starts is
+	   joined to the next side where it stops.  So the inside is
+	   always on the left, and diagonal corners inside are apart. */
+
+	int c, k, j, n;
+
+	for (c = 0; c < 16; c++) {
+		for (k = 0, n = 0; k < 4; k++) {
+			if ((c >> k & 1) || !(c >> ((k + 1) & 3) & 1))
+				continue;
+
+			for (j = (k + 1) & 3; !(c >> j & 1) || (c >> ((j + 1) & 3) & 1);
+			     j = (j + 1) & 3) ;
+
+			segmentTable[c][n++] = (int8_t)k;
+			segmentTable[c][n++] = (int8_t)j;
+		}
+
+		while (n < 4)
+			segmentTable[c][n++] = -1;
+	}
+}
+
+static void AddEdge(struct contourPaths *p, int64_t edge)
+{
+	if ((p->edges & 1023) == 0)
+		p->edge = (int64_t *)realloc(p->edge, (p->edges + 1024) * sizeof(int64_t));
+
+	p->edge[p->edges++] = edge;
+}
+
+static void AddChain(struct contourPaths *p)
+{
+	if ((p->chains & 63) == 0) {
+		p->first = (int *)realloc(p->first, (p->chains + 65) * sizeof(int));
+		p->closed = (bool *)realloc(p->closed, (p->chains + 64) * sizeof(bool));
+	}
+
+	p->first[p->chains] = p->edges;
+	p->closed[p->chains] = false;
+	p->chains++;
+}
+
+static void AddSegment(struct contourBand *b, int64_t from, int64_t to)
+{
+	if ((b->segments & 4095) == 0) {
+		b->from = (int64_t *)realloc(b->from, (b->segments + 4096) * sizeof(int64_t));
+		b->to = (int64_t *)realloc(b->to, (b->segments + 4096) * sizeof(int64_t));
+	}
+
+	b->from[b->segments] = from;
+	b->to[b->segments] = to;
+	b->segments++;
+}
+
+static void LinkSegments(struct contourBand *b, struct contourPaths *p)
+{
+	/* Joins the band's segments end to end.  Those starting on an
+	   edge no segment of the band reaches come in from the band
+	   next door, and begin open chains; what is left once they
+	   are followed closes into rings. */
+
+	int64_t base = HorizontalEdge(b->r0, 0), edge;
+	int i, s, pass;
+
+	for (i = 0; i < b->segments; i++) {
+		b->start[b->from[i] - base] = i;
+		b->ends[b->to[i] - base] = 1;
+	}
+
+	for (pass = 0; pass < 2; pass++)
+		for (i = 0; i < b->segments; i++) {
+			if (b->start[b->from[i] - base] != i
+			    || (pass == 0 && b->ends[b->from[i] - base]))
+				continue;
+
+			AddChain(p);
+			AddEdge(p, b->from[i]);
+
+			for (s = i; s >= 0;) {
+				b->start[b->from[s] - base] = -1;
+				edge = b->to[s];
+
+				if (edge == b->from[i]) {
+					p->closed[p->chains - 1] = true;
+					break;
+				}
+
+				AddEdge(p, edge);
+				s = b->start[edge - base];
+			}
+		}
+
+	for (i = 0; i < b->segments; i++)
+		b->ends[b->to[i] - base] = 0;
+
+	if (p->chains > 0)
+		p->first[p->chains] = p->edges;
+}
+
+static void TraceBand(struct contourBand *b)
+{
+	/* Reads the band's rows of the map, then runs marching squares
+	   over its cells at each level and links what it finds */
+
+	int r, c, l, k, n, y;
+	int64_t side[4];
+	uint8_t *row, *next;
+	size_t edges = 2 * (size_t)(b->r1 - b->r0 + 1) * across;
+	double lat, lon;
+
+	b->keys = new uint8_t[(size_t)(b->r1 - b->r0 + 1) * across];
+	b->start = new int[edges];
+	b->ends = new uint8_t[edges];
+	b->from = b->to = NULL;
+
+	memset(b->keys, 0, (size_t)(b->r1 - b->r0 + 1) * across);
+	memset(b->ends, 0, edges);
+
+	for (k = 0; k < (int)edges; k++)
+		b->start[k] = -1;
+
+	for (r = b->r0; r <= b->r1; r++) {
+		y = r - 1;
+
+		if (y < 0 || y >= (int)height)
+			continue;
+
+		lat = (double)max_north - dpp - (dpp * (double)y);
+
+		for (c = 0; c < (int)width; c++) {
+			lon = max_west - (dpp * (double)c);
+
+			if (lon < 0.0)
+				lon += 360.0;
+
+			b->keys[(size_t)(r - b->r0) * across + c + 1] = GetSignal(lat, lon);
+		}
+	}
+
+	for (l = 0; l < levels; l++) {
+		b->segments = 0;
+
+		for (r = b->r0; r < b->r1; r++) {
+			row = b->keys + (size_t)(r - b->r0) * across;
+			next = row + across;
+
+			for (c = 0; c + 1 < across; c++) {
+				n = Inside(row[c], l) | Inside(row[c + 1], l) << 1 |
+				    Inside(next[c + 1], l) << 2 | Inside(next[c], l) << 3;
+
+				if (n == 0 || n == 15)
+					continue;
+
+				side[0] = HorizontalEdge(r, c);
+				side[1] = VerticalEdge(r, c + 1);
+				side[2] = HorizontalEdge(r + 1, c);
+				side[3] = VerticalEdge(r, c);
+
+				for (k = 0; k < 4 && segmentTable[n][k] >= 0; k += 2)
+					AddSegment(b, side[segmentTable[n][k]],
+						   side[segmentTable[n][k + 1]]);
+			}
+		}
+
+		LinkSegments(b, &b->paths[l]);
+	}
+
+	free(b->from);
+	free(b->to);
+	delete [] b->ends;
+	delete [] b->start;
+	delete [] b->keys;
+}
+
+static double SegmentDistance(double x, double y, double x0, double y0,
+			      double x1, double y1)
+{
+	double dx = x1 - x0, dy = y1 - y0, t = 0.0;
+
+	if (dx != 0.0 || dy != 0.0)
+		t = ((x - x0) * dx + (y - y0) * dy) / (dx * dx + dy * dy);
+
+	t = (t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t);
+
+	return sqrt(pow(x - x0 - t * dx, 2.0) + pow(y - y0 - t * dy, 2.0));
+}
+
+static int Simplify(double *lon, double *lat, int n, double tolerance)
+{
+	/* Douglas-Peucker over a ring, in place, from its first vertex
+	   and the one farthest from it.  Returns how many are left,
+	   or n if too few would be left for an area. */
+
+	bool *keep;
+	int *stack, top = 0, a, b, k, far = 0, kept;
+	double d, most = -1.0;
+
+	if (n < 3)
+		return n;
+
+	keep = new bool[(size_t)n];
+	stack = new int[4 * (size_t)n + 4];
+
+	memset(keep, 0, (size_t)n * sizeof(bool));
+
+	for (k = 1; k < n; k++) {
+		d = pow(lon[k] - lon[0], 2.0) + pow(lat[k] - lat[0], 2.0);
+
+		if (d > most) {
+			most = d;
+			far = k;
+		}
+	}
+
+	keep[0] = keep[far] = true;
+	stack[top++] = 0;
+	stack[top++] = far;
+	stack[top++] = far;
+	stack[top++] = n;
+
+	while (top > 0) {
+		b = stack[--top];
+		a = stack[--top];
+
+		for (k = a + 1, far = -1, most = tolerance; k < b; k++) {
+			d = SegmentDistance(lon[k], lat[k], lon[a], lat[a],
+					    lon[b % n], lat[b % n]);
+
+			if (d > most) {
+				most = d;
+				far = k;
+			}
+		}
+
+		if (far >= 0) {
+			keep[far] = true;
+			stack[top++] = a;
+			stack[top++] = far;
+			stack[top++] = far;
+			stack[top++] = b;
+		}
+	}
+
+	for (k = 0, kept = 0; k < n; k++)
+		kept += keep[k];
+
+	if (kept >= 3)
+		for (k = 0, kept = 0; k < n; k++)
+			if (keep[k]) {
+				lon[kept] = lon[k];
+				lat[kept] = lat[k];
+				kept++;
+			}
+
+	delete [] stack;
+	delete [] keep;
+
+	return (kept >= 3 ? kept : n);
+}
+
+static void AddRing(struct contourRings *rings, const int64_t *edge, int n)
+{
+	/* Adds the ring through n edges, simplified to within half a
+	   pixel */
+
+	double *lon, *lat;
+	int k;
+
+	if ((rings->rings & 63) == 0)
+		rings->first = (int *)realloc(rings->first, (rings->rings + 65) * sizeof(int));
+
+	rings->lon = (double *)realloc(rings->lon, (rings->vertices + n) * sizeof(double));
+	rings->lat = (double *)realloc(rings->lat, (rings->vertices + n) * sizeof(double));
+
+	lon = rings->lon + rings->vertices;
+	lat = rings->lat + rings->vertices;
+
+	for (k = 0; k < n; k++)
+		EdgePoint(edge[k], lon + k, lat + k);
+
+	rings->first[rings->rings++] = rings->vertices;
+	rings->vertices += Simplify(lon, lat, n, dpp / 2.0);
+	rings->first[rings->rings] = rings->vertices;
+}
+
+static int CompareHeads(const void *a, const void *b)
+{
+	int64_t p = ((const struct openChain *)a)->head,
+	    q = ((const struct openChain *)b)->head;
+
+	return (p < q ? -1 : p > q ? 1 : 0);
+}
+
+static void StitchRings(struct contourBand *band, int bands, int l,
+			struct contourRings *rings)
+{
+	/* Collects the rings of level l: those closed within a band,
+	   and those made of open chains, each of which ends on the
+	   seam edge the next one starts on */
+
+	struct contourPaths *p;
+	struct openChain *open, key, *next;
+	int i, j, k, opens = 0, count, length = 0, allocated = 0;
+	int64_t *edge = NULL;
+
+	for (i = 0; i < bands; i++)
+		for (j = 0; j < band[i].paths[l].chains; j++)
+			opens += !band[i].paths[l].closed[j];
+
+	open = new struct openChain[opens + 1];
+
+	for (i = 0, k = 0; i < bands; i++) {
+		p = &band[i].paths[l];
+
+		for (j = 0; j < p->chains; j++) {
+			count = p->first[j + 1] - p->first[j];
+
+			if (p->closed[j]) {
+				AddRing(rings, p->edge + p->first[j], count);
+				continue;
+			}
+
+			open[k].head = p->edge[p->first[j]];
+			open[k].tail = p->edge[p->first[j + 1] - 1];
+			open[k].paths = p;
+			open[k].chain = j;
+			open[k].used = false;
+			k++;
+		}
+	}
+
+	qsort(open, opens, sizeof(struct openChain), CompareHeads);
+
+	for (i = 0; i < opens; i++) {
+		if (open[i].used)
+			continue;
+
+		for (next = &open[i], length = 0; next != NULL && !next->used;) {
+			next->used = true;
+			p = next->paths;
+			count = p->first[next->chain + 1] - p->first[next->chain] - 1;
+
+			if (length + count > allocated) {
+				allocated = 2 * (length + count);
+				edge = (int64_t *)realloc(edge, allocated * sizeof(int64_t));
+			}
+
+			memcpy(edge + length, p->edge + p->first[next->chain],
+			       count * sizeof(int64_t));
+			length += count;
+
+			key.head = next->tail;
+			next = (struct openChain *)bsearch(&key, open, opens,
+							   sizeof(struct openChain),
+							   CompareHeads);
+		}
+
+		if (length >= 3)
+			AddRing(rings, edge, length);
+	}
+
+	free(edge);
+	delete [] open;
+}
+
+static double RingArea(struct contourRings *rings, int i)
+{
+	/* Twice the signed area, positive if anticlockwise */
+
+	int k, j, a = rings->first[i], n = rings->first[i + 1] - a;
+	double area = 0.0;
+
+	for (k = 0, j = n - 1; k < n; j = k++)
+		area += (rings->lon[a + j] - rings->lon[a + k]) *
+		    (rings->lat[a + j] + rings->lat[a + k]);
+
+	return area;
+}
+
+static bool InRing(struct contourRings *rings, int i, double lon, double lat)
+{
+	int k, j, a = rings->first[i], n = rings->first[i + 1] - a;
+	bool inside = false;
+	double *x = rings->lon + a, *y = rings->lat + a;
+
+	for (k = 0, j = n - 1; k < n; j = k++)
+		if ((y[k] > lat) != (y[j] > lat)
+		    && lon < x[j] + (x[k] - x[j]) * (lat - y[j]) / (y[k] - y[j]))
+			inside = !inside;
+
+	return inside;
+}
+
+static void WriteRing(FILE *fd, bool kml, struct contourRings *rings, int i)
+{
+	int k, a = rings->first[i], n = rings->first[i + 1] - a;
+
+	for (k = 0; k <= n; k++)
+		fprintf(fd, (kml ? "%s%.6f,%.6f" : "%s[%.6f, %.6f]"),
+			(k == 0 ? "" : kml ? " " : ", "),
+			rings->lon[a + k % n], rings->lat[a + k % n]);
+}
+
+static void WriteLevel(FILE *fd, bool kml, int l, struct contourRings *rings)
+{
+	/* Writes the rings of level l as polygons, each hole with the
+	   smallest outer ring around it */
+
+	const char *units = (mode == CONTOUR_LOSS ? "dB" :
+			     mode == CONTOUR_POWER ? "dBm" : "dBuV/m");
+	double *area = new double[rings->rings + 1];
+	int *parent = new int[rings->rings + 1], i, j, polygons = 0;
+
+	for (i = 0; i < rings->rings; i++) {
+		area[i] = RingArea(rings, i);
+		parent[i] = -1;
+	}
+
+	for (j = 0; j < rings->rings; j++) {
+		if (area[j] >= 0.0)
+			continue;
+
+		for (i = 0; i < rings->rings; i++)
+			if (area[i] > -area[j]
+			    && (parent[j] < 0 || area[i] < area[parent[j]])
+			    && InRing(rings, i, rings->lon[rings->first[j]],
+				      rings->lat[rings->first[j]]))
+				parent[j] = i;
+	}
+
+	if (kml)
+		fprintf(fd, "<Placemark>\n<name>%d %s</name>\n<Style><LineStyle>"
+			"<color>ff%02x%02x%02x</color></LineStyle><PolyStyle>"
+			"<color>80%02x%02x%02x</color></PolyStyle></Style>\n"
+			"<MultiGeometry>\n", level[l], units,
+			colour[l][2], colour[l][1], colour[l][0],
+			colour[l][2], colour[l][1], colour[l][0]);
+	else
+		fprintf(fd, "{\"type\": \"Feature\", \"properties\": {\"level\": %d, "
+			"\"units\": \"%s\", \"fill\": \"#%02x%02x%02x\"}, \"geometry\": "
+			"{\"type\": \"MultiPolygon\", \"coordinates\": [", level[l],
+			units, colour[l][0], colour[l][1], colour[l][2]);
+
+	for (i = 0; i < rings->rings; i++) {
+		if (area[i] <= 0.0)
+			continue;
+
+		if (kml) {
+			fprintf(fd, "<Polygon><outerBoundaryIs><LinearRing><coordinates>");
+			WriteRing(fd, kml, rings, i);
+			fprintf(fd, "</coordinates></LinearRing></outerBoundaryIs>");
+		} else {
+			fprintf(fd, "%s\n[[", (polygons > 0 ? "," : ""));
+			WriteRing(fd, kml, rings, i);
+			fprintf(fd, "]");
+		}
+
+		for (j = 0; j < rings->rings; j++) {
+			if (parent[j] != i)
+				continue;
+
+			if (kml) {
+				fprintf(fd, "<innerBoundaryIs><LinearRing><coordinates>");
+				WriteRing(fd, kml, rings, j);
+				fprintf(fd, "</coordinates></LinearRing></innerBoundaryIs>");
+			} else {
+				fprintf(fd, ", [");
+				WriteRing(fd, kml, rings, j);
+				fprintf(fd, "]");
+			}
+		}
+
+		fprintf(fd, (kml ? "</Polygon>\n" : "]"));
+		polygons++;
+	}
+
+	fprintf(fd, (kml ? "</MultiGeometry>\n</Placemark>\n" : "]}}"));
+
+	delete [] parent;
+	delete [] area;
+}
+
+static bool Weaker(int a, int b)
+{
+	return (mode == CONTOUR_LOSS ? a > b : a < b);
+}
+
+static void AddLevel(int value)
+{
+	/* Adds a level, in the colour a pixel of that value is drawn
+	   in, keeping them weakest first */
+
+	int i, z;
+
+	for (i = 0; i < levels; i++)
+		if (level[i] == value)
+			return;
+
+	if (levels == CONTOUR_LEVELS)
+		return;
+
+	for (i = levels++; i > 0 && Weaker(value, level[i - 1]); i--) {
+		level[i] = level[i - 1];
+		memcpy(colour[i], colour[i - 1], 3);
+	}
+
+	level[i] = value;
+	memset(colour[i], 0, 3);
+
+	for (z = 0; z < region.levels; z++)
+		if (!Weaker(value, region.level[z])) {
+			memcpy(colour[i], region.color[z], 3);
+			break;
+		}
+}
+
+int WriteContours(char *filename, struct site *xmtr)
+{
+	/* Traces the coverage of each level in bands of rows, one to
+	   a thread, then joins up the rings cut by the seams between
+	   the bands and writes them out level by level */
+
+	struct contourBand band[CONTOUR_THREADS];
+	struct contourRings rings;
+	HANDLE threads[CONTOUR_THREADS];
+	int i, l, z, bands, started;
+	size_t length = strlen(filename);
+	bool kml = (length > 4 && (strcmp(filename + length - 4, ".kml") == 0
+				   || strcmp(filename + length - 4, ".KML") == 0));
+	FILE *fd;
+
+	mode = (LR.erp == 0.0 ? CONTOUR_LOSS : dbm ? CONTOUR_POWER :
+		CONTOUR_SIGNAL);
+
+	if (mode == CONTOUR_LOSS && LoadLossColors(xmtr[0]) != 0)
+		fprintf(stderr,"Error loading loss colors\n");
+
+	if (mode == CONTOUR_SIGNAL && LoadSignalColors(xmtr[0]) != 0)
+		fprintf(stderr,"Error loading signal colors\n");
+
+	if (mode == CONTOUR_POWER && LoadDBMColors(xmtr[0]) != 0)
+		fprintf(stderr,"Error loading DBM colors\n");
+
+	/* The levels drawn, and the threshold if it is one more */
+
+	levels = 0;
+
+	for (z = 0; z < region.levels; z++)
+		if (contour_threshold == 0
+		    || (mode == CONTOUR_LOSS ? region.level[z] <= abs(contour_threshold) :
+			region.level[z] >= contour_threshold))
+			AddLevel(region.level[z]);
+
+	if (contour_threshold != 0)
+		AddLevel(mode == CONTOUR_LOSS ? abs(contour_threshold) :
+			 contour_threshold);
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+		return errno;
+
+	across = width + 2;
+	origin_lon = (max_west < 180.0 ? -max_west : 360.0 - max_west);
+
+	BuildTable();
+
+	bands = ((int)height + 1 < CONTOUR_THREADS ? (int)height + 1 : CONTOUR_THREADS);
+
+	for (i = 0; i < bands; i++) {
+		band[i].r0 = ((int)height + 1) * i / bands;
+		band[i].r1 = ((int)height + 1) * (i + 1) / bands;
+		band[i].paths = new struct contourPaths[levels + 1];
+		memset(band[i].paths, 0, (levels + 1) * sizeof(struct contourPaths));
+	}
+
+	for (i = 1, started = 0; i < bands; i++) {
+		threads[started] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ TraceBand((struct contourBand*)arg); return 0; }, &band[i], 0, 0);
+		if (threads[started] == nullptr)
+			TraceBand(&band[i]);
+		else
+			++started;
+	}
+
+	TraceBand(&band[0]);
+
+	for (i = 0; i < started; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+
+	if (kml)
+		fprintf(fd, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Document>\n"
+			"<name>%s</name>\n", xmtr[0].name);
+	else
+		fprintf(fd, "{\"type\": \"FeatureCollection\", \"features\": [\n");
+
+	for (l = 0; l < levels; l++) {
+		memset(&rings, 0, sizeof(rings));
+		StitchRings(band, bands, l, &rings);
+
+		if (!kml && l > 0)
+			fprintf(fd, ",\n");
+
+		WriteLevel(fd, kml, l, &rings);
+
+		free(rings.lon);
+		free(rings.lat);
+		free(rings.first);
+	}
+
+	fprintf(fd, (kml ? "</Document>\n</kml>\n" : "\n]}\n"));
+
+	for (i = 0; i < bands; i++) {
+		for (l = 0; l < levels; l++) {
+			free(band[i].paths[l].edge);
+			free(band[i].paths[l].first);
+			free(band[i].paths[l].closed);
+		}
+
+		delete [] band[i].paths;
+	}
+
+	if (debug)
+		fprintf(stderr, "\nWrote %d contour levels to \"%s\"\n", levels, filename);
+
+	if (fclose(fd) != 0)
+		return errno;
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _CONTOURS_HH_
+#define _CONTOURS_HH_
+
+#include "common.h"
+
+/* The coverage of the map as polygons rather than pixels: for each
+   level of the region table in use (or the -rt threshold), the area
+   where the signal is at least that good, traced with marching
+   squares through the pixel centres and simplified to within half a
+   pixel.  Polygons are in WGS84 degrees, outer rings anticlockwise
+   and holes clockwise, one feature or placemark per level, weakest
+   first.  A file name ending .kml is written as KML, anything else
+   as GeoJSON. */
+
+int WriteContours(char *filename, struct site *xmtr);
+
+#endif /* _CONTOURS_HH_ */
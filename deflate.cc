@@ -0,0 +1,256 @@
+/*
+ * A small deflate (RFC 1951) encoder of our own for the image and
+ * raster writers: greedy LZ77 over a 32K window with hash chains,
+ * sent with the fixed Huffman codes, which does well on the long
+ * runs of flat colour and no-data that coverage maps are made of.
+ *
+ * deflate_block() ends each piece byte aligned on an empty stored
+ * block unless it is the last, so pieces deflated apart (and on
+ * other threads) can simply be joined, as pigz does.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include "deflate.hh"
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_CHAIN 32		/* Matches tried per position */
+#define DEFLATE_MAX_MATCH 258
+
+static uint16_t fixed_code[288];	/* Bit reversed, as deflate sends them */
+static uint8_t fixed_length[288];
+
+static const uint16_t length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+	35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,
+	3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const uint16_t distance_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+	257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const uint8_t distance_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,
+	7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static uint16_t reverse(uint16_t code, int length){
+	uint16_t out = 0;
+	while(length-- > 0){
+		out = (out << 1) | (code & 1);
+		code >>= 1;
+	}
+	return out;
+}
+
+static std::once_flag tables_once;
+
+static void build_tables(){
+	int n;
+
+	/* The fixed Huffman codes of RFC 1951 3.2.6 */
+	for(n = 0; n < 288; n++){
+		if(n < 144){
+			fixed_length[n] = 8;
+			fixed_code[n] = reverse(0x30 + n, 8);
+		}else if(n < 256){
+			fixed_length[n] = 9;
+			fixed_code[n] = reverse(0x190 + n - 144, 9);
+		}else if(n < 280){
+			fixed_length[n] = 7;
+			fixed_code[n] = reverse(n - 256, 7);
+		}else{
+			fixed_length[n] = 8;
+			fixed_code[n] = reverse(0xc0 + n - 280, 8);
+		}
+	}
+}
+
+/*
+ * deflate_tables
+ * Builds the code tables. Must be called before any
+ * encoding; threads calling it together build them once
+ */
+void deflate_tables(){
+	std::call_once(tables_once, build_tables);
+}
+
+uint32_t deflate_adler32(uint32_t adler, const uint8_t *data, size_t length){
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	size_t n;
+
+	while(length > 0){
+		/* The most that can be summed before b overflows */
+		n = length < 5552 ? length : 5552;
+		length -= n;
+		while(n-- > 0){
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return a | (b << 16);
+}
+
+uint32_t deflate_adler32_combine(uint32_t adler1, uint32_t adler2, size_t length2){
+	/* The checksum of two runs of data from theirs, as zlib has it */
+	uint32_t sum1, sum2, rem;
+
+	rem = (uint32_t)(length2 % 65521);
+	sum1 = adler1 & 0xffff;
+	sum2 = (rem * sum1) % 65521;
+	sum1 += (adler2 & 0xffff) + 65521 - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+	if(sum1 >= 65521) sum1 -= 65521;
+	if(sum1 >= 65521) sum1 -= 65521;
+	if(sum2 >= 65521 * 2) sum2 -= 65521 * 2;
+	if(sum2 >= 65521) sum2 -= 65521;
+	return sum1 | (sum2 << 16);
+}
+
+void deflate_byte(deflate_buf_t *w, uint8_t byte){
+	uint8_t *grown;
+
+	if(w->size == w->alloc){
+		w->alloc = w->alloc ? w->alloc * 2 : 65536;
+		if((grown = (uint8_t*)realloc(w->buf,w->alloc)) == NULL){
+			w->failed = 1;
+			w->size = 0;
+			return;
+		}
+		w->buf = grown;
+	}
+	w->buf[w->size++] = byte;
+}
+
+static void put_bits(deflate_buf_t *w, uint32_t value, int count){
+	w->bits |= (uint64_t)value << w->count;
+	w->count += count;
+	while(w->count >= 8){
+		deflate_byte(w,(uint8_t)w->bits);
+		w->bits >>= 8;
+		w->count -= 8;
+	}
+}
+
+static void put_align(deflate_buf_t *w){
+	if(w->count > 0)
+		put_bits(w,0,8 - w->count);
+}
+
+static void put_match(deflate_buf_t *w, int length, int distance){
+	int code;
+
+	for(code = 28; length_base[code] > length; code--);
+	put_bits(w,fixed_code[257 + code],fixed_length[257 + code]);
+	put_bits(w,length - length_base[code],length_extra[code]);
+
+	for(code = 29; distance_base[code] > distance; code--);
+	put_bits(w,reverse(code,5),5);
+	put_bits(w,distance - distance_base[code],distance_extra[code]);
+}
+
+static void deflate_fixed(deflate_buf_t *w, const uint8_t *in, size_t length){
+	/* Greedy LZ77 with hash chains, sent as fixed Huffman codes */
+	int32_t *head, *prev, candidate, next;
+	size_t i, j, limit, best, found, distance = 0, chain;
+	uint32_t hash;
+
+	head = (int32_t*)malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+	prev = (int32_t*)malloc(sizeof(int32_t) * DEFLATE_WINDOW);
+	if(head == NULL || prev == NULL){
+		free(head);
+		free(prev);
+		w->failed = 1;
+		return;
+	}
+	memset(head,0xff,sizeof(int32_t) << DEFLATE_HASH_BITS);
+
+#define DEFLATE_HASH(p) ((((uint32_t)(p)[0] << 10) ^ ((uint32_t)(p)[1] << 5) ^ (p)[2]) & ((1 << DEFLATE_HASH_BITS) - 1))
+
+	for(i = 0; i < length;){
+		best = 0;
+
+		if(i + 3 <= length){
+			limit = length - i < DEFLATE_MAX_MATCH ? length - i : DEFLATE_MAX_MATCH;
+			hash = DEFLATE_HASH(in + i);
+
+			for(candidate = head[hash], chain = DEFLATE_CHAIN;
+			    candidate >= 0 && i - candidate <= DEFLATE_WINDOW && chain > 0; chain--){
+				if(in[candidate + best] == in[i + best]){
+					for(found = 0; found < limit && in[candidate + found] == in[i + found]; found++);
+					if(found > best){
+						best = found;
+						distance = i - candidate;
+						if(best == limit)
+							break;
+					}
+				}
+				next = prev[candidate & (DEFLATE_WINDOW - 1)];
+				if(next >= candidate)
+					break;
+				candidate = next;
+			}
+
+			prev[i & (DEFLATE_WINDOW - 1)] = head[hash];
+			head[hash] = (int32_t)i;
+		}
+
+		if(best < 3){
+			put_bits(w,fixed_code[in[i]],fixed_length[in[i]]);
+			i++;
+			continue;
+		}
+
+		put_match(w,(int)best,(int)distance);
+
+		for(j = i + 1, i += best; j < i && j + 3 <= length; j++){
+			hash = DEFLATE_HASH(in + j);
+			prev[j & (DEFLATE_WINDOW - 1)] = head[hash];
+			head[hash] = (int32_t)j;
+		}
+	}
+
+#undef DEFLATE_HASH
+
+	free(head);
+	free(prev);
+}
+
+/*
+ * deflate_block
+ * Appends length bytes of in to w as one fixed Huffman block,
+ * the final one of the stream if last is set. Matches never
+ * reach back before in.
+ */
+void deflate_block(deflate_buf_t *w, const uint8_t *in, size_t length, int last){
+	put_bits(w,last ? 1 : 0,1);
+	put_bits(w,1,2);		/* Fixed Huffman codes */
+	deflate_fixed(w,in,length);
+	put_bits(w,fixed_code[256],fixed_length[256]);
+
+	if(!last){
+		/* An empty stored block, leaving the next byte aligned */
+		put_bits(w,0,3);
+		put_align(w);
+		deflate_byte(w,0x00);
+		deflate_byte(w,0x00);
+		deflate_byte(w,0xff);
+		deflate_byte(w,0xff);
+	}else
+		put_align(w);
+}
+
+/*
+ * deflate_zlib
+ * Appends in to w as a whole zlib (RFC 1950) stream
+ */
+void deflate_zlib(deflate_buf_t *w, const uint8_t *in, size_t length){
+	uint32_t adler = deflate_adler32(1,in,length);
+
+	deflate_byte(w,0x78);	/* Deflate, 32K window */
+	deflate_byte(w,0x01);
+	deflate_block(w,in,length,1);
+	deflate_byte(w,(uint8_t)(adler >> 24));
+	deflate_byte(w,(uint8_t)(adler >> 16));
+	deflate_byte(w,(uint8_t)(adler >> 8));
+	deflate_byte(w,(uint8_t)adler);
+}
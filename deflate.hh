@@ -0,0 +1,23 @@
+#ifndef _DEFLATE_HH
+#define _DEFLATE_HH
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Output of the encoder, and the bits not yet whole bytes of it */
+typedef struct _deflate_buf{
+	uint8_t *buf;
+	size_t size, alloc;
+	uint64_t bits;
+	int count;
+	int failed;	/* Set if the buffer could not grow */
+} deflate_buf_t;
+
+void deflate_tables();
+uint32_t deflate_adler32(uint32_t adler, const uint8_t *data, size_t length);
+uint32_t deflate_adler32_combine(uint32_t adler1, uint32_t adler2, size_t length2);
+void deflate_byte(deflate_buf_t *w, uint8_t byte);
+void deflate_block(deflate_buf_t *w, const uint8_t *in, size_t length, int last);
+void deflate_zlib(deflate_buf_t *w, const uint8_t *in, size_t length);
+
+#endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "main.hh"
+#include "geotiff.hh"
+#include "lossmap.hh"
+#include "deflate.hh"
+#include "models/los.hh"
+
+#define TIFF_ASCII 2
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_DOUBLE 12
+
+#define GEOTIFF_NODATA_INT16 (-32768)
+
+struct tiffEntry {
+	uint16_t tag;
+	uint16_t type;
+	uint32_t count;
+	const void *data;
+};
+
+static size_t TypeSize(int type)
+{
+	return (type == TIFF_DOUBLE ? 8 : type == TIFF_LONG ? 4 :
+		type == TIFF_SHORT ? 2 : 1);
+}
+
+static void PackTile(const float *band, int tx, bool compact,
+		     bool compress, uint8_t *tile)
+{
+	/* Copies tile tx of a band of GEOTIFF_TILE rows into tile,
+	   as stored: float32 or int16, padded with no data past the
+	   east edge, and run through the predictor if compressed.
+	   Floats use predictor 3, each row split into byte planes,
+	   most significant first, then differenced; int16 uses
+	   predictor 2, the difference from the sample to the west. */
+
+	int x, y, k, n = GEOTIFF_TILE, column;
+	float value, *floats = (float *)tile;
+	int16_t *packed = (int16_t *)tile;
+	uint8_t *row, planes[GEOTIFF_TILE * sizeof(float)];
+
+	for (y = 0; y < n; y++) {
+		for (x = 0; x < n; x++) {
+			column = tx * n + x;
+			value = (column < (int)width ? band[y * width + column] : NAN);
+
+			if (!compact)
+				floats[y * n + x] = value;
+
+			else if (value != value || fabs(value) >= 3276.7)
+				packed[y * n + x] = GEOTIFF_NODATA_INT16;
+
+			else
+				packed[y * n + x] = (int16_t)rint(value * 10.0);
+		}
+
+		if (!compress)
+			continue;
+
+		if (compact) {
+			for (x = n - 1; x > 0; x--)
+				packed[y * n + x] = (int16_t)(packed[y * n + x] -
+							      packed[y * n + x - 1]);
+			continue;
+		}
+
+		row = tile + y * n * sizeof(float);
+
+		for (x = 0; x < n; x++)
+			for (k = 0; k < (int)sizeof(float); k++)
+				planes[(sizeof(float) - 1 - k) * n + x] =
+				    row[x * sizeof(float) + k];
+
+		for (x = n * sizeof(float) - 1; x > 0; x--)
+			planes[x] -= planes[x - 1];
+
+		memcpy(row, planes, sizeof(planes));
+	}
+}
+
+static int WriteIFD(FILE *fd, struct tiffEntry *entry, int entries)
+{
+	/* Writes the directory of entries at the (word aligned) end
+	   of fd, values that do not fit in an entry after it, and
+	   points the header at it */
+
+	uint32_t offset, data, value;
+	uint16_t count = (uint16_t)entries;
+	size_t size;
+	int i;
+
+	if (ftell(fd) & 1)
+		fputc(0, fd);
+
+	offset = (uint32_t)ftell(fd);
+	data = offset + 2 + entries * 12 + 4;
+
+	fwrite(&count, sizeof(count), 1, fd);
+
+	for (i = 0; i < entries; i++) {
+		size = entry[i].count * TypeSize(entry[i].type);
+
+		fwrite(&entry[i].tag, sizeof(uint16_t), 1, fd);
+		fwrite(&entry[i].type, sizeof(uint16_t), 1, fd);
+		fwrite(&entry[i].count, sizeof(uint32_t), 1, fd);
+
+		value = 0;
+
+		if (size <= 4)
+			memcpy(&value, entry[i].data, size);
+		else {
+			value = data;
+			data += (uint32_t)((size + 1) & ~(size_t)1);
+		}
+
+		fwrite(&value, sizeof(value), 1, fd);
+	}
+
+	value = 0;	/* No further directory */
+	fwrite(&value, sizeof(value), 1, fd);
+
+	for (i = 0; i < entries; i++) {
+		size = entry[i].count * TypeSize(entry[i].type);
+
+		if (size > 4) {
+			fwrite(entry[i].data, 1, size, fd);
+
+			if (size & 1)
+				fputc(0, fd);
+		}
+	}
+
+	fseek(fd, 4, SEEK_SET);
+	fwrite(&offset, sizeof(offset), 1, fd);
+
+	return (ferror(fd) ? EIO : 0);
+}
+
+int WriteGeoTIFF(char *filename, bool compact, bool compress)
+{
+	/* Writes what the map shows, from the loss map, which must
+	   have been allocated before the sweep, as a GeoTIFF.  A row
+	   of tiles is held at a time. */
+
+	static const char magic[4] = {'I', 'I', 42, 0};
+	int across, down, tx, ty, y, x, i, result = 0;
+	uint32_t *offsets, *counts, zero = 0;
+	size_t sample = (compact ? sizeof(int16_t) : sizeof(float)),
+	    tile_size = (size_t)GEOTIFF_TILE * GEOTIFF_TILE * sample;
+	float *band;
+	uint8_t *tile;
+	deflate_buf_t packed;
+	double lon, scale[3], tiepoint[6];
+	FILE *fd;
+
+	uint16_t bits = (uint16_t)(8 * sample), compression = (compress ? 8 : 1),
+	    photometric = 1, one = 1, predictor = (compact ? 2 : 3),
+	    format = (compact ? 2 : 3);
+	uint32_t tiff_width = width, tiff_height = height,
+	    tile_side = GEOTIFF_TILE;
+	const char *description = (LR.erp == 0.0 ? "Path loss (dB)" :
+				   dbm ? "Received power (dBm)" :
+				   "Field strength (dBuV/m)"),
+	    *nodata = (compact ? "-32768" : "nan"),
+	    *metadata = "<GDALMetadata><Item name=\"SCALE\" sample=\"0\" "
+	    "role=\"scale\">0.1</Item></GDALMetadata>";
+
+	/* Geographic WGS84, each pixel an area */
+
+	uint16_t geokeys[16] = {1, 1, 0, 3,
+		1024, 0, 1, 2,		/* GTModelType: geographic */
+		1025, 0, 1, 1,		/* GTRasterType: pixel is area */
+		2048, 0, 1, 4326	/* GeographicType: WGS 84 */
+	};
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+		return errno;
+
+	across = (width + GEOTIFF_TILE - 1) / GEOTIFF_TILE;
+	down = (height + GEOTIFF_TILE - 1) / GEOTIFF_TILE;
+
+	offsets = new uint32_t[across * down];
+	counts = new uint32_t[across * down];
+	band = new float[(size_t)GEOTIFF_TILE * width];
+	tile = new uint8_t[tile_size];
+
+	fwrite(magic, sizeof(magic), 1, fd);
+	fwrite(&zero, sizeof(zero), 1, fd);	/* Directory offset, once known */
+
+	deflate_tables();
+
+	for (ty = 0; ty < down && result == 0; ty++) {
+		for (y = 0; y < GEOTIFF_TILE; y++) {
+			if (ty * GEOTIFF_TILE + y >= (int)height) {
+				for (x = 0; x < (int)width; x++)
+					band[y * width + x] = NAN;
+				continue;
+			}
+
+			LossMapRow(ty * GEOTIFF_TILE + y, band + y * width);
+
+			for (x = 0; x < (int)width; x++)
+				if (band[y * width + x] == band[y * width + x])
+					band[y * width + x] =
+					    (float)SignalValue(band[y * width + x],
+							       LR.frq_mhz);
+		}
+
+		for (tx = 0; tx < across && result == 0; tx++) {
+			i = ty * across + tx;
+			offsets[i] = (uint32_t)ftell(fd);
+
+			PackTile(band, tx, compact, compress, tile);
+
+			if (!compress) {
+				counts[i] = (uint32_t)tile_size;
+				fwrite(tile, 1, tile_size, fd);
+				continue;
+			}
+
+			memset(&packed, 0, sizeof(packed));
+			deflate_zlib(&packed, tile, tile_size);
+
+			if (packed.failed)
+				result = ENOMEM;
+			else {
+				counts[i] = (uint32_t)packed.size;
+				fwrite(packed.buf, 1, packed.size, fd);
+			}
+
+			free(packed.buf);
+		}
+	}
+
+	/* The north west corner of pixel (0, 0), which LossMapRow()
+	   samples at its centre: max_north - dpp, max_west */
+
+	lon = (max_west < 180.0 ? -max_west : 360.0 - max_west);
+
+	scale[0] = scale[1] = dpp;
+	scale[2] = 0.0;
+
+	tiepoint[0] = tiepoint[1] = tiepoint[2] = tiepoint[5] = 0.0;
+	tiepoint[3] = lon - dpp / 2.0;
+	tiepoint[4] = max_north - dpp / 2.0;
+
+	struct tiffEntry entry[] = {
+		{256, TIFF_LONG, 1, &tiff_width},	/* ImageWidth */
+		{257, TIFF_LONG, 1, &tiff_height},	/* ImageLength */
+		{258, TIFF_SHORT, 1, &bits},		/* BitsPerSample */
+		{259, TIFF_SHORT, 1, &compression},	/* 1: none, 8: deflate */
+		{262, TIFF_SHORT, 1, &photometric},	/* BlackIsZero */
+		{270, TIFF_ASCII, (uint32_t)strlen(description) + 1, description},
+		{277, TIFF_SHORT, 1, &one},		/* SamplesPerPixel */
+		{284, TIFF_SHORT, 1, &one},		/* PlanarConfiguration */
+		{317, TIFF_SHORT, 1, &predictor},	/* Predictor */
+		{322, TIFF_LONG, 1, &tile_side},	/* TileWidth */
+		{323, TIFF_LONG, 1, &tile_side},	/* TileLength */
+		{324, TIFF_LONG, (uint32_t)(across * down), offsets},
+		{325, TIFF_LONG, (uint32_t)(across * down), counts},
+		{339, TIFF_SHORT, 1, &format},		/* SampleFormat */
+		{33550, TIFF_DOUBLE, 3, scale},		/* ModelPixelScale */
+		{33922, TIFF_DOUBLE, 6, tiepoint},	/* ModelTiepoint */
+		{34735, TIFF_SHORT, 16, geokeys},	/* GeoKeyDirectory */
+		{42112, TIFF_ASCII, (uint32_t)strlen(metadata) + 1, metadata},
+		{42113, TIFF_ASCII, (uint32_t)strlen(nodata) + 1, nodata}
+	};
+	int entries = sizeof(entry) / sizeof(entry[0]);
+
+	/* Only a compressed image has a predictor, and only an int16
+	   one a scale */
+
+	for (i = 0, x = 0; i < entries; i++)
+		if ((entry[i].tag != 317 || compress)
+		    && (entry[i].tag != 42112 || compact))
+			entry[x++] = entry[i];
+
+	if (result == 0)
+		result = WriteIFD(fd, entry, x);
+
+	delete [] tile;
+	delete [] band;
+	delete [] counts;
+	delete [] offsets;
+
+	if (fclose(fd) != 0 && result == 0)
+		result = errno;
+
+	return result;
+}
@@ -0,0 +1,19 @@
+#ifndef _GEOTIFF_HH_
+#define _GEOTIFF_HH_
+
+#include "common.h"
+
+/* A GeoTIFF of what the map shows (path loss in dB, or received
+   power in dBm, or field strength in dBuV/m) as numbers rather than
+   colours, over the same area: WGS84 degrees, north up, the first
+   pixel at the map's north west corner.  Samples are float32 with
+   NaN where nothing was predicted or, compacted, int16 of 0.1 dB
+   with -32768 for none.  Tiles are 256 pixels square, optionally
+   deflated with a predictor, and written as soon as their row of
+   tiles is done. */
+
+#define GEOTIFF_TILE 256
+
+int WriteGeoTIFF(char *filename, bool compact, bool compress);
+
+#endif /* _GEOTIFF_HH_ */
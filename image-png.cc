@@ -0,0 +1,503 @@
+/*
+ * Built-in PNG output. Rows are gathered into blocks, each block
+ * is filtered and deflated on its own thread, and the blocks go
+ * out as IDAT chunks in order as they are done, so that a
+ * streamed image never holds more than PNG_BLOCKS of them.
+ *
+ * The blocks are deflated apart with the encoder in deflate.cc
+ * and simply joined, their Adler-32 sums combined.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <mutex>
+#include "image.hh"
+#include "deflate.hh"
+#include <Windows.h>
+
+#define PNG_BLOCK_ROWS 64	/* Rows deflated as one block */
+#define PNG_BLOCKS 4		/* Blocks deflated at once, a thread each */
+#define PNG_COLOURS 4096	/* Colour to palette index cache */
+
+typedef struct _png_state{
+	int colour_type;	/* 2: RGB, 6: RGBA, 3: palette */
+	size_t pixel;		/* Bytes per pixel as added, RGB or RGBA */
+	size_t bpp;		/* Bytes per pixel as stored */
+	size_t stride;		/* Bytes per row as stored, without the filter */
+	uint8_t palette[256 * RGBA_SIZE];	/* Opaque unless given as RGBA */
+	int colours;
+	uint64_t cache_key[PNG_COLOURS];	/* RGBA | 1 << 32 when used */
+	uint8_t cache_index[PNG_COLOURS];
+	int cached;
+	uint8_t *rows;		/* The rows of the blocks being gathered */
+	uint8_t *prior;		/* The row before them, zero at first */
+	size_t held;		/* Whole rows in rows[] */
+	size_t fill;		/* Pixels of the row being added */
+	size_t done;		/* Rows deflated */
+	uint32_t adler;
+	int header;		/* Whether the signature to PLTE went out */
+	uint8_t *kept;		/* Output kept for image_write without a stream */
+	size_t kept_size, kept_alloc;
+} png_state_t;
+
+typedef struct _png_block{
+	const uint8_t *rows;
+	const uint8_t *prior;
+	size_t count, stride, bpp;
+	int filter;		/* Choose a filter per row, else none */
+	int first, last;	/* First and last block of the image */
+	deflate_buf_t out;
+	uint32_t adler;
+	size_t length;		/* Filtered bytes */
+} png_block_t;
+
+#define PNG_STATE(ctx) ((png_state_t*)(ctx)->_state)
+
+static uint32_t crc_table[256];
+static std::once_flag crc_once;
+
+static void crc_tables(){
+	uint32_t c;
+	int n, k;
+
+	for(n = 0; n < 256; n++){
+		c = (uint32_t)n;
+		for(k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static void png_tables(){
+	/* Tiles may start their first PNGs on several threads at once */
+	deflate_tables();
+	std::call_once(crc_once, crc_tables);
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length){
+	crc ^= 0xffffffff;
+	while(length-- > 0)
+		crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static void filter_row(uint8_t *out, const uint8_t *row, const uint8_t *above, size_t stride, size_t bpp, int choose){
+	/* None for palettes, as the PNG spec advises; else whichever
+	   of None, Sub and Up has the least sum of absolute values */
+	unsigned long sum[3] = {0, 0, 0};
+	size_t x;
+	int filter = 0;
+
+	if(choose){
+		for(x = 0; x < stride; x++){
+			sum[0] += abs((int8_t)row[x]);
+			sum[1] += abs((int8_t)(row[x] - (x >= bpp ? row[x - bpp] : 0)));
+			sum[2] += abs((int8_t)(row[x] - above[x]));
+		}
+		filter = sum[1] < sum[0] ? 1 : 0;
+		if(sum[2] < sum[filter])
+			filter = 2;
+	}
+
+	out[0] = (uint8_t)filter;
+	for(x = 0; x < stride; x++)
+		out[x + 1] = (uint8_t)(filter == 0 ? row[x] : filter == 1 ?
+			row[x] - (x >= bpp ? row[x - bpp] : 0) : row[x] - above[x]);
+}
+
+static void png_deflate(png_block_t *b){
+	uint8_t *filtered;
+	const uint8_t *above;
+	size_t y;
+
+	b->length = b->count * (b->stride + 1);
+	if((filtered = (uint8_t*)malloc(b->length)) == NULL){
+		b->out.failed = 1;
+		return;
+	}
+
+	for(y = 0, above = b->prior; y < b->count; above = b->rows + y * b->stride, y++)
+		filter_row(filtered + y * (b->stride + 1),b->rows + y * b->stride,above,b->stride,b->bpp,b->filter);
+
+	b->adler = deflate_adler32(1,filtered,b->length);
+
+	if(b->first){
+		deflate_byte(&b->out,0x78);	/* Deflate, 32K window */
+		deflate_byte(&b->out,0x01);
+	}
+
+	deflate_block(&b->out,filtered,b->length,b->last);
+
+	free(filtered);
+}
+
+static int png_emit(image_ctx_t *ctx, const uint8_t *data, size_t length){
+	png_state_t *s = PNG_STATE(ctx);
+	uint8_t *grown;
+	size_t alloc;
+
+	if(ctx->stream != NULL)
+		return fwrite(data,sizeof(uint8_t),length,ctx->stream) < length ? EPIPE : 0;
+
+	if(s->kept_size + length > s->kept_alloc){
+		for(alloc = s->kept_alloc ? s->kept_alloc : 65536; alloc < s->kept_size + length; alloc *= 2);
+		if((grown = (uint8_t*)realloc(s->kept,alloc)) == NULL)
+			return ENOMEM;
+		s->kept = grown;
+		s->kept_alloc = alloc;
+	}
+	memcpy(s->kept + s->kept_size,data,length);
+	s->kept_size += length;
+	return 0;
+}
+
+static int png_chunk(image_ctx_t *ctx, const char *type, const uint8_t *data, size_t length){
+	uint8_t head[8], tail[4];
+	uint32_t crc;
+	int success;
+
+	head[0] = (uint8_t)(length >> 24);
+	head[1] = (uint8_t)(length >> 16);
+	head[2] = (uint8_t)(length >> 8);
+	head[3] = (uint8_t)length;
+	memcpy(head + 4,type,4);
+
+	crc = crc32(crc32(0,head + 4,4),data,length);
+	tail[0] = (uint8_t)(crc >> 24);
+	tail[1] = (uint8_t)(crc >> 16);
+	tail[2] = (uint8_t)(crc >> 8);
+	tail[3] = (uint8_t)crc;
+
+	if((success = png_emit(ctx,head,8)) != 0 ||
+	   (length > 0 && (success = png_emit(ctx,data,length)) != 0))
+		return success;
+	return png_emit(ctx,tail,4);
+}
+
+static int png_header(image_ctx_t *ctx){
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	png_state_t *s = PNG_STATE(ctx);
+	uint8_t ihdr[13], colours[256 * RGB_SIZE], alphas[256];
+	int success, i, last;
+
+	if(s->header)
+		return 0;
+	s->header = 1;
+
+	ihdr[0] = (uint8_t)(ctx->width >> 24);
+	ihdr[1] = (uint8_t)(ctx->width >> 16);
+	ihdr[2] = (uint8_t)(ctx->width >> 8);
+	ihdr[3] = (uint8_t)ctx->width;
+	ihdr[4] = (uint8_t)(ctx->height >> 24);
+	ihdr[5] = (uint8_t)(ctx->height >> 16);
+	ihdr[6] = (uint8_t)(ctx->height >> 8);
+	ihdr[7] = (uint8_t)ctx->height;
+	ihdr[8] = 8;			/* Bit depth */
+	ihdr[9] = (uint8_t)s->colour_type;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;	/* Deflate, adaptive filters, no interlace */
+
+	if((success = png_emit(ctx,signature,8)) != 0 ||
+	   (success = png_chunk(ctx,"IHDR",ihdr,13)) != 0)
+		return success;
+
+	if(s->colour_type != 3)
+		return 0;
+
+	/* PLTE takes the colours, tRNS the alphas up to the last
+	   entry that is not opaque */
+	for(i = 0, last = 0; i < s->colours; i++){
+		memcpy(colours + i * RGB_SIZE,s->palette + i * RGBA_SIZE,RGB_SIZE);
+		alphas[i] = s->palette[i * RGBA_SIZE + 3];
+		if(alphas[i] != 0xff)
+			last = i + 1;
+	}
+
+	if((success = png_chunk(ctx,"PLTE",colours,s->colours * RGB_SIZE)) != 0 || last == 0)
+		return success;
+	return png_chunk(ctx,"tRNS",alphas,last);
+}
+
+static uint64_t png_key(png_state_t *s, const uint8_t *pixel){
+	return (uint64_t)pixel[0] << 24 | (uint64_t)pixel[1] << 16 | (uint64_t)pixel[2] << 8 |
+		(s->pixel == RGBA_SIZE ? pixel[3] : 0xff) | (uint64_t)1 << 32;
+}
+
+static uint32_t png_slot(png_state_t *s, uint64_t key){
+	/* The cache slot holding key, or the empty one it would go in */
+	uint32_t slot = ((uint32_t)key * 2654435761u) >> 20;
+
+	while(s->cache_key[slot] != 0 && s->cache_key[slot] != key)
+		slot = (slot + 1) & (PNG_COLOURS - 1);
+	return slot;
+}
+
+static void png_cache(png_state_t *s, const uint8_t *pixel, uint8_t index){
+	uint64_t key = png_key(s,pixel);
+	uint32_t slot = png_slot(s,key);
+
+	/* Keep the cache at most half full, so that lookups stay short */
+	if(s->cache_key[slot] == 0 && s->cached < PNG_COLOURS / 2){
+		s->cache_key[slot] = key;
+		s->cache_index[slot] = index;
+		s->cached++;
+	}
+}
+
+static uint8_t png_index(png_state_t *s, const uint8_t *pixel){
+	/* The palette entry of a colour, or the nearest if it is
+	   missing from the palette, which it shouldn't be */
+	uint64_t key = png_key(s,pixel);
+	uint32_t slot = png_slot(s,key);
+	long distance, nearest = -1;
+	int i, k, d;
+	uint8_t index = 0;
+
+	if(s->cache_key[slot] == key)
+		return s->cache_index[slot];
+
+	for(i = 0; i < s->colours && nearest != 0; i++){
+		for(k = 0, distance = 0; k < (int)s->pixel; k++){
+			d = s->palette[i * RGBA_SIZE + k] - pixel[k];
+			distance += (long)d * d;
+		}
+		if(nearest < 0 || distance < nearest){
+			nearest = distance;
+			index = (uint8_t)i;
+		}
+	}
+
+	png_cache(s,pixel,index);
+	return index;
+}
+
+static int png_flush(image_ctx_t *ctx){
+	/* Deflates the rows held, a block per thread, and emits them */
+	png_state_t *s = PNG_STATE(ctx);
+	png_block_t block[PNG_BLOCKS];
+	HANDLE threads[PNG_BLOCKS];
+	int blocks, i, started, success;
+
+	if(s->held == 0)
+		return 0;
+
+	if((success = png_header(ctx)) != 0)
+		return success;
+
+	blocks = (int)((s->held + PNG_BLOCK_ROWS - 1) / PNG_BLOCK_ROWS);
+
+	for(i = 0; i < blocks; i++){
+		memset(&block[i],0x00,sizeof(png_block_t));
+		block[i].rows = s->rows + (size_t)i * PNG_BLOCK_ROWS * s->stride;
+		block[i].prior = i == 0 ? s->prior : block[i].rows - s->stride;
+		block[i].count = s->held - (size_t)i * PNG_BLOCK_ROWS < PNG_BLOCK_ROWS ?
+			s->held - (size_t)i * PNG_BLOCK_ROWS : PNG_BLOCK_ROWS;
+		block[i].stride = s->stride;
+		block[i].bpp = s->bpp;
+		block[i].filter = s->colour_type != 3;
+		block[i].first = s->done == 0 && i == 0;
+		block[i].last = s->done + s->held == ctx->height && i == blocks - 1;
+	}
+
+	for(i = 1, started = 0; i < blocks; i++){
+		threads[started] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ png_deflate((png_block_t*)arg); return 0; }, &block[i], 0, 0);
+		if(threads[started] == nullptr)
+			png_deflate(&block[i]);
+		else
+			++started;
+	}
+
+	png_deflate(&block[0]);
+
+	for(i = 0; i < started; i++){
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+
+	for(i = 0; i < blocks; i++){
+		if(success == 0 && block[i].out.failed)
+			success = ENOMEM;
+
+		if(success == 0){
+			s->adler = deflate_adler32_combine(s->adler,block[i].adler,block[i].length);
+
+			if(block[i].last){
+				deflate_byte(&block[i].out,(uint8_t)(s->adler >> 24));
+				deflate_byte(&block[i].out,(uint8_t)(s->adler >> 16));
+				deflate_byte(&block[i].out,(uint8_t)(s->adler >> 8));
+				deflate_byte(&block[i].out,(uint8_t)s->adler);
+			}
+
+			success = png_chunk(ctx,"IDAT",block[i].out.buf,block[i].out.size);
+		}
+
+		free(block[i].out.buf);
+	}
+
+	memcpy(s->prior,s->rows + (s->held - 1) * s->stride,s->stride);
+	s->done += s->held;
+	s->held = 0;
+
+	return success;
+}
+
+int png_init(image_ctx_t *ctx){
+	png_state_t *s;
+
+	if(ctx->canvas != NULL)
+		return EINVAL;
+	ctx->format = IMAGE_PNG;
+	ctx->extension = (char*)".png";
+
+	png_tables();
+
+	if((s = (png_state_t*)calloc(1,sizeof(png_state_t))) == NULL)
+		return ENOMEM;
+	ctx->_state = (void*)s;
+
+	/* Truecolour, with alpha for an RGBA image, until a palette
+	   is given */
+	s->pixel = ctx->model == IMAGE_RGBA ? RGBA_SIZE : RGB_SIZE;
+	s->colour_type = ctx->model == IMAGE_RGBA ? 6 : 2;
+	s->bpp = s->pixel;
+	s->stride = ctx->width * s->pixel;
+	s->adler = 1;
+
+	s->rows = (uint8_t*)malloc(s->stride * PNG_BLOCK_ROWS * PNG_BLOCKS);
+	s->prior = (uint8_t*)calloc(s->stride,sizeof(uint8_t));
+	if(s->rows == NULL || s->prior == NULL)
+		return ENOMEM;
+
+	return 0;
+}
+
+int png_set_palette(image_ctx_t *ctx, const uint8_t *colours, const size_t count){
+	/* Stores indices into colours, packed as the image's pixels
+	   are, from here on.  Only before the first pixel, and only
+	   for up to 256 colours. */
+	png_state_t *s = PNG_STATE(ctx);
+	size_t i;
+
+	if(count == 0 || count > 256 || s->held != 0 || s->fill != 0 || s->done != 0)
+		return EINVAL;
+
+	for(i = 0; i < count; i++){
+		memcpy(s->palette + i * RGBA_SIZE,colours + i * s->pixel,s->pixel);
+		if(s->pixel == RGB_SIZE)
+			s->palette[i * RGBA_SIZE + 3] = 0xff;
+	}
+	s->colours = (int)count;
+	s->colour_type = 3;
+	s->bpp = 1;
+	s->stride = ctx->width;
+
+	/* Seed the cache with the palette itself, so a colour listed
+	   twice maps to its first entry */
+	memset(s->cache_key,0x00,sizeof(s->cache_key));
+	s->cached = 0;
+	for(i = 0; i < count; i++)
+		png_cache(s,colours + i * s->pixel,(uint8_t)i);
+
+	return 0;
+}
+
+int png_add_row(image_ctx_t *ctx, const uint8_t *pixels, const size_t count){
+	png_state_t *s = PNG_STATE(ctx);
+	uint8_t *row;
+	size_t i, n, left = count;
+	int success;
+
+	while(left > 0){
+		if(s->done + s->held >= ctx->height)
+			return EINVAL;
+
+		row = s->rows + s->held * s->stride;
+		n = ctx->width - s->fill < left ? ctx->width - s->fill : left;
+
+		if(s->colour_type == 3)
+			for(i = 0; i < n; i++, pixels += s->pixel)
+				row[s->fill + i] = png_index(s,pixels);
+		else{
+			memcpy(row + s->fill * s->pixel,pixels,n * s->pixel);
+			pixels += n * s->pixel;
+		}
+
+		s->fill += n;
+		left -= n;
+		ctx->streamed += n;
+
+		if(s->fill == ctx->width){
+			s->fill = 0;
+			s->held++;
+			if(s->held == PNG_BLOCK_ROWS * PNG_BLOCKS && (success = png_flush(ctx)) != 0)
+				return success;
+		}
+	}
+
+	return 0;
+}
+
+int png_add_pixel(image_ctx_t *ctx,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a){
+	uint8_t pixel[RGBA_SIZE] = {r, g, b, a};
+
+	return png_add_row(ctx,pixel,1);
+}
+
+int png_set_span(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *pixels,const size_t count){
+	/* Pixels are deflated as they come, so only the span that
+	   comes next can be set */
+	if(x + y * ctx->width != ctx->streamed)
+		return EINVAL;
+	return png_add_row(ctx,pixels,count);
+}
+
+int png_set_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a){
+	uint8_t pixel[RGBA_SIZE] = {r, g, b, a};
+
+	return png_set_span(ctx,x,y,pixel,1);
+}
+
+int png_stream(image_ctx_t *ctx, FILE *fd){
+	/* Chunks go straight to fd from here on.  Only possible
+	   before anything has been deflated. */
+	png_state_t *s = PNG_STATE(ctx);
+
+	if(ctx->stream != NULL || s->header)
+		return EINVAL;
+
+	ctx->stream = fd;
+	return 0;
+}
+
+int png_write(image_ctx_t *ctx, FILE* fd){
+	png_state_t *s = PNG_STATE(ctx);
+	uint8_t black[RGBA_SIZE] = {0, 0, 0, 0};
+	int success;
+
+	/* Pixels never drawn are black, as on a canvas, or clear */
+	while(s->done + s->held < ctx->height)
+		if((success = png_add_row(ctx,black,1)) != 0)
+			return success;
+
+	if((success = png_flush(ctx)) != 0 ||
+	   (success = png_chunk(ctx,"IEND",NULL,0)) != 0)
+		return success;
+
+	if(ctx->stream != NULL)
+		return fflush(ctx->stream) != 0 ? EPIPE : 0;
+
+	return fwrite(s->kept,sizeof(uint8_t),s->kept_size,fd) < s->kept_size ? EPIPE : 0;
+}
+
+void png_free(image_ctx_t *ctx){
+	png_state_t *s = PNG_STATE(ctx);
+
+	if(s == NULL)
+		return;
+	free(s->rows);
+	free(s->prior);
+	free(s->kept);
+	free(s);
+	ctx->_state = NULL;
+}
@@ -1,12 +1,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include "image.hh"
 
 int ppm_init(image_ctx_t *ctx){
-	size_t buf_size;
-
 	/* Perform simple sanity checking */
 	if(ctx->canvas != NULL)
 		return EINVAL;
@@ -14,6 +13,20 @@ int ppm_init(image_ctx_t *ctx){
 	ctx->format = IMAGE_PPM;
 	ctx->extension = (char*)".ppm";
 
+	/* The canvas is only allocated when the first pixel arrives
+	   without a stream to take it, see ppm_canvas */
+	ctx->canvas = NULL;
+	ctx->next_pixel = NULL;
+
+	return 0;
+}
+
+static int ppm_canvas(image_ctx_t *ctx){
+	size_t buf_size;
+
+	if(ctx->canvas != NULL)
+		return 0;
+
 	buf_size = ctx->width * ctx->height * RGB_SIZE;
 
 	/* Allocate the canvas buffer */
@@ -25,8 +38,35 @@ int ppm_init(image_ctx_t *ctx){
 	return 0;
 }
 
+int ppm_stream(image_ctx_t *ctx, FILE *fd){
+	/* From here on pixels go straight to fd, strictly in order,
+	   with no canvas.  Only possible before the first pixel. */
+	if(ctx->canvas != NULL || ctx->stream != NULL)
+		return EINVAL;
+
+	ctx->stream = fd;
+	ctx->streamed = 0;
+
+	if(fprintf(fd, "P6\n%zu %zu\n255\n", ctx->width, ctx->height) < 0)
+		return EPIPE;
+
+	return 0;
+}
+
 int ppm_add_pixel(image_ctx_t *ctx,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a){
 	register uint8_t* next;
+	uint8_t pixel[RGB_SIZE];
+
+	if(ctx->stream != NULL){
+		pixel[0] = r;
+		pixel[1] = g;
+		pixel[2] = b;
+		ctx->streamed++;
+		return fwrite(pixel,sizeof(uint8_t),RGB_SIZE,ctx->stream) < RGB_SIZE ? EPIPE : 0;
+	}
+
+	if(ctx->canvas == NULL && ppm_canvas(ctx) != 0)
+		return ENOMEM;
 
 	next = ctx->next_pixel;
 
@@ -39,6 +79,45 @@ int ppm_add_pixel(image_ctx_t *ctx,const uint8_t r,const uint8_t g,const uint8_t
 	return 0;
 }
 
+int ppm_add_row(image_ctx_t *ctx,const uint8_t *pixels,const size_t count){
+	if(ctx->stream != NULL){
+		ctx->streamed += count;
+		return fwrite(pixels,RGB_SIZE,count,ctx->stream) < count ? EPIPE : 0;
+	}
+
+	if(ctx->canvas == NULL && ppm_canvas(ctx) != 0)
+		return ENOMEM;
+
+	memcpy(ctx->next_pixel,pixels,count * RGB_SIZE);
+	ctx->next_pixel += count * RGB_SIZE;
+
+	return 0;
+}
+
+int ppm_set_span(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *pixels,const size_t count){
+	/* Leaves next_pixel alone, so spans of different rows can be
+	   set from several threads at once.  A stream only takes the
+	   span that comes next. */
+	if(ctx->stream != NULL){
+		if(x + y * ctx->width != ctx->streamed)
+			return EINVAL;
+		return ppm_add_row(ctx,pixels,count);
+	}
+
+	if(ctx->canvas == NULL && ppm_canvas(ctx) != 0)
+		return ENOMEM;
+
+	memcpy(ctx->canvas + PIXEL_OFFSET(x,y,ctx->width,RGB_SIZE),pixels,count * RGB_SIZE);
+
+	return 0;
+}
+
+int ppm_set_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a){
+	uint8_t pixel[RGB_SIZE] = {r, g, b};
+
+	return ppm_set_span(ctx,x,y,pixel,1);
+}
+
 int ppm_get_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *r,const uint8_t *g,const uint8_t *b,const uint8_t *a){
 	/* STUB */
 	return 0;
@@ -47,8 +126,25 @@ int ppm_get_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *
 int ppm_write(image_ctx_t *ctx, FILE* fd){
 	size_t written;
 	size_t count;
+	uint8_t blank[RGB_SIZE * 256];
 
-	count = ctx->width * ctx->height * RGB_SIZE;
+	count = ctx->width * ctx->height;
+
+	if(ctx->stream != NULL){
+		/* Pixels never drawn are black, as on a canvas */
+		memset(blank,0x00,sizeof(blank));
+		for(; ctx->streamed < count; ctx->streamed += written){
+			written = count - ctx->streamed < 256 ? count - ctx->streamed : 256;
+			if(fwrite(blank,RGB_SIZE,written,ctx->stream) < written)
+				return EPIPE;
+		}
+		return fflush(ctx->stream) != 0 ? EPIPE : 0;
+	}
+
+	if(ctx->canvas == NULL && ppm_canvas(ctx) != 0)
+		return ENOMEM;
+
+	count *= RGB_SIZE;
 
 	fprintf(fd, "P6\n%zu %zu\n255\n", ctx->width, ctx->height);
 	written = fwrite(ctx->canvas,sizeof(uint8_t),count,fd);
@@ -56,4 +152,4 @@ int ppm_write(image_ctx_t *ctx, FILE* fd){
 		return EPIPE;
 	
 	return 0;
-}
\ No newline at end of file
+}
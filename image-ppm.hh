@@ -9,15 +9,22 @@
 int ppm_init(image_ctx_t *ctx);
 int ppm_add_pixel(image_ctx_t *ctx,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a);
 int ppm_get_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *r,const uint8_t *g,const uint8_t *b,const uint8_t *a);
+int ppm_stream(image_ctx_t *ctx, FILE *fd);
+int ppm_set_pixel(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t r,const uint8_t g,const uint8_t b,const uint8_t a);
+int ppm_add_row(image_ctx_t *ctx,const uint8_t *pixels,const size_t count);
+int ppm_set_span(image_ctx_t *ctx,const size_t x,const size_t y,const uint8_t *pixels,const size_t count);
 int ppm_write(image_ctx_t *ctx, FILE* fd);
 
 image_dispatch_table_t ppm_dt = {\
 	.init 		= ppm_init, \
 	.add_pixel 	= ppm_add_pixel, \
-	.set_pixel	= NULL, \
+	.set_pixel	= ppm_set_pixel, \
 	.get_pixel	= ppm_get_pixel, \
 	.write		= ppm_write, \
-	.free		= NULL
+	.free		= NULL, \
+	.add_row	= ppm_add_row, \
+	.set_span	= ppm_set_span, \
+	.stream		= ppm_stream
 };
 
 #endif
\ No newline at end of file
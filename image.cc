@@ -13,6 +13,7 @@
 //#include <dlfcn.h>
 #include "image.hh"
 #include "image-ppm.hh"
+#include "image-png.hh"
 
 int get_dt(image_dispatch_table_t *dt, int format);
 int load_library(image_dispatch_table_t *dt);
@@ -116,12 +117,75 @@ int image_set_pixel(image_ctx_t *ctx, const size_t x, const size_t y, const uint
 	ctx->next_pixel = ctx->canvas + PIXEL_OFFSET(x,y,ctx->width,block_size);
 	return DISPATCH_TABLE(ctx)->add_pixel(ctx,r,g,b,a);
 }
+/*
+ * image_add_row, image_set_span
+ * Span versions of image_add_pixel and image_set_pixel. pixels holds
+ * count packed pixels of the context's model (RGB or RGBA), which
+ * backends may copy in one go. Backends without span handlers are
+ * given the pixels one at a time.
+ */
+int image_add_row(image_ctx_t *ctx, const uint8_t *pixels, const size_t count){
+	size_t i, block_size;
+	int success = 0;
+	if(ctx->initialized != 1) return EINVAL;
+	if(DISPATCH_TABLE(ctx)->add_row != NULL)
+		return DISPATCH_TABLE(ctx)->add_row(ctx,pixels,count);
+	block_size = ctx->model == IMAGE_RGB ? RGB_SIZE : RGBA_SIZE;
+	for(i = 0; i < count && success == 0; i++, pixels += block_size)
+		success = DISPATCH_TABLE(ctx)->add_pixel(ctx,pixels[0],pixels[1],pixels[2],
+			block_size == RGBA_SIZE ? pixels[3] : 0xff);
+	return success;
+}
+int image_set_span(image_ctx_t *ctx, const size_t x, const size_t y, const uint8_t *pixels, const size_t count){
+	size_t i, block_size;
+	int success = 0;
+	if(ctx->initialized != 1) return EINVAL;
+	if(x + count > ctx->width || y >= ctx->height) return EINVAL;
+	if(DISPATCH_TABLE(ctx)->set_span != NULL)
+		return DISPATCH_TABLE(ctx)->set_span(ctx,x,y,pixels,count);
+	block_size = ctx->model == IMAGE_RGB ? RGB_SIZE : RGBA_SIZE;
+	if(DISPATCH_TABLE(ctx)->set_pixel == NULL){
+		/* As image_set_pixel does: seek, then add the pixels */
+		ctx->next_pixel = ctx->canvas + PIXEL_OFFSET(x,y,ctx->width,block_size);
+		return image_add_row(ctx,pixels,count);
+	}
+	for(i = 0; i < count && success == 0; i++, pixels += block_size)
+		success = DISPATCH_TABLE(ctx)->set_pixel(ctx,x+i,y,pixels[0],pixels[1],pixels[2],
+			block_size == RGBA_SIZE ? pixels[3] : 0xff);
+	return success;
+}
 int image_get_pixel(image_ctx_t *ctx, const size_t x, const size_t y, const uint8_t *r, const uint8_t *g, const uint8_t *b, const uint8_t *a){
 	if(ctx->initialized != 1) return EINVAL;
 	if(DISPATCH_TABLE(ctx)->get_pixel != NULL)
 		return DISPATCH_TABLE(ctx)->get_pixel(ctx,x,y,r,g,b,a);
 	return ENOSYS;
 }
+/*
+ * image_stream
+ * Asks the backend to write pixels to fd as they are added, in
+ * order, instead of keeping a canvas until image_write. Must come
+ * before the first pixel. Returns ENOSYS if the backend can't, in
+ * which case the image is kept and written as usual.
+ */
+int image_stream(image_ctx_t *ctx, FILE *fd){
+	if(ctx->initialized != 1) return EINVAL;
+	if(DISPATCH_TABLE(ctx)->stream == NULL)
+		return ENOSYS;
+	return DISPATCH_TABLE(ctx)->stream(ctx,fd);
+}
+/*
+ * image_set_palette
+ * Tells the backend every colour the image will hold, as count
+ * (at most 256) packed pixels of the context's model, so it may
+ * store palette indices instead. Must come before the first pixel.
+ * Returns ENOSYS if the backend has no use for it.
+ */
+int image_set_palette(image_ctx_t *ctx, const uint8_t *colours, const size_t count){
+	if(ctx->initialized != 1) return EINVAL;
+	if(DISPATCH_TABLE(ctx)->set_palette == NULL)
+		return ENOSYS;
+	return DISPATCH_TABLE(ctx)->set_palette(ctx,colours,count);
+}
 int image_write(image_ctx_t *ctx, FILE *fd){
 	if(ctx->initialized != 1) return EINVAL;
 	return DISPATCH_TABLE(ctx)->write(ctx,fd);
@@ -160,16 +224,13 @@ int image_get_filename(image_ctx_t *ctx, char *out, size_t len_out, char *in){
 	if(len_src > len_ext && strcmp(in+len_src-len_ext,ctx->extension) == 0){
 		/* Already has correct extension and fits in buffer */
 		if(len_src < len_out)
-			strncpy(in,out,len_out);
+			strncpy(out,in,len_out);
 		else
 			success = ENOMEM;
-	}else if(len_src > len_ext){
+	}else if(len_src + len_ext < len_out){
 		/* Doesn't have correct extension and fits */
-		if(len_src + len_ext < len_out){
-			strncpy(out,in,len_out);
-			strncat(out,ctx->extension,len_out);
-		}else
-			success = ENOMEM;
+		strncpy(out,in,len_out);
+		strncat(out,ctx->extension,len_out);
 	}else{
 		/* The input buffer plus an extension cannot fit in the output buffer */
 		fprintf(stderr,"Error building image output filename\n");
@@ -181,7 +242,7 @@ int image_get_filename(image_ctx_t *ctx, char *out, size_t len_out, char *in){
 /*
  * get_dt
  * Load the dispatch table for the specified image
- * format. Currently only pixmap supported.
+ * format: pixmap or PNG.
  */
 int get_dt(image_dispatch_table_t *dt, int format){
 	int success = 0;
@@ -191,6 +252,9 @@ int get_dt(image_dispatch_table_t *dt, int format){
 		case IMAGE_PPM:
 			*dt = ppm_dt;
 			break;
+		case IMAGE_PNG:
+			*dt = png_dt;
+			break;
 		case IMAGE_LIBRARY:
 			success = load_library(dt);
 			break;
@@ -2,12 +2,14 @@
 #define _IMAGE_HH_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define RGB_SIZE  3
 #define RGBA_SIZE 4
 
 enum _image_format{	IMAGE_DEFAULT = 0, \
 					IMAGE_PPM, \
+					IMAGE_PNG, \
 					IMAGE_LIBRARY, \
 					IMAGE_FORMAT_MAX \
 				};
@@ -27,12 +29,19 @@ typedef struct _image_ctx{
 	uint32_t initialized;
 	char *extension;
 	void *_dt;
+	FILE *stream;		/* Set while streaming, see image_stream */
+	size_t streamed;	/* Pixels written to the stream so far */
+	void *_state;		/* Backend state, freed by its _free */
 } image_ctx_t, *pimage_ctx_t;
 
 typedef int _init(image_ctx_t*);
 typedef int _add_pixel(image_ctx_t*,const uint8_t,const uint8_t,const uint8_t,const uint8_t);
 typedef int _set_pixel(image_ctx_t*,const size_t,const size_t,const uint8_t,const uint8_t,const uint8_t,const uint8_t);
 typedef int _get_pixel(image_ctx_t*,const size_t,const size_t,const uint8_t*,const uint8_t*,const uint8_t*,const uint8_t*);
+typedef int _add_row(image_ctx_t*,const uint8_t*,const size_t);
+typedef int _set_span(image_ctx_t*,const size_t,const size_t,const uint8_t*,const size_t);
+typedef int _stream(image_ctx_t*,FILE*);
+typedef int _set_palette(image_ctx_t*,const uint8_t*,const size_t);
 typedef int _write(image_ctx_t*,FILE*);
 typedef void _free(image_ctx_t*);
 
@@ -43,14 +52,22 @@ typedef struct _image_dispatch_table{
 	_get_pixel	*get_pixel;
 	_write		*write;
 	_free		*free;
+	_add_row	*add_row;	/* Optional, else add_pixel per pixel */
+	_set_span	*set_span;	/* Optional, else set_pixel per pixel */
+	_stream		*stream;	/* Optional, else the canvas is kept */
+	_set_palette	*set_palette;	/* Optional, else pixels stay RGB */
 } image_dispatch_table_t;
 
 int image_set_format(int);
 int image_init(image_ctx_t*, const size_t, const size_t, const int, const int);
 int image_add_pixel(image_ctx_t* ctx, const uint8_t, const uint8_t, const uint8_t, const uint8_t);
 int image_set_pixel(image_ctx_t* ctx, const size_t, const size_t, const uint8_t, const uint8_t, const uint8_t, const uint8_t);
+int image_add_row(image_ctx_t* ctx, const uint8_t*, const size_t);
+int image_set_span(image_ctx_t* ctx, const size_t, const size_t, const uint8_t*, const size_t);
 int image_get_pixel(image_ctx_t* ctx,const size_t,const size_t, uint8_t const*, uint8_t const*, uint8_t const*, uint8_t const*);
 int image_get_filename(image_ctx_t*, char*, size_t, char*);
+int image_stream(image_ctx_t*, FILE*);
+int image_set_palette(image_ctx_t*, const uint8_t*, const size_t);
 int image_write(image_ctx_t*, FILE*);
 void image_free(image_ctx_t*);
 int image_set_library(char*);
@@ -1137,6 +1137,16 @@ int LoadPAT(char* az_filename, char* el_filename)
 					az = 1.0;
 
 				LR.antenna_pattern[x][y] = az * elevation;
+
+				/* Precompute the gain in dB so the sweep doesn't
+				   take a log10() per pixel. A null stays at 0 dB,
+				   matching how the sweep always skipped it. */
+
+				if (LR.antenna_pattern[x][y] > 0.0)
+					LR.antenna_pattern_db[x][y] = (pattern_db_t)
+						PATTERN_DB_ROUND(20.0 * log10(LR.antenna_pattern[x][y]) * PATTERN_DB_SCALE);
+				else
+					LR.antenna_pattern_db[x][y] = 0;
 			}
 		}
 	}
@@ -1865,3 +1875,96 @@ int LoadUDT(char* filename)
 	unlink(tempname);
 	return 0;
 }
+
+int LoadSites(char *filename, struct site **sites, int **channels, int *count)
+{
+	/* This function reads a list of transmitter sites for batch
+	   mode, one per line as "lat, lon, height, name[, channel]".
+	   lat and lon are read as for -lat and -lon, the height as for
+	   -txh and name is the base name of the site's output file.
+	   The optional channel (default 0) groups co-channel sites for
+	   interference.  Anything after a ';' is a comment.  The
+	   arrays are allocated here. */
+
+	int n = 0, size = 0, x, *group = NULL, *grown_group;
+	char input[512], *str[5], *pointer;
+	struct site *list = NULL, *grown;
+	FILE *fd;
+
+	if ((fd = fopen(filename, "r")) == NULL)
+		return errno;
+
+	while (fgets(input, sizeof(input), fd) != NULL) {
+		pointer = strchr(input, ';');
+
+		if (pointer != NULL)
+			*pointer = 0;
+
+		/* Split on commas, dropping blanks and <CR>/<LF> */
+
+		for (x = 0, str[0] = strtok(input, ",\r\n"); x < 4 && str[x] != NULL; x++)
+			str[x + 1] = strtok(NULL, ",\r\n");
+
+		if (x < 3 || str[3] == NULL)
+			continue;
+
+		while (*str[3] == ' ' || *str[3] == '\t')
+			str[3]++;
+
+		for (x = strlen(str[3]); x > 0 && (str[3][x - 1] == ' ' || str[3][x - 1] == '\t'); x--)
+			str[3][x - 1] = 0;
+
+		if (str[3][0] == 0)
+			continue;
+
+		if (n == size) {
+			size = (size == 0 ? 64 : size * 2);
+
+			grown = (struct site *)realloc(list, size * sizeof(struct site));
+			if (grown != NULL)
+				list = grown;
+
+			grown_group = (int *)realloc(group, size * sizeof(int));
+			if (grown_group != NULL)
+				group = grown_group;
+
+			if (grown == NULL || grown_group == NULL) {
+				free(list);
+				free(group);
+				fclose(fd);
+				return ENOMEM;
+			}
+		}
+
+		memset(&list[n], 0, sizeof(struct site));
+		list[n].lat = ReadBearing(str[0]);
+		list[n].lon = -ReadBearing(str[1]);
+
+		if (list[n].lon < 0.0)
+			list[n].lon += 360.0;
+
+		list[n].alt = (float)atof(str[2]);
+		strncpy(list[n].name, "Tx", 3);
+		strncpy(list[n].filename, str[3], 253);
+		group[n] = (str[4] != NULL ? atoi(str[4]) : 0);
+
+		if (group[n] < 0)
+			group[n] = 0;
+
+		n++;
+	}
+
+	fclose(fd);
+
+	if (n == 0) {
+		free(list);
+		free(group);
+		return EINVAL;
+	}
+
+	*sites = list;
+	*channels = group;
+	*count = n;
+
+	return 0;
+}
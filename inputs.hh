@@ -18,6 +18,7 @@ int LoadUDT(char *filename);
 int loadLIDAR(char *filename, int resample);
 int loadClutter(char *filename, double radius, struct site tx);
 int averageHeight(int h, int w, int x, int y);
+int LoadSites(char *filename, struct site **sites, int **channels, int *count);
 static const char AZ_FILE_SUFFIX[] = ".az";
 static const char EL_FILE_SUFFIX[] = ".el"; 
 
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "main.hh"
+#include "lossmap.hh"
+#include "models/los.hh"
+
+/* Path loss of every pixel of the pages in use, NAN where none was
+   predicted, laid out like dem[].signal.  NULL unless -lf is set.
+   For an angle map it is the loss without the antenna pattern, and
+   the angles it was looked up at are kept alongside. */
+static float ***lossPlanes = NULL;
+static uint16_t ***azimuthPlanes = NULL;
+static int16_t ***elevationPlanes = NULL;
+
+static int MapPage(double lat, double lon, int *x, int *y)
+{
+	/* The page holding lat/lon and its pixel, as the renderers
+	   find it, or -1 off the terrain */
+
+	int indx;
+
+	if (lon < 0.0)
+		lon += 360.0;
+
+	for (indx = 0; indx < MAXPAGES; indx++) {
+		*x = (int)rint(ppd * (lat - (double)dem[indx].min_north));
+		*y = mpi - (int)rint(ppd * (LonDiff((double)dem[indx].max_west, lon)));
+
+		if (*x >= 0 && *x <= mpi && *y >= 0 && *y <= mpi)
+			return indx;
+	}
+
+	return -1;
+}
+
+void AllocLossMap(bool angles)
+{
+	lossPlanes = allocPlanes<float>(NAN);
+
+	if (angles) {
+		azimuthPlanes = allocPlanes<uint16_t>(0);
+		elevationPlanes = allocPlanes<int16_t>(0);
+	}
+}
+
+void FreeLossMap(void)
+{
+	freePlanes(lossPlanes);
+	freePlanes(azimuthPlanes);
+	freePlanes(elevationPlanes);
+	lossPlanes = NULL;
+	azimuthPlanes = NULL;
+	elevationPlanes = NULL;
+}
+
+void PutLoss(double lat, double lon, double raw_loss, double loss,
+	     double azimuth, double elevation)
+{
+	/* Keeps the least path loss seen at a location, as
+	   PutPropSignal() keeps the strongest signal.  For an
+	   angle map that is the loss before the antenna pattern
+	   (raw_loss), with the pattern indices PatternLoss() uses. */
+
+	int x = 0, y = 0, indx;
+	char found;
+
+	if (lossPlanes == NULL)
+		return;
+
+	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
+		x = (int)rint(ppd * (lat - dem[indx].min_north));
+		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
+
+		if (x >= 0 && x <= mpi && y >= 0 && y <= mpi)
+			found = 1;
+		else
+			indx++;
+	}
+
+	if (!found || lossPlanes[indx] == NULL)
+		return;
+
+	if (azimuthPlanes == NULL) {
+		if (!(lossPlanes[indx][x][y] <= loss))
+			lossPlanes[indx][x][y] = (float)loss;
+	}
+
+	else if (!(lossPlanes[indx][x][y] <= raw_loss)) {
+		lossPlanes[indx][x][y] = (float)raw_loss;
+		azimuthPlanes[indx][x][y] = (uint16_t)rint(azimuth);
+		elevationPlanes[indx][x][y] = (int16_t)rint(10.0 * (10.0 - elevation));
+	}
+}
+
+void LossMapRow(int y, float *row)
+{
+	/* The loss of row y of the map as it will be drawn, antenna
+	   pattern included, NAN where none was predicted */
+
+	int x, x0, y0, indx;
+	double lat = (double)max_north - dpp - (dpp * (double)y), loss;
+
+	for (x = 0; x < (int)width; x++) {
+		indx = MapPage(lat, max_west - (dpp * (double)x), &x0, &y0);
+		loss = (indx < 0 || lossPlanes == NULL || lossPlanes[indx] == NULL ?
+			NAN : lossPlanes[indx][x0][y0]);
+
+		if (azimuthPlanes != NULL && loss == loss)
+			loss = PatternLoss(loss, azimuthPlanes[indx][x0][y0],
+					   10.0 - elevationPlanes[indx][x0][y0] / 10.0);
+
+		row[x] = (float)loss;
+	}
+}
+
+static size_t sampleSize(int type)
+{
+	return (type == LOSSMAP_ANGLES ? sizeof(struct lossmap_angles) :
+		type == LOSSMAP_INT16 ? sizeof(int16_t) : sizeof(float));
+}
+
+int WriteLossMap(char *filename, bool compact)
+{
+	/* Writes the loss over the map as it will be drawn, so
+	   after any cropping, with the geometry in the header */
+
+	struct lossmap_header header;
+	struct lossmap_angles *angles;
+	int x, y, x0, y0, indx;
+	double lat, loss;
+	float *row;
+	int16_t *packed;
+	FILE *fd;
+
+	if ((fd = fopen(filename, "wb")) == NULL)
+		return errno;
+
+	memcpy(header.magic, LOSSMAP_MAGIC, sizeof(header.magic));
+	header.type = (azimuthPlanes != NULL ? LOSSMAP_ANGLES :
+		       compact ? LOSSMAP_INT16 : LOSSMAP_FLOAT);
+	header.width = width;
+	header.height = height;
+	header.north = (double)max_north - dpp;
+	header.west = max_west;
+	header.dpp = dpp;
+	header.frq_mhz = LR.frq_mhz;
+
+	fwrite(&header, sizeof(header), 1, fd);
+
+	/* One row buffer, viewed as whichever sample type is in use */
+
+	angles = new struct lossmap_angles[width];
+	row = (float *)angles;
+	packed = (int16_t *)angles;
+
+	for (y = 0, lat = header.north; y < (int)height;
+	     y++, lat = header.north - (dpp * (double)y)) {
+		for (x = 0; x < (int)width; x++) {
+			indx = MapPage(lat, max_west - (dpp * (double)x), &x0, &y0);
+			loss = (indx < 0 || lossPlanes[indx] == NULL ?
+				NAN : lossPlanes[indx][x0][y0]);
+
+			if (header.type == LOSSMAP_ANGLES) {
+				angles[x].loss = (float)loss;
+				angles[x].azimuth = (loss != loss ? 0 :
+						     azimuthPlanes[indx][x0][y0]);
+				angles[x].elevation = (loss != loss ? 0 :
+						       elevationPlanes[indx][x0][y0]);
+			}
+
+			else if (header.type == LOSSMAP_FLOAT)
+				row[x] = (float)loss;
+
+			else if (loss != loss || fabs(loss) >= 3276.7)
+				packed[x] = LOSSMAP_NODATA_INT16;
+
+			else
+				packed[x] = (int16_t)rint(loss * 10.0);
+		}
+
+		fwrite(angles, sampleSize(header.type), width, fd);
+	}
+
+	delete [] angles;
+
+	if (fclose(fd) != 0)
+		return errno;
+
+	return 0;
+}
+
+int ReadLossMap(char *filename)
+{
+	/* Loads a loss map written by WriteLossMap() into dem[].signal
+	   for the current ERP and units, taking the map geometry from
+	   it.  The terrain it covers must already be loaded.  An angle
+	   map takes the antenna pattern loaded now (if any).  The loss
+	   is kept as well if a loss map has been allocated. */
+
+	struct lossmap_header header;
+	struct lossmap_angles *angles;
+	int x, y, x0, y0, indx;
+	double lat, loss;
+	float *row;
+	int16_t *packed;
+	unsigned char signal;
+	FILE *fd;
+
+	if ((fd = fopen(filename, "rb")) == NULL)
+		return errno;
+
+	if (fread(&header, sizeof(header), 1, fd) != 1
+	    || memcmp(header.magic, LOSSMAP_MAGIC, sizeof(header.magic)) != 0
+	    || (header.type != LOSSMAP_FLOAT && header.type != LOSSMAP_INT16
+		&& header.type != LOSSMAP_ANGLES)
+	    || header.width <= 0 || header.height <= 0) {
+		fprintf(stderr, "%s is not a loss map\n", filename);
+		fclose(fd);
+		return EINVAL;
+	}
+
+	if (fabs(header.dpp - dpp) > dpp * 1e-6) {
+		fprintf(stderr, "%s was made at another resolution\n", filename);
+		fclose(fd);
+		return EINVAL;
+	}
+
+	max_north = header.north + dpp;
+	max_west = header.west;
+	width = header.width;
+	height = header.height;
+
+	angles = new struct lossmap_angles[width];
+	row = (float *)angles;
+	packed = (int16_t *)angles;
+
+	for (y = 0, lat = header.north; y < (int)height;
+	     y++, lat = header.north - (dpp * (double)y)) {
+		if (fread(angles, sampleSize(header.type), width, fd) !=
+		    (size_t)width) {
+			fprintf(stderr, "%s is truncated\n", filename);
+			delete [] angles;
+			fclose(fd);
+			return EINVAL;
+		}
+
+		for (x = 0; x < (int)width; x++) {
+			if (header.type == LOSSMAP_ANGLES) {
+				/* The elevation back from its pattern index */
+
+				loss = angles[x].loss;
+
+				if (loss == loss)
+					loss = PatternLoss(loss, angles[x].azimuth,
+							   10.0 - angles[x].elevation / 10.0);
+			}
+
+			else if (header.type == LOSSMAP_FLOAT)
+				loss = row[x];
+
+			else if (packed[x] == LOSSMAP_NODATA_INT16)
+				loss = NAN;
+
+			else
+				loss = packed[x] / 10.0;
+
+			if (loss != loss)
+				continue;
+
+			indx = MapPage(lat, max_west - (dpp * (double)x), &x0, &y0);
+
+			if (indx < 0)
+				continue;
+
+			signal = SignalLevel(loss, header.frq_mhz);
+			dem[indx].signal[x0][y0] = signal;
+
+			if (lossPlanes != NULL && lossPlanes[indx] != NULL)
+				lossPlanes[indx][x0][y0] = (float)loss;
+
+			if (signal > hottest)
+				hottest = signal;
+		}
+	}
+
+	delete [] angles;
+	fclose(fd);
+
+	return 0;
+}
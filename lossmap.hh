@@ -0,0 +1,49 @@
+#ifndef _LOSSMAP_HH_
+#define _LOSSMAP_HH_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/* A loss map holds the path loss (dB, antenna pattern included) of
+   every pixel of the final map, so that it can be drawn again for
+   another ERP, unit or threshold without propagating again.  The
+   header is followed by height rows of width samples, north row
+   first, each a float or, compacted, an int16 of 0.1 dB.
+
+   An angle map instead holds the loss without the pattern, with
+   the azimuth and elevation pattern index it was looked up at, so
+   that another antenna pattern or tilt can be applied as well. */
+
+#define LOSSMAP_MAGIC "SSLM"
+#define LOSSMAP_FLOAT 0
+#define LOSSMAP_INT16 1
+#define LOSSMAP_ANGLES 2
+#define LOSSMAP_NODATA_INT16 (-32768)
+
+struct lossmap_angles {
+	float loss;		/* dB without the antenna pattern, or NAN */
+	uint16_t azimuth;	/* degrees, 0 to 360 */
+	int16_t elevation;	/* index into antenna_pattern_db[][] */
+};
+
+struct lossmap_header {
+	char magic[4];
+	int32_t type;		/* LOSSMAP_FLOAT, _INT16 or _ANGLES */
+	int32_t width;
+	int32_t height;
+	double north;		/* latitude of the first row */
+	double west;		/* longitude (degrees west) of the first column */
+	double dpp;		/* degrees per pixel */
+	double frq_mhz;		/* frequency the loss was predicted at */
+};
+
+void AllocLossMap(bool angles);
+void FreeLossMap(void);
+void PutLoss(double lat, double lon, double raw_loss, double loss,
+	     double azimuth, double elevation);
+void LossMapRow(int y, float *row);
+int WriteLossMap(char *filename, bool compact);
+int ReadLossMap(char *filename);
+
+#endif /* _LOSSMAP_HH_ */
@@ -28,6 +28,7 @@ double version = 3.10;
 //#include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <mutex>
 
 #include "common.h"
 #include "inputs.hh"
@@ -36,6 +37,12 @@ double version = 3.10;
 #include "models/los.hh"
 #include "models/pel.hh"
 #include "image.hh"
+#include "batch.hh"
+#include "lossmap.hh"
+#include "aoi.hh"
+#include "geotiff.hh"
+#include "contours.hh"
+#include "metricgrid.hh"
 
 int MAXPAGES = 10*10;
 int IPPD = 1200;
@@ -48,7 +55,7 @@ double earthradius, max_range = 0.0, forced_erp, dpp, ppd, yppd,
     fzone_clearance = 0.6, forced_freq, clutter, lat, lon, txh, tercon, terdic,
     north, east, south, west, dBm, loss, field_strength,
     min_north = 90, max_north = -90, min_west = 360, max_west = -1, westoffset=180, eastoffset=-180, delta=0, rxGain=0,
-    cropLat=-70, cropLon=0,cropLonNeg=0;
+    et_margin = 0.0, et_distance = 1.0;
 
 int ippd, mpi, 
     max_elevation = -32768, min_elevation = 32768, bzerror, contour_threshold,
@@ -57,12 +64,48 @@ int ippd, mpi,
 
 unsigned char got_elevation_pattern, got_azimuth_pattern, metric = 0, dbm = 0;
 
-bool to_stdout = false, cropping = true;
+bool to_stdout = false, cropping = true, early_termination = false;
+bool angle_map = false;
+bool ano_binary = false;
+
+/* Azimuth window of a -sec sweep, clockwise from sector_start
+   to sector_end in degrees true */
+bool sector = false;
+double sector_start = 0.0, sector_end = 360.0;
+
+/* Receiver heights (feet) of a -rxh list.  The first is swept
+   into dem[] as usual, the others each into a layer of their own. */
+double rx_heights[MAX_RX_HEIGHTS];
+int rx_height_count = 1;
+struct layer *height_layers[MAX_RX_HEIGHTS];
+
+/* Frequencies (MHz) of a -f list, laid out like the heights */
+double frequencies[MAX_BANDS];
+int band_count = 1;
+struct layer *band_layers[MAX_BANDS];
+
+/* ITM reliabilities (fractions) of a -rel list, likewise */
+double reliabilities[MAX_PERCENTILES];
+int rel_count = 1;
+struct layer *rel_layers[MAX_PERCENTILES];
 
 thread_local double *elev;
 thread_local struct path path;
 struct site tx_site[2];
 struct dem *dem;
+thread_local struct layer *site_layer = NULL;
+
+/* The pixels drawn above -rt by this thread, and by every thread that
+   has merged its own: the latitudes of their centres, and longitudes
+   as degrees west of the Tx */
+struct signalBounds {
+	double north, south, west, east;
+	bool found;
+};
+
+static thread_local struct signalBounds thread_bounds = {0.0, 0.0, 0.0, 0.0, false};
+static struct signalBounds signal_bounds = {0.0, 0.0, 0.0, 0.0, false};
+static std::mutex boundsMutex;
 
 struct LR LR;
 struct region region;
@@ -154,6 +197,19 @@ char *dec2dms(double decimal)
 	return (string);
 }
 
+static inline unsigned char **MaskPage(int indx)
+{
+	/* The mask page being written: the site layer of
+	   this thread if it has one, else the shared one */
+
+	return (site_layer != NULL ? site_layer->mask[indx] : dem[indx].mask);
+}
+
+static inline unsigned char **SignalPage(int indx)
+{
+	return (site_layer != NULL ? site_layer->signal[indx] : dem[indx].signal);
+}
+
 int PutMask(double lat, double lon, int value)
 {
 	/* Lines, text, markings, and coverage areas are stored in a
@@ -163,8 +219,17 @@ int PutMask(double lat, double lon, int value)
 	   area pointed to. */
 
 	int x = 0, y = 0, indx;
+	long cell;
 	char found;
 
+	if (tm_grid != NULL) {
+		if ((cell = MetricCell(lat, lon)) < 0)
+			return -1;
+
+		tm_grid->mask[cell] = value;
+		return ((int)tm_grid->mask[cell]);
+	}
+
 	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
 		x = (int)rint(ppd * (lat - dem[indx].min_north));
 		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
@@ -176,8 +241,8 @@ int PutMask(double lat, double lon, int value)
 	}
 
 	if (found) {
-		dem[indx].mask[x][y] = value;
-		return ((int)dem[indx].mask[x][y]);
+		MaskPage(indx)[x][y] = value;
+		return ((int)MaskPage(indx)[x][y]);
 	}
 
 	else
@@ -193,8 +258,17 @@ int OrMask(double lat, double lon, int value)
 	   pointed to. */
 
 	int x = 0, y = 0, indx;
+	long cell;
 	char found;
 
+	if (tm_grid != NULL) {
+		if ((cell = MetricCell(lat, lon)) < 0)
+			return -1;
+
+		tm_grid->mask[cell] |= value;
+		return ((int)tm_grid->mask[cell]);
+	}
+
 	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
 		x = (int)rint(ppd * (lat - dem[indx].min_north));
 		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
@@ -206,8 +280,8 @@ int OrMask(double lat, double lon, int value)
 	}
 
 	if (found) {
-		dem[indx].mask[x][y] |= value;
-		return ((int)dem[indx].mask[x][y]);
+		MaskPage(indx)[x][y] |= value;
+		return ((int)MaskPage(indx)[x][y]);
 	}
 
 	else
@@ -222,6 +296,62 @@ int GetMask(double lat, double lon)
 	return (OrMask(lat, lon, 0));
 }
 
+static void GrowBounds(struct signalBounds *b, double lat, double west)
+{
+	if (!b->found) {
+		b->north = b->south = lat;
+		b->west = b->east = west;
+		b->found = true;
+		return;
+	}
+
+	b->north = MAX(b->north, lat);
+	b->south = MIN(b->south, lat);
+	b->west = MAX(b->west, west);
+	b->east = MIN(b->east, west);
+}
+
+void MergeSignalBounds(void)
+{
+	/* Adds the pixels this thread gave a signal to the bounds of
+	   the map.  Sweep threads call this as they finish, and main()
+	   once the sweep is done, so the bounds do not depend on which
+	   thread got to a pixel first. */
+
+	std::lock_guard<std::mutex> lock(boundsMutex);
+
+	if (thread_bounds.found) {
+		GrowBounds(&signal_bounds, thread_bounds.north, thread_bounds.west);
+		GrowBounds(&signal_bounds, thread_bounds.south, thread_bounds.east);
+	}
+
+	thread_bounds.found = false;
+}
+
+void GrowSignalBounds(double lat, double lon)
+{
+	/* Adds the pixel at lat/lon to the bounds the map is cropped
+	   to.  The sweep calls this for points that clear the -rt
+	   threshold, so the crop holds what will be drawn. */
+
+	int x, y, indx;
+
+	if (tm_grid != NULL)
+		return;
+
+	for (indx = 0; indx < MAXPAGES; indx++) {
+		x = (int)rint(ppd * (lat - dem[indx].min_north));
+		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
+
+		if (x >= 0 && x <= mpi && y >= 0 && y <= mpi) {
+			GrowBounds(&thread_bounds, dem[indx].min_north + (double)x / ppd,
+				   LonDiff(dem[indx].max_west - (double)(mpi - y) / yppd,
+					   tx_site[0].lon));
+			return;
+		}
+	}
+}
+
 int PutSignal(double lat, double lon, unsigned char signal)
 {
 	/* This function writes a signal level (0-255)
@@ -231,10 +361,24 @@ int PutSignal(double lat, double lon, unsigned char signal)
 	snprintf(dotfile, 80, "%s.dot%c", tx_site[0].filename, 0);
 
 	int x = 0, y = 0, indx;
+	long cell;
 	char found;
-	if (signal > hottest)	// dBm, dBuV
+	if (site_layer != NULL) {
+		if (signal > site_layer->hottest)
+			site_layer->hottest = signal;
+	}
+
+	else if (signal > hottest)	// dBm, dBuV
 		hottest = signal;
 
+	if (tm_grid != NULL) {
+		if ((cell = MetricCell(lat, lon)) < 0)
+			return 0;
+
+		tm_grid->signal[cell] = signal;
+		return (tm_grid->signal[cell]);
+	}
+
 	//lookup x/y for this co-ord
 	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
 		x = (int)rint(ppd * (lat - dem[indx].min_north));
@@ -248,15 +392,43 @@ int PutSignal(double lat, double lon, unsigned char signal)
 
 	if (found) {
 		// Write values to file
-		dem[indx].signal[x][y] = signal;
+		SignalPage(indx)[x][y] = signal;
+
+		if (site_layer != NULL && site_layer->site >= 0)
+			MergeBestServer(indx, x, y, site_layer->site, signal);
 
-		return (dem[indx].signal[x][y]);
+		return (SignalPage(indx)[x][y]);
 	}
 
 	else
 		return 0;
 }
 
+void PutPower(double lat, double lon, double power)
+{
+	/* Keeps the strongest received power (mW) seen at a
+	   location in the power plane of this thread's layer */
+
+	int x = 0, y = 0, indx;
+	char found;
+
+	if (site_layer == NULL || site_layer->power == NULL)
+		return;
+
+	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
+		x = (int)rint(ppd * (lat - dem[indx].min_north));
+		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
+
+		if (x >= 0 && x <= mpi && y >= 0 && y <= mpi)
+			found = 1;
+		else
+			indx++;
+	}
+
+	if (found && power > site_layer->power[indx][x][y])
+		site_layer->power[indx][x][y] = (float)power;
+}
+
 unsigned char GetSignal(double lat, double lon)
 {
 	/* This function reads the signal level (0-255) at the
@@ -264,8 +436,12 @@ unsigned char GetSignal(double lat, double lon)
 	   complimentary PutSignal() function. */
 
 	int x = 0, y = 0, indx;
+	long cell;
 	char found;
 
+	if (tm_grid != NULL)
+		return ((cell = MetricCell(lat, lon)) < 0 ? 0 : tm_grid->signal[cell]);
+
 	for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
 		x = (int)rint(ppd * (lat - dem[indx].min_north));
 		y = mpi - (int)rint(yppd * (LonDiff(dem[indx].max_west, lon)));
@@ -277,7 +453,7 @@ unsigned char GetSignal(double lat, double lon)
 	}
 
 	if (found)
-		return (dem[indx].signal[x][y]);
+		return (SignalPage(indx)[x][y]);
 	else
 		return 0;
 }
@@ -440,6 +616,70 @@ double Azimuth(struct site source, struct site destination)
 	return (azimuth / DEG2RAD);
 }
 
+bool InSector(double azimuth, double margin)
+{
+	/* Whether an azimuth (degrees) lies within the -sec window,
+	   widened by margin degrees on either side */
+
+	double span;
+
+	if (!sector)
+		return true;
+
+	span = fmod(sector_end - sector_start + 360.0, 360.0);
+
+	return (fmod(azimuth - sector_start + margin + 720.0, 360.0)
+		<= span + 2.0 * margin);
+}
+
+static bool PatternSector(double cutoff)
+{
+	/* Derives the -sec window from the antenna pattern: the
+	   narrowest arc holding every azimuth whose best gain, over
+	   all elevations, is within cutoff dB of the peak.  That is
+	   the complement of the widest run of azimuths below it.
+	   Returns false when no azimuth falls below the cutoff. */
+
+	double gain[360], peak = -HUGE_VAL, best;
+	int x, y, run, gap = 0, gap_end = 0;
+
+	for (x = 0; x < 360; x++) {
+		/* Ranked on the linear pattern, as the dB table holds
+		   0 dB for a null as well as for the peak */
+
+		for (y = 0, best = 0.0; y <= 1000; y++)
+			if (LR.antenna_pattern[x][y] > best)
+				best = LR.antenna_pattern[x][y];
+
+		gain[x] = (best > 0.0 ? 20.0 * log10(best) : -HUGE_VAL);
+
+		if (gain[x] > peak)
+			peak = gain[x];
+	}
+
+	/* Twice round, so a gap through north is counted whole */
+
+	for (x = 0, run = 0; x < 720; x++) {
+		if (gain[x % 360] < peak - cutoff)
+			run++;
+		else
+			run = 0;
+
+		if (run > gap && run <= 360) {
+			gap = run;
+			gap_end = x % 360;
+		}
+	}
+
+	if (gap == 0 || gap == 360)
+		return false;
+
+	sector_start = (double)((gap_end + 1) % 360);
+	sector_end = (double)((gap_end - gap + 360) % 360);
+
+	return true;
+}
+
 double ElevationAngle(struct site source, struct site destination)
 {
 	/* This function returns the angle of elevation (in degrees)
@@ -1017,6 +1257,133 @@ void alloc_path(void)
 	path.distance = new double[ARRAYSIZE];
 }
 
+void clear_layer(struct layer *l)
+{
+	/* Readies a layer for the next site.  The map markings
+	   (the low mask bits) are carried over from dem[].mask. */
+
+	int i, j, k;
+
+	for (i = 0; i < MAXPAGES; i++) {
+		if (l->mask[i] == NULL)
+			continue;
+
+		for (j = 0; j < ippd; j++) {
+			for (k = 0; k < ippd; k++)
+				l->mask[i][j][k] = dem[i].mask[j][k] & 7;
+
+			memset(l->signal[i][j], 0, ippd);
+			memset(l->processed[i][j], 0, ippd * sizeof(bool));
+
+			if (l->power != NULL)
+				memset(l->power[i][j], 0, ippd * sizeof(float));
+		}
+	}
+
+	l->hottest = 0;
+	l->site = -1;
+	l->channel = -1;
+}
+
+struct layer *alloc_layer(bool power)
+{
+	/* Allocates result planes for every DEM page in use,
+	   with a received power plane if asked for */
+
+	int i, j;
+	struct layer *l = new struct layer;
+
+	l->mask = new unsigned char **[MAXPAGES];
+	l->signal = new unsigned char **[MAXPAGES];
+	l->processed = new bool **[MAXPAGES];
+	l->power = (power ? new float **[MAXPAGES] : NULL);
+
+	for (i = 0; i < MAXPAGES; i++) {
+		l->mask[i] = NULL;
+		l->signal[i] = NULL;
+		l->processed[i] = NULL;
+
+		if (l->power != NULL)
+			l->power[i] = NULL;
+
+		if (dem[i].max_north < dem[i].min_north)
+			continue;
+
+		l->mask[i] = new unsigned char *[ippd];
+		l->signal[i] = new unsigned char *[ippd];
+		l->processed[i] = new bool *[ippd];
+
+		if (l->power != NULL)
+			l->power[i] = new float *[ippd];
+
+		for (j = 0; j < ippd; j++) {
+			l->mask[i][j] = new unsigned char[ippd];
+			l->signal[i][j] = new unsigned char[ippd];
+			l->processed[i][j] = new bool[ippd];
+
+			if (l->power != NULL)
+				l->power[i][j] = new float[ippd];
+		}
+	}
+
+	clear_layer(l);
+
+	return l;
+}
+
+void free_layer(struct layer *l)
+{
+	int i, j;
+
+	for (i = 0; i < MAXPAGES; i++) {
+		if (l->mask[i] == NULL)
+			continue;
+
+		for (j = 0; j < ippd; j++) {
+			delete [] l->mask[i][j];
+			delete [] l->signal[i][j];
+			delete [] l->processed[i][j];
+
+			if (l->power != NULL)
+				delete [] l->power[i][j];
+		}
+		delete [] l->mask[i];
+		delete [] l->signal[i];
+		delete [] l->processed[i];
+
+		if (l->power != NULL)
+			delete [] l->power[i];
+	}
+	delete [] l->mask;
+	delete [] l->signal;
+	delete [] l->processed;
+	delete [] l->power;
+	delete l;
+}
+
+void swap_layer(struct layer *l)
+{
+	/* Exchanges the planes of a layer with those of dem[], so the
+	   renderers, which read dem[] directly, draw the layer.  A
+	   second call swaps them back. */
+
+	int i;
+	unsigned char **page;
+
+	for (i = 0; i < MAXPAGES; i++) {
+		if (l->mask[i] == NULL)
+			continue;
+
+		page = dem[i].mask;
+		dem[i].mask = l->mask[i];
+		l->mask[i] = page;
+
+		page = dem[i].signal;
+		dem[i].signal = l->signal[i];
+		l->signal[i] = page;
+	}
+}
+
 void do_allocs(void)
 {
 	int i;
@@ -1040,18 +1407,30 @@ int main(int argc, char *argv[])
 	int x, y, z = 0, min_lat, min_lon, max_lat, max_lon,
 	    rxlat, rxlon, txlat, txlon, west_min, west_max,
 	    nortRxHin, nortRxHax, propmodel, knifeedge = 0, ppa =
-	    0, normalise = 0, haf = 0, pmenv = 1, lidar=0, cropped, result;
+	    0, normalise = 0, haf = 0, pmenv = 1, lidar=0, cropped, result,
+	    packet = 0;
+
+	bool use_threads = true, viewshed = false, polar = false,
+	    best_server = false, interference = false, compact_loss = false,
+	    compact_raster = false, compress_raster = false;
 
-	bool use_threads = true;
+	double sector_cutoff = 0.0, crop_west = 0.0, tm_spacing = 0.0,
+	    tm_bounds[4];
 
 	unsigned char LRmap = 0, txsites = 0, topomap = 0, geo = 0, kml =
 	    0, area_mode = 0, max_txsites, ngs = 0;
 
 	char mapfile[255], ano_filename[255], lidar_tiles[27000], clutter_file[255];
-	char *az_filename, *el_filename, *udt_file = NULL;
+	char *az_filename, *el_filename, *udt_file = NULL, *batch_file = NULL, *s,
+	    *loss_file = NULL, *rerender_file = NULL, *aoi_file = NULL,
+	    *raster_file = NULL, *tile_dir = NULL, *contour_file = NULL;
+	int tile_zmin = -1, tile_zmax = -1;
+	struct site *batch_sites = NULL;
+	int *batch_channels = NULL, batch_count = 0;
 
 	double altitude = 0.0, altitudeLR = 0.0, tx_range = 0.0,
-	    rx_range = 0.0, deg_range = 0.0, deg_limit = 0.0, deg_range_lon;
+	    rx_range = 0.0, deg_range = 0.0, deg_limit = 0.0, deg_range_lon,
+	    noise_floor = -120.0;
 
 	if (strstr(argv[0], "signalserverHD")) {
 		MAXPAGES = 9;
@@ -1085,9 +1464,9 @@ int main(int argc, char *argv[])
 		fprintf(stdout, "     -txh Tx Height (above ground)\n");
 		fprintf(stdout,	"     -rla (Optional) Rx Latitude for PPA (decimal degrees) -70/+70\n");
 		fprintf(stdout, "     -rlo (Optional) Rx Longitude for PPA (decimal degrees) -180/+180\n");
-		fprintf(stdout,	"     -f Tx Frequency (MHz) 20MHz to 100GHz (LOS after 20GHz)\n");
+		fprintf(stdout,	"     -f Tx Frequency (MHz) 20MHz to 100GHz (LOS after 20GHz). A list as 700,1800 gives one output per band\n");
 		fprintf(stdout,	"     -erp Tx Total Effective Radiated Power in Watts (dBd) inc Tx+Rx gain. 2.14dBi = 0dBd\n");
-		fprintf(stdout,	"     -rxh Rx Height(s) (optional. Default=0.1)\n");
+		fprintf(stdout,	"     -rxh Rx Height(s) (optional. Default=0.1). A list as 1.5,3,10 gives one output per height\n");
 		fprintf(stdout,	"     -rxg Rx gain dBd (optional for PPA text report)\n");
 		fprintf(stdout,	"     -hp Horizontal Polarisation (default=vertical)\n");
 		fprintf(stdout, "     -gc Random ground clutter (feet/meters)\n");
@@ -1096,12 +1475,30 @@ int main(int argc, char *argv[])
 		fprintf(stdout,	"     -terdic Terrain dielectric value 2-80 (optional)\n");
 		fprintf(stdout,	"     -tercon Terrain conductivity 0.01-0.0001 (optional)\n");
 		fprintf(stdout, "     -cl Climate code 1-6 (optional)\n");
-		fprintf(stdout, "     -rel Reliability for ITM model 50 to 99 (optional)\n");
+		fprintf(stdout, "     -rel Reliability for ITM model 50 to 99 (optional). A list as 50,90,99 gives one output per percentile\n");
 		fprintf(stdout, "     -resample Reduce Lidar resolution by specified factor (2 = 50%)\n");
+		fprintf(stdout, "     -batch Site list, one 'lat,lon,height,name' per line. One output per site\n");
+		fprintf(stdout, "     -bs Best server: one composite of all -batch sites plus server ids\n");
+		fprintf(stdout, "     -ci C/I and SINR of -batch sites, grouped by a 5th 'channel' field (needs -erp)\n");
+		fprintf(stdout, "     -nf Noise floor for SINR in dBm (default -120)\n");
+		fprintf(stdout, "     -lf Save the path loss of the map to a loss map file\n");
+		fprintf(stdout, "     -lfc Save the loss map as int16 0.1 dB instead of float\n");
+		fprintf(stdout, "     -lfa Save the loss map without the -ant pattern, so -rr can apply another\n");
+		fprintf(stdout, "     -rr Redraw a loss map for the given -erp, -dbm and -rt without propagating\n");
+		fprintf(stdout, "     -ano Write every pixel's lat, lon, azimuth, elevation and dB / dBm / dBuV/m to a text file\n");
+		fprintf(stdout, "     -anb As -ano, to a binary file of columns\n");
 		fprintf(stdout, "Output:\n");
 		fprintf(stdout,	"     -dbm Plot Rxd signal power instead of field strength\n");
 		fprintf(stdout, "     -rt Rx Threshold (dB / dBm / dBuV/m)\n");
 		fprintf(stdout, "     -o Filename. Required. \n");
+		fprintf(stdout, "     -png Write PNG instead of PPM (as does an -o name ending .png)\n");
+		fprintf(stdout, "     -gt Also write the map's dB / dBm / dBuV/m values to a GeoTIFF file\n");
+		fprintf(stdout, "     -gtc Write the GeoTIFF as int16 0.1 dB instead of float\n");
+		fprintf(stdout, "     -gtz Deflate the GeoTIFF's tiles\n");
+		fprintf(stdout, "     -xyz Also write the map as web map tiles, dir/z/x/y.png\n");
+		fprintf(stdout, "     -iso Also write the coverage of each colour level as polygons, to GeoJSON or .kml\n");
+		fprintf(stdout, "     -xyzz Zooms of the web map tiles, eg 8,14: Default the map's resolution and 4 out\n");
+		fprintf(stdout, "     -tm Sweep and draw on a transverse Mercator grid about the Tx, cells this many meters apart\n");
 		fprintf(stdout, "     -R Radius (miles/kilometers)\n");
 		fprintf(stdout,	"     -res Pixels per tile. 300/600/1200/3600 (Optional. LIDAR res is within the tile)\n");
 		fprintf(stdout,	"     -pm Propagation model. 1: ITM, 2: LOS, 3: Hata, 4: ECC33,\n");
@@ -1109,12 +1506,20 @@ int main(int argc, char *argv[])
 		fprintf(stdout, "	  10: Plane earth, 11: Egli VHF/UHF, 12: Soil\n");
 		fprintf(stdout,	"     -pe Propagation model mode: 1=Urban,2=Suburban,3=Rural\n");
 		fprintf(stdout,	"     -ked Knife edge diffraction (Already on for ITM)\n");
+		fprintf(stdout,	"     -vs Raster viewshed for LOS maps (-pm 2), faster but approximate\n");
 		fprintf(stdout, "Debugging:\n");
 		fprintf(stdout, "     -t Terrain greyscale background\n");
 		fprintf(stdout, "     -dbg Verbose debug messages\n");
 		fprintf(stdout, "     -ng Normalise Path Profile graph\n");
 		fprintf(stdout, "     -haf Halve 1 or 2 (optional)\n");
+		fprintf(stdout, "     -sec Sweep only the sector from a bearing to another, eg 300,60\n");
+		fprintf(stdout, "     -secdb Sweep only the sector where the -ant pattern is within this many dB of its peak\n");
+		fprintf(stdout, "     -aoi Only model and draw inside the polygon(s) of a WKT or GeoJSON file\n");
 		fprintf(stdout, "     -nothreads Turn off threaded processing\n");
+		fprintf(stdout, "     -pkt Packet ray tracing: trace 4 to 16 adjacent rays together\n");
+		fprintf(stdout, "     -polar Compute on a Tx centred polar grid, then convert to the map\n");
+		fprintf(stdout, "     -et Stop rays this many dB below the receiver threshold (-rt)\n");
+		fprintf(stdout, "     -etd Distance rays must stay below before stopping: Default 1 mi/km\n");
 
 		fflush(stdout);
 
@@ -1218,19 +1623,28 @@ int main(int argc, char *argv[])
 
 			if (z <= y && argv[z][0] && argv[z][0] != '-') {
 				strncpy(mapfile, argv[z], 253);
+
+				/* A .png name picks the PNG backend, which puts
+				   the extension back on each map it names */
+				if ((s = strrchr(mapfile, '.')) != NULL && s > mapfile
+				    && (strcmp(s, ".png") == 0 || strcmp(s, ".PNG") == 0)) {
+					image_set_format(IMAGE_PNG);
+					*s = 0;
+				}
+
 				strncpy(tx_site[0].name, "Tx", 2);
-				strncpy(tx_site[0].filename, argv[z], 253);
+				strncpy(tx_site[0].filename, mapfile, 253);
 				/* Antenna pattern files have the same basic name as the output file
-				 * but with a different extension. If they exist, load them now */
-				if( (az_filename = (char*) calloc(strlen(argv[z]) + strlen(AZ_FILE_SUFFIX) + 1, sizeof(char))) == NULL )
+				 * (less any .png) but with a different extension. If they exist, load them now */
+				if( (az_filename = (char*) calloc(strlen(mapfile) + strlen(AZ_FILE_SUFFIX) + 1, sizeof(char))) == NULL )
 					return ENOMEM;
-				strcpy(az_filename, argv[z]);
+				strcpy(az_filename, mapfile);
 				strcat(az_filename, AZ_FILE_SUFFIX);
-				if( (el_filename = (char*) calloc(strlen(argv[z]) + strlen(EL_FILE_SUFFIX) + 1, sizeof(char))) == NULL ){
+				if( (el_filename = (char*) calloc(strlen(mapfile) + strlen(EL_FILE_SUFFIX) + 1, sizeof(char))) == NULL ){
 					free(az_filename);
 					return ENOMEM;
 				}
-				strcpy(el_filename, argv[z]);
+				strcpy(el_filename, mapfile);
 				strcat(el_filename, EL_FILE_SUFFIX);
 				if( (result = LoadPAT(az_filename,el_filename)) != 0 ){
 					fprintf(stderr,"Permissions error reading antenna pattern file\n");
@@ -1250,6 +1664,9 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		if (strcmp(argv[x], "-png") == 0)
+			image_set_format(IMAGE_PNG);
+
 		if (strcmp(argv[x], "-so") == 0) {
 			z = x + 1;
 			if(image_set_library(argv[z]) != 0){
@@ -1388,6 +1805,21 @@ int main(int argc, char *argv[])
 			if (z <= y && argv[z][0] && argv[z][0] != '-') {
 				sscanf(argv[z], "%lf", &altitudeLR);
 				sscanf(argv[z], "%f", &tx_site[1].alt);
+
+				/* Further heights may follow, comma separated */
+
+				for (rx_height_count = 0, s = argv[z];
+				     s != NULL && *s; rx_height_count++) {
+					if (rx_height_count == MAX_RX_HEIGHTS) {
+						fprintf(stderr,
+							"ERROR: No more than %d Rx heights",
+							MAX_RX_HEIGHTS);
+						exit(EINVAL);
+					}
+
+					rx_heights[rx_height_count] = strtod(s, &s);
+					s = (*s == ',' ? s + 1 : NULL);
+				}
 			}
 		}
 
@@ -1404,6 +1836,21 @@ int main(int argc, char *argv[])
 
 			if (z <= y && argv[z][0] && argv[z][0] != '-') {
 				sscanf(argv[z], "%lf", &LR.frq_mhz);
+
+				/* Further frequencies may follow, comma separated */
+
+				for (band_count = 0, s = argv[z];
+				     s != NULL && *s; band_count++) {
+					if (band_count == MAX_BANDS) {
+						fprintf(stderr,
+							"ERROR: No more than %d frequencies",
+							MAX_BANDS);
+						exit(EINVAL);
+					}
+
+					frequencies[band_count] = strtod(s, &s);
+					s = (*s == ',' ? s + 1 : NULL);
+				}
 			}
 		}
 
@@ -1535,6 +1982,12 @@ int main(int argc, char *argv[])
 			knifeedge = 1;
 		}
 
+		//Raster viewshed for LOS maps
+		if (strcmp(argv[x], "-vs") == 0) {
+			z = x + 1;
+			viewshed = true;
+		}
+
 		//Normalise Path Profile chart
 		if (strcmp(argv[x], "-ng") == 0) {
 			z = x + 1;
@@ -1548,12 +2001,188 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		//Sector window for directional antennas
+		if (strcmp(argv[x], "-sec") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				if ((s = strchr(argv[z], ',')) == NULL) {
+					fprintf(stderr,
+						"ERROR: A sector is a start and an end bearing, eg 300,60");
+					exit(EINVAL);
+				}
+
+				*s++ = 0;
+				sector_start = fmod(ReadBearing(argv[z]) + 360.0, 360.0);
+				sector_end = fmod(ReadBearing(s) + 360.0, 360.0);
+				sector = true;
+			}
+		}
+
+		if (strcmp(argv[x], "-secdb") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				sscanf(argv[z], "%lf", &sector_cutoff);
+			}
+		}
+
+		//Area of interest
+		if (strcmp(argv[x], "-aoi") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				aoi_file = argv[z];
+			}
+		}
+
 		//Disable threads
 		if (strcmp(argv[x], "-nothreads") == 0) {
 			z = x + 1;
 			use_threads = false;
 		}
 
+		//Packet ray tracing
+		if (strcmp(argv[x], "-pkt") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0]) {
+				sscanf(argv[z], "%d", &packet);
+			}
+		}
+
+		//Polar grid propagation
+		if (strcmp(argv[x], "-polar") == 0) {
+			z = x + 1;
+			polar = true;
+		}
+
+		//Batch mode site list
+		if (strcmp(argv[x], "-batch") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				batch_file = argv[z];
+			}
+		}
+
+		//Best server composite of the batch sites
+		if (strcmp(argv[x], "-bs") == 0) {
+			z = x + 1;
+			best_server = true;
+		}
+
+		//Loss map to save, or to redraw instead of propagating
+		if (strcmp(argv[x], "-lf") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				loss_file = argv[z];
+			}
+		}
+
+		if (strcmp(argv[x], "-lfc") == 0) {
+			z = x + 1;
+			compact_loss = true;
+		}
+
+		if (strcmp(argv[x], "-lfa") == 0) {
+			z = x + 1;
+			angle_map = true;
+		}
+
+		if (strcmp(argv[x], "-rr") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				rerender_file = argv[z];
+			}
+		}
+
+		//GeoTIFF of the values drawn
+		if (strcmp(argv[x], "-gt") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				raster_file = argv[z];
+			}
+		}
+
+		if (strcmp(argv[x], "-gtc") == 0) {
+			z = x + 1;
+			compact_raster = true;
+		}
+
+		if (strcmp(argv[x], "-gtz") == 0) {
+			z = x + 1;
+			compress_raster = true;
+		}
+
+		//Alphanumeric output, as text or as binary columns
+		if (strcmp(argv[x], "-ano") == 0 || strcmp(argv[x], "-anb") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				strncpy(ano_filename, argv[z], 253);
+				ano_binary = (strcmp(argv[x], "-anb") == 0);
+			}
+		}
+
+		//Metric grid
+		if (strcmp(argv[x], "-tm") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				sscanf(argv[z], "%lf", &tm_spacing);
+			}
+		}
+
+		//Coverage polygons
+		if (strcmp(argv[x], "-iso") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				contour_file = argv[z];
+			}
+		}
+
+		//Web map tiles
+		if (strcmp(argv[x], "-xyz") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				tile_dir = argv[z];
+			}
+		}
+
+		if (strcmp(argv[x], "-xyzz") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0] && argv[z][0] != '-') {
+				if (sscanf(argv[z], "%d,%d", &tile_zmin, &tile_zmax) != 2) {
+					fprintf(stderr,
+						"ERROR: Web map zooms are the least and the most, eg 8,14");
+					exit(EINVAL);
+				}
+			}
+		}
+
+		//Co-channel interference of the batch sites
+		if (strcmp(argv[x], "-ci") == 0) {
+			z = x + 1;
+			interference = true;
+		}
+
+		if (strcmp(argv[x], "-nf") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0]) {
+				sscanf(argv[z], "%lf", &noise_floor);
+			}
+		}
+
+		//Early ray termination margin (dB) and distance
+		if (strcmp(argv[x], "-et") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0]) {
+				sscanf(argv[z], "%lf", &et_margin);
+				early_termination = true;
+			}
+		}
+
+		if (strcmp(argv[x], "-etd") == 0) {
+			z = x + 1;
+			if (z <= y && argv[z][0]) {
+				sscanf(argv[z], "%lf", &et_distance);
+			}
+		}
+
 		// Reliability % for ITM model
 		if (strcmp(argv[x], "-rel") == 0) {
 			z = x + 1;
@@ -1563,10 +2192,42 @@ int main(int argc, char *argv[])
 				sscanf(argv[z], "%lf", &LR.conf);
 				LR.rel=LR.rel/100;
 				LR.conf=LR.conf/100;
+
+				/* Further percentiles may follow, comma separated */
+
+				for (rel_count = 0, s = argv[z];
+				     s != NULL && *s; rel_count++) {
+					if (rel_count == MAX_PERCENTILES) {
+						fprintf(stderr,
+							"ERROR: No more than %d reliabilities",
+							MAX_PERCENTILES);
+						exit(EINVAL);
+					}
+
+					reliabilities[rel_count] = strtod(s, &s) / 100;
+					s = (*s == ',' ? s + 1 : NULL);
+				}
 			}
 		}
 	}
 
+	if (batch_file != NULL) {
+		if ((result = LoadSites(batch_file, &batch_sites, &batch_channels,
+					 &batch_count)) != 0) {
+			fprintf(stderr, "Error loading site list %s\n", batch_file);
+			exit(result);
+		}
+
+		/* The first site stands in for -lat/-lon/-txh if not given */
+
+		if (tx_site[0].lat == 91.0 && tx_site[0].lon == 361.0) {
+			tx_site[0].lat = batch_sites[0].lat;
+			tx_site[0].lon = batch_sites[0].lon;
+			tx_site[0].alt = batch_sites[0].alt;
+			txsites = 1;
+		}
+	}
+
 	/* ERROR DETECTION */
 	if (tx_site[0].lat > 90 || tx_site[0].lat < -90) {
 		fprintf(stderr,
@@ -1580,10 +2241,14 @@ int main(int argc, char *argv[])
 		exit(EINVAL);
 
 	}
-	if (LR.frq_mhz < 20 || LR.frq_mhz > 100000) {
-		fprintf(stderr,
-			"ERROR: Either the Frequency was missing or out of range!");
-		exit(EINVAL);
+	frequencies[0] = LR.frq_mhz;
+
+	for (z = 0; z < band_count; z++) {
+		if (frequencies[z] < 20 || frequencies[z] > 100000) {
+			fprintf(stderr,
+				"ERROR: Either the Frequency was missing or out of range!");
+			exit(EINVAL);
+		}
 	}
 	if (LR.erp > 500000000) {
 		fprintf(stderr, "ERROR: Power was out of range!");
@@ -1613,6 +2278,21 @@ int main(int argc, char *argv[])
 		exit(EINVAL);
 	}
 
+	for (z = 1; z < rx_height_count; z++) {
+		if (rx_heights[z] < 0 || rx_heights[z] > 60000) {
+			fprintf(stderr,
+				"ERROR: Rx altitude above ground was too high!");
+			exit(EINVAL);
+		}
+	}
+
+	if (rx_height_count > 1 && (ppa != 0 || propmodel == 2 || packet != 0
+				    || polar || batch_count > 0 || to_stdout)) {
+		fprintf(stderr,
+			"ERROR: Several Rx heights need area coverage by ray, with an -o file");
+		exit(EINVAL);
+	}
+
 	if(!lidar){
 		if (ippd < 300 || ippd > 10000) {
 			fprintf(stderr, "ERROR: resolution out of range!");
@@ -1625,9 +2305,29 @@ int main(int argc, char *argv[])
 			"ERROR: Receiver threshold out of range (-200 / +240)");
 		exit(EINVAL);
 	}
-	if (propmodel > 2 && propmodel < 7 && LR.frq_mhz < 150) {
+	for (z = 0; z < band_count; z++) {
+		if (propmodel > 2 && propmodel < 7 && frequencies[z] < 150) {
+			fprintf(stderr,
+				"ERROR: Frequency too low for Propagation model");
+			exit(EINVAL);
+		}
+	}
+
+	if (band_count > 1 && (ppa != 0 || propmodel == 2 || packet != 0
+			       || polar || batch_count > 0 || to_stdout
+			       || rx_height_count > 1)) {
 		fprintf(stderr,
-			"ERROR: Frequency too low for Propagation model");
+			"ERROR: Several frequencies need area coverage by ray at one Rx height, with an -o file");
+		exit(EINVAL);
+	}
+
+	reliabilities[0] = LR.rel;
+
+	if (rel_count > 1 && (propmodel != 1 || packet != 0 || polar
+			      || batch_count > 0 || to_stdout
+			      || rx_height_count > 1 || band_count > 1)) {
+		fprintf(stderr,
+			"ERROR: Several reliabilities need ITM area coverage by ray at one Rx height and band, with an -o file");
 		exit(EINVAL);
 	}
 
@@ -1637,6 +2337,100 @@ int main(int argc, char *argv[])
 		exit(EINVAL);
 	}
 
+	if (batch_count > 0 && (propmodel == 2 || ppa != 0)) {
+		fprintf(stderr,
+			"ERROR: Batch mode needs area coverage with a propagation model other than LOS");
+		exit(EINVAL);
+	}
+
+	if (best_server && (batch_count == 0 || batch_count > MAX_BEST_SERVER
+			    || to_stdout)) {
+		fprintf(stderr,
+			"ERROR: Best server needs a -batch list of up to %d sites and an -o file",
+			MAX_BEST_SERVER);
+		exit(EINVAL);
+	}
+
+	if (interference && (batch_count == 0 || LR.erp == 0.0 || to_stdout)) {
+		fprintf(stderr,
+			"ERROR: C/I needs a -batch list, an -erp and an -o file");
+		exit(EINVAL);
+	}
+
+	if ((loss_file != NULL || rerender_file != NULL || raster_file != NULL)
+	    && (ppa != 0 || propmodel == 2 || batch_count > 0 || to_stdout)) {
+		fprintf(stderr,
+			"ERROR: Loss maps and GeoTIFFs need single site area coverage by ray, with an -o file");
+		exit(EINVAL);
+	}
+
+	if (angle_map && (loss_file == NULL || compact_loss)) {
+		fprintf(stderr,
+			"ERROR: An angle map needs -lf and is always saved as float");
+		exit(EINVAL);
+	}
+
+	if (rerender_file != NULL && (loss_file != NULL || rx_height_count > 1
+				      || band_count > 1 || rel_count > 1)) {
+		fprintf(stderr,
+			"ERROR: A loss map is redrawn on its own, without -lf or lists");
+		exit(EINVAL);
+	}
+
+	if (sector && (sector_cutoff != 0.0 || sector_start == sector_end)) {
+		fprintf(stderr,
+			"ERROR: A sector is either two different bearings or a -secdb cutoff");
+		exit(EINVAL);
+	}
+
+	if (tm_spacing != 0.0 && (ppa != 0 || propmodel == 2 || batch_count > 0
+				  || polar || loss_file != NULL || rerender_file != NULL
+				  || raster_file != NULL || tile_dir != NULL
+				  || contour_file != NULL || rx_height_count > 1
+				  || band_count > 1 || rel_count > 1)) {
+		fprintf(stderr,
+			"ERROR: A metric grid is drawn from single site area coverage by ray, without lists, -polar, -lf, -gt, -xyz or -iso");
+		exit(EINVAL);
+	}
+
+	if ((sector || sector_cutoff != 0.0) && (ppa != 0 || viewshed)) {
+		fprintf(stderr,
+			"ERROR: A sector limits the rays of an area sweep");
+		exit(EINVAL);
+	}
+
+	if (sector_cutoff != 0.0) {
+		if (sector_cutoff < 0.0 || !got_elevation_pattern) {
+			fprintf(stderr,
+				"ERROR: -secdb needs a positive cutoff and an antenna pattern (.az and .el)");
+			exit(EINVAL);
+		}
+
+		sector = PatternSector(sector_cutoff);
+
+		if (debug) {
+			if (sector)
+				fprintf(stderr, "Sector %.0f to %.0f degrees\n",
+					sector_start, sector_end);
+			else
+				fprintf(stderr, "Pattern within %.1f dB all round, no sector\n",
+					sector_cutoff);
+		}
+	}
+
+	if (early_termination && (contour_threshold == 0 || et_margin < 0.0
+				  || et_distance < 0.0)) {
+		fprintf(stderr,
+			"ERROR: Early termination needs a receiver threshold (-rt) and a positive margin and distance");
+		exit(EINVAL);
+	}
+
+	if (packet != 0 && (packet < 4 || packet > MAX_PACKET)) {
+		fprintf(stderr,
+			"ERROR: Packet size out of range (4 / %d)", MAX_PACKET);
+		exit(EINVAL);
+	}
+
 	if(resample > 10){
 		fprintf(stderr,
 			"ERROR: Cannot resample higher than a factor of 10");
@@ -1644,13 +2438,20 @@ int main(int argc, char *argv[])
 	}
 	if (metric) {
 		altitudeLR /= METERS_PER_FOOT;	/* 10ft * 0.3 = 3.3m */
+		for (z = 1; z < rx_height_count; z++)
+			rx_heights[z] /= METERS_PER_FOOT;
 		max_range /= KM_PER_MILE;	/* 10 / 1.6 = 7.5 */
 		altitude /= METERS_PER_FOOT;
 		tx_site[0].alt /= METERS_PER_FOOT;	/* Feet to metres */
 		tx_site[1].alt /= METERS_PER_FOOT;	/* Feet to metres */
 		clutter /= METERS_PER_FOOT;	/* Feet to metres */
+		et_distance /= KM_PER_MILE;
+		for (z = 0; z < batch_count; z++)
+			batch_sites[z].alt /= METERS_PER_FOOT;
 	}
 
+	rx_heights[0] = altitudeLR;
+
 	/* Ensure a trailing '/' is present in sdf_path */
 
 	if (sdf_path[0]) {
@@ -1749,13 +2550,19 @@ int main(int argc, char *argv[])
 		}
 
 		if (area_mode || topomap) {
-			for (z = 0; z < txsites && z < max_txsites; z++) {
+			/* In batch mode load the union of every site's tiles */
+
+			struct site *area_sites = (batch_count > 0 ? batch_sites : tx_site);
+			int area_count = (batch_count > 0 ? batch_count :
+					  (txsites < max_txsites ? txsites : max_txsites));
+
+			for (z = 0; z < area_count; z++) {
 				/* "Ball park" estimates used to load any additional
 				   SDF files required to conduct this analysis. */
 
 				tx_range =
 					sqrt(1.5 *
-					 (tx_site[z].alt + GetElevation(tx_site[z])));
+					 (area_sites[z].alt + GetElevation(area_sites[z])));
 
 				if (LRmap)
 					rx_range = sqrt(1.5 * altitudeLR);
@@ -1783,9 +2590,9 @@ int main(int argc, char *argv[])
 				// No more than 8 degs
 				deg_limit = 3.5;
 
-				if (fabs(tx_site[z].lat) < 70.0)
+				if (fabs(area_sites[z].lat) < 70.0)
 					deg_range_lon =
-						deg_range / cos(DEG2RAD * tx_site[z].lat);
+						deg_range / cos(DEG2RAD * area_sites[z].lat);
 				else
 					deg_range_lon = deg_range / cos(DEG2RAD * 70.0);
 
@@ -1797,10 +2604,10 @@ int main(int argc, char *argv[])
 				if (deg_range_lon > deg_limit)
 					deg_range_lon = deg_limit;
 
-				nortRxHin = (int)floor(tx_site[z].lat - deg_range);
-				nortRxHax = (int)floor(tx_site[z].lat + deg_range);
+				nortRxHin = (int)floor(area_sites[z].lat - deg_range);
+				nortRxHax = (int)floor(area_sites[z].lat + deg_range);
 
-				west_min = (int)floor(tx_site[z].lon - deg_range_lon);
+				west_min = (int)floor(area_sites[z].lon - deg_range_lon);
 
 				while (west_min < 0)
 					west_min += 360;
@@ -1808,7 +2615,7 @@ int main(int argc, char *argv[])
 				while (west_min >= 360)
 					west_min -= 360;
 
-				west_max = (int)floor(tx_site[z].lon + deg_range_lon);
+				west_max = (int)floor(area_sites[z].lon + deg_range_lon);
 
 				while (west_max < 0)
 					west_max += 360;
@@ -1865,18 +2672,77 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (aoi_file != NULL) {
+		if ((result = LoadAOI(aoi_file)) != 0) {
+			fprintf(stderr, "Error reading area of interest %s\n",
+				aoi_file);
+			return result;
+		}
+	}
+
 	if(max_range>100 || LR.frq_mhz==446.446){
 		cropping=false;
 	}
-	if (ppa == 0) {
+	if (batch_count > 0) {
+		/* Every site in the list, each to its own file */
+
+		if( (result = PlotBatch(batch_sites, batch_channels, batch_count,
+				       altitudeLR, propmodel, knifeedge, pmenv,
+				       packet, polar, use_threads, geo, kml, ngs,
+				       mapfile, best_server, interference,
+				       noise_floor)) != 0 )
+			return result;
+
+		free(batch_sites);
+		free(batch_channels);
+	} else if (ppa == 0) {
 		if (propmodel == 2) {
 			cropping = false;
-			PlotLOSMap(tx_site[0], altitudeLR, ano_filename, use_threads);
+			PlotLOSMap(tx_site[0], altitudeLR, ano_filename, use_threads,
+				   viewshed);
 			DoLOS(mapfile, geo, kml, ngs, tx_site, txsites);
+
+			if (tile_dir != NULL &&
+			    (result = DoXYZ(tile_dir, tile_zmin, tile_zmax, 1, tx_site)) != 0)
+				return result;
 		} else {
-			// 90% of effort here
-			PlotPropagation(tx_site[0], altitudeLR, ano_filename,
-					propmodel, knifeedge, haf, pmenv, use_threads);
+			/* A layer for each further Rx height or band */
+
+			for (z = 1; z < rx_height_count; z++)
+				height_layers[z] = alloc_layer(false);
+
+			for (z = 1; z < band_count; z++)
+				band_layers[z] = alloc_layer(false);
+
+			for (z = 1; z < rel_count; z++)
+				rel_layers[z] = alloc_layer(false);
+
+			if (loss_file != NULL || raster_file != NULL)
+				AllocLossMap(angle_map);
+
+			if (rerender_file != NULL) {
+				/* The map, cropped as it was, comes from the file */
+
+				cropping = false;
+
+				if ((result = ReadLossMap(rerender_file)) != 0) {
+					fprintf(stderr, "Error reading loss map %s\n",
+						rerender_file);
+					return result;
+				}
+			} else {
+				if (tm_spacing != 0.0 &&
+				    (result = AllocMetricGrid(tm_spacing, tx_site[0])) != 0) {
+					fprintf(stderr, "Error: bad metric grid spacing %g m for the radius\n",
+						tm_spacing);
+					return result;
+				}
+
+				// 90% of effort here
+				PlotPropagation(tx_site[0], altitudeLR, ano_filename,
+						propmodel, knifeedge, haf, pmenv, use_threads,
+						packet, polar);
+			}
 
                         if(debug)
                         	fprintf(stderr,"Finished PlotPropagation()\n");
@@ -1888,33 +2754,63 @@ int main(int argc, char *argv[])
 					for (float y=-0.001; y<0.001;y=y+0.0001){
 						if(GetSignal(tx_site[0].lat+y, tx_site[0].lon+x)<=0){
 							PutSignal(tx_site[0].lat+y, tx_site[0].lon+x, hottest);
+							GrowSignalBounds(tx_site[0].lat+y, tx_site[0].lon+x);
 						}
 					}
 				}
 
+			MergeSignalBounds();
+
+			if (tm_grid != NULL) {
+				/* The map is the grid, a cell a pixel */
+
+				cropping = false;
+				width = height = tm_grid->size;
+			}
+
 			if(cropping){
-				// CROPPING. Factor is determined in propPathLoss().
-				// cropLon is the circle radius in pixels at it's widest (east/west) 
-				cropLon*=dpp; // pixels to degrees
-				max_north=cropLat; // degrees
-				max_west=cropLon+tx_site[0].lon; // degrees west (positive)
-				cropLat-=tx_site[0].lat; // angle from tx to edge
+				/* Crop to the pixels drawn above -rt, as
+				   merged from every sweep thread, so that row 0 and
+				   column 0 sample the most northerly and westerly */
+
+				max_north = signal_bounds.north + dpp;
+				max_west = tx_site[0].lon + signal_bounds.west;
+
+				if (max_west < 0.0)
+					max_west += 360.0;
+
+				if (max_west >= 360.0)
+					max_west -= 360.0;
+
+				height = (int)rint((signal_bounds.north - signal_bounds.south) * ppd) + 1;
+				width = (int)rint((signal_bounds.west - signal_bounds.east) * ppd) + 1;
 
-			
 				if(debug)
-					fprintf(stderr,"Cropping 1: max_west: %.4f cropLat: %.4f cropLon: %.4f longitude: %.5f dpp %.7f\n",max_west,cropLat,cropLon,tx_site[0].lon,dpp);
-					width=(int)((cropLon*ppd)*2);
-					height=(int)((cropLat*ppd)*2);
+					fprintf(stderr,"Cropping: max_north: %.4f max_west: %.4f longitude: %.5f %d x %d\n",max_north,max_west,tx_site[0].lon,width,height);
 
-					if(debug)
-						fprintf(stderr,"Cropping 2: max_west: %.4f cropLat: %.4f cropLon: %.7f longitude: %.5f width %d\n",max_west,cropLat,cropLon,tx_site[0].lon,width);
+				if(width>3600*10 || !signal_bounds.found){
+					fprintf(stderr,"FATAL BOUNDS! max_west: %.4f max_north: %.4f longitude: %.5f width %d\n",max_west,max_north,tx_site[0].lon,width);
+					return 0;
+				}
+			}
 
-					if(width>3600*10 || cropLon < 0){
-						fprintf(stderr,"FATAL BOUNDS! max_west: %.4f cropLat: %.4f cropLon: %.7f longitude: %.5f\n",max_west,cropLat,cropLon,tx_site[0].lon);
-						return 0;
-					}
+			if (loss_file != NULL &&
+			    (result = WriteLossMap(loss_file, compact_loss)) != 0) {
+				fprintf(stderr, "Error writing loss map %s\n",
+					loss_file);
+				return result;
+			}
+
+			if (raster_file != NULL &&
+			    (result = WriteGeoTIFF(raster_file, compact_raster,
+						   compress_raster)) != 0) {
+				fprintf(stderr, "Error writing GeoTIFF %s\n",
+					raster_file);
+				return result;
 			}
 
+			FreeLossMap();
+
 			// Write bitmap
 			if (LR.erp == 0.0)
 				DoPathLoss(mapfile, geo, kml, ngs, tx_site,
@@ -1925,6 +2821,74 @@ int main(int argc, char *argv[])
 			else
 				if( (result = DoSigStr(mapfile, geo, kml, ngs, tx_site,txsites)) != 0 )
 					return result;
+
+			if (tile_dir != NULL &&
+			    (result = DoXYZ(tile_dir, tile_zmin, tile_zmax, 0, tx_site)) != 0)
+				return result;
+
+			if (contour_file != NULL &&
+			    (result = WriteContours(contour_file, tx_site)) != 0) {
+				fprintf(stderr, "Error writing contours %s\n",
+					contour_file);
+				return result;
+			}
+
+			/* Then each further Rx height to mapfile_<height>,
+			   band to mapfile_<MHz>, at its own frequency, or
+			   reliability to mapfile_<percent> */
+
+			for (z = 1; z < rx_height_count || z < band_count ||
+			     z < rel_count; z++) {
+				struct layer *l;
+				char layer_file[255];
+
+				if (band_count > 1) {
+					l = band_layers[z];
+					LR.frq_mhz = frequencies[z];
+					snprintf(layer_file, sizeof(layer_file), "%s_%g",
+						 mapfile, frequencies[z]);
+				} else if (rel_count > 1) {
+					l = rel_layers[z];
+					snprintf(layer_file, sizeof(layer_file), "%s_%g",
+						 mapfile, reliabilities[z] * 100);
+				} else {
+					l = height_layers[z];
+					snprintf(layer_file, sizeof(layer_file), "%s_%g",
+						 mapfile, metric ? rx_heights[z] * METERS_PER_FOOT :
+						 rx_heights[z]);
+				}
+
+				site_layer = l;
+
+				for (float x=-0.001; x<0.001;x=x+0.0001){
+					for (float y=-0.001; y<0.001;y=y+0.0001){
+						if(GetSignal(tx_site[0].lat+y, tx_site[0].lon+x)<=0){
+							PutSignal(tx_site[0].lat+y, tx_site[0].lon+x, l->hottest);
+						}
+					}
+				}
+
+				site_layer = NULL;
+				swap_layer(l);
+
+				if (LR.erp == 0.0)
+					DoPathLoss(layer_file, geo, kml, ngs, tx_site,
+						   txsites);
+				else if (dbm)
+					DoRxdPwr(layer_file, geo, kml, ngs, tx_site,
+						 txsites);
+				else
+					result = DoSigStr(layer_file, geo, kml, ngs,
+							  tx_site, txsites);
+
+				swap_layer(l);
+				free_layer(l);
+
+				if (result != 0)
+					return result;
+			}
+
+			LR.frq_mhz = frequencies[0];
 		}
 		/*if(lidar){
 			east=eastoffset;
@@ -1938,11 +2902,21 @@ int main(int argc, char *argv[])
 			tx_site[0].lon += 360;
 		}
 
-		if (cropping) {
-			fprintf(stderr, "|%.6f", tx_site[0].lat+cropLat);
-			fprintf(stderr, "|%.6f", tx_site[0].lon+cropLon);
-			fprintf(stderr, "|%.6f", tx_site[0].lat-cropLat);
-			fprintf(stderr, "|%.6f|",tx_site[0].lon-cropLon);
+		if (tm_grid != NULL) {
+			/* The extent of the grid, which its world file places */
+			MetricBounds(&tm_bounds[0], &tm_bounds[1], &tm_bounds[2], &tm_bounds[3]);
+			fprintf(stderr, "|%.6f", tm_bounds[0]);
+			fprintf(stderr, "|%.6f", tm_bounds[1]);
+			fprintf(stderr, "|%.6f", tm_bounds[2]);
+			fprintf(stderr, "|%.6f|",tm_bounds[3]);
+			FreeMetricGrid();
+		}else if (cropping) {
+			/* The edges of the cropped map, as rendered */
+			crop_west = (max_west < 180.0 ? -max_west : 360.0 - max_west);
+			fprintf(stderr, "|%.6f", max_north);
+			fprintf(stderr, "|%.6f", crop_west + width * dpp);
+			fprintf(stderr, "|%.6f", max_north - height * dpp);
+			fprintf(stderr, "|%.6f|",crop_west);
 		}else{
 			fprintf(stderr, "|%.6f", max_north);
 			fprintf(stderr, "|%.6f", east);
@@ -5,17 +5,22 @@
 
 #include "common.h"
 
+double arccos(double x, double y);
 int ReduceAngle(double angle);
 double LonDiff(double lon1, double lon2);
 int PutMask(double lat, double lon, int value);
 int OrMask(double lat, double lon, int value);
 int GetMask(double lat, double lon);
 int PutSignal(double lat, double lon, unsigned char signal);
+void GrowSignalBounds(double lat, double lon);
+void MergeSignalBounds(void);
 unsigned char GetSignal(double lat, double lon);
+void PutPower(double lat, double lon, double power);
 double GetElevation(struct site location);
 int AddElevation(double lat, double lon, double height, int size);
 double Distance(struct site site1, struct site site2);
 double Azimuth(struct site source, struct site destination);
+bool InSector(double azimuth, double margin);
 double ElevationAngle(struct site source, struct site destination);
 void ReadPath(struct site source, struct site destination);
 double ElevationAngle2(struct site source, struct site destination, double er);
@@ -28,5 +33,53 @@ void free_path(void);
 void alloc_elev(void);
 void alloc_path(void);
 void do_allocs(void);
+struct layer *alloc_layer(bool power);
+void clear_layer(struct layer *l);
+void free_layer(struct layer *l);
+void swap_layer(struct layer *l);
+
+/* A plane of values laid out like dem[].signal, for every page in
+   use (NULL for the others), each pixel set to fill */
+template <typename T, typename V> T ***allocPlanes(V fill)
+{
+	int i, j, k;
+	T ***planes = new T **[MAXPAGES];
+
+	for (i = 0; i < MAXPAGES; i++) {
+		planes[i] = NULL;
+
+		if (dem[i].max_north < dem[i].min_north)
+			continue;
+
+		planes[i] = new T *[ippd];
+
+		for (j = 0; j < ippd; j++) {
+			planes[i][j] = new T[ippd];
+
+			for (k = 0; k < ippd; k++)
+				planes[i][j][k] = fill;
+		}
+	}
+
+	return planes;
+}
+
+template <typename T> void freePlanes(T ***planes)
+{
+	int i, j;
+
+	if (planes == NULL)
+		return;
+
+	for (i = 0; i < MAXPAGES; i++) {
+		if (planes[i] == NULL)
+			continue;
+
+		for (j = 0; j < ippd; j++)
+			delete [] planes[i][j];
+		delete [] planes[i];
+	}
+	delete [] planes;
+}
 
 #endif /* _MAIN_HH_ */
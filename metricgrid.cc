@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "main.hh"
+#include "metricgrid.hh"
+
+/* WGS84 */
+#define TM_A 6378137.0
+#define TM_E2 0.00669437999014
+#define TM_INVF 298.257223563
+
+/* Most cells across, as for the width of a cropped map */
+#define METRIC_MAX_SIZE 36000
+
+struct metric_grid *tm_grid = NULL;
+
+/* Series for the meridian arc and its inverse (Snyder, Map
+   Projections: A Working Manual, 1987), and the arc at the Tx */
+static double arc[4], foot[4], ep2, arc0;
+
+/* The accessors are called several times over for each point of a
+   path, so the last point looked up is kept */
+static thread_local double last_lat = 1000.0, last_lon = 1000.0;
+static thread_local long last_cell = -1;
+
+static double MeridianArc(double phi)
+{
+	return TM_A * (arc[0] * phi - arc[1] * sin(2.0 * phi) +
+		       arc[2] * sin(4.0 * phi) - arc[3] * sin(6.0 * phi));
+}
+
+static void Forward(double lat, double lon, double *x, double *y)
+{
+	/* Metres east and north of the Tx of lat/lon (degrees west) */
+
+	double phi = lat * DEG2RAD, s = sin(phi), c = cos(phi), t = s / c,
+	    n = TM_A / sqrt(1.0 - TM_E2 * s * s), tt = t * t, cc = ep2 * c * c,
+	    a = LonDiff(tm_grid->lon, lon) * DEG2RAD * c, a2 = a * a;
+
+	*x = n * a * (1.0 + a2 * ((1.0 - tt + cc) / 6.0 +
+		      a2 * (5.0 - 18.0 * tt + tt * tt + 72.0 * cc - 58.0 * ep2) / 120.0));
+
+	*y = MeridianArc(phi) - arc0 +
+	    n * t * a2 * (0.5 + a2 * ((5.0 - tt + 9.0 * cc + 4.0 * cc * cc) / 24.0 +
+		      a2 * (61.0 - 58.0 * tt + tt * tt + 600.0 * cc - 330.0 * ep2) / 720.0));
+}
+
+static void Inverse(double x, double y, double *lat, double *lon)
+{
+	/* The lat/lon (degrees west) x metres east and y north of
+	   the Tx */
+
+	double mu = (arc0 + y) / (TM_A * arc[0]), phi, s, c, t, n, r, tt, cc,
+	    d, d2, w;
+
+	phi = mu + foot[0] * sin(2.0 * mu) + foot[1] * sin(4.0 * mu) +
+	    foot[2] * sin(6.0 * mu) + foot[3] * sin(8.0 * mu);
+
+	s = sin(phi);
+	c = cos(phi);
+	t = s / c;
+	w = 1.0 - TM_E2 * s * s;
+	n = TM_A / sqrt(w);
+	r = TM_A * (1.0 - TM_E2) / (w * sqrt(w));
+	tt = t * t;
+	cc = ep2 * c * c;
+	d = x / n;
+	d2 = d * d;
+
+	*lat = (phi - (n * t / r) * d2 *
+		(0.5 - d2 * ((5.0 + 3.0 * tt + 10.0 * cc - 4.0 * cc * cc - 9.0 * ep2) / 24.0 -
+		 d2 * (61.0 + 90.0 * tt + 298.0 * cc + 45.0 * tt * tt - 252.0 * ep2 -
+		       3.0 * cc * cc) / 720.0))) / DEG2RAD;
+
+	*lon = tm_grid->lon - d * (1.0 - d2 * ((1.0 + 2.0 * tt + cc) / 6.0 -
+		d2 * (5.0 - 2.0 * cc + 28.0 * tt - 3.0 * cc * cc + 8.0 * ep2 +
+		      24.0 * tt * tt) / 120.0)) / c / DEG2RAD;
+
+	if (*lon < 0.0)
+		*lon += 360.0;
+
+	if (*lon >= 360.0)
+		*lon -= 360.0;
+}
+
+void MetricSite(double column, double row, double *lat, double *lon)
+{
+	/* The lat/lon (degrees west) of a point of the grid, in cells
+	   east of its west edge and south of its north edge */
+
+	Inverse((column - tm_grid->half) * tm_grid->spacing,
+		(tm_grid->half - row) * tm_grid->spacing, lat, lon);
+}
+
+long MetricCell(double lat, double lon)
+{
+	/* The cell of lat/lon (degrees west), -1 off the grid */
+
+	double x, y;
+	int column, row;
+
+	if (lat == last_lat && lon == last_lon)
+		return last_cell;
+
+	Forward(lat, lon, &x, &y);
+
+	column = tm_grid->half + (int)rint(x / tm_grid->spacing);
+	row = tm_grid->half - (int)rint(y / tm_grid->spacing);
+
+	last_lat = lat;
+	last_lon = lon;
+	last_cell = (column >= 0 && column < tm_grid->size && row >= 0 &&
+		     row < tm_grid->size ? (long)row * tm_grid->size + column : -1);
+
+	return last_cell;
+}
+
+int AllocMetricGrid(double spacing, struct site xmtr)
+{
+	/* Sets up a grid of cells spacing metres apart about xmtr,
+	   out to max_range, with the elevation under each cell */
+
+	struct metric_grid *g;
+	struct site cell;
+	double e1, e2 = TM_E2 * TM_E2, e3 = e2 * TM_E2, feet;
+	size_t cells, i;
+	int half;
+
+	if (spacing <= 0.0 ||
+	    2.0 * ceil(max_range * METERS_PER_MILE / spacing) + 1.0 > METRIC_MAX_SIZE)
+		return EINVAL;
+
+	half = (int)ceil(max_range * METERS_PER_MILE / spacing);
+
+	arc[0] = 1.0 - TM_E2 / 4.0 - 3.0 * e2 / 64.0 - 5.0 * e3 / 256.0;
+	arc[1] = 3.0 * TM_E2 / 8.0 + 3.0 * e2 / 32.0 + 45.0 * e3 / 1024.0;
+	arc[2] = 15.0 * e2 / 256.0 + 45.0 * e3 / 1024.0;
+	arc[3] = 35.0 * e3 / 3072.0;
+
+	e1 = (1.0 - sqrt(1.0 - TM_E2)) / (1.0 + sqrt(1.0 - TM_E2));
+	foot[0] = 1.5 * e1 - 27.0 * e1 * e1 * e1 / 32.0;
+	foot[1] = 21.0 * e1 * e1 / 16.0 - 55.0 * e1 * e1 * e1 * e1 / 32.0;
+	foot[2] = 151.0 * e1 * e1 * e1 / 96.0;
+	foot[3] = 1097.0 * e1 * e1 * e1 * e1 / 512.0;
+
+	ep2 = TM_E2 / (1.0 - TM_E2);
+	arc0 = MeridianArc(xmtr.lat * DEG2RAD);
+
+	g = new struct metric_grid;
+	g->spacing = spacing;
+	g->lat = xmtr.lat;
+	g->lon = xmtr.lon;
+	g->half = (half > 0 ? half : 1);
+	g->size = 2 * g->half + 1;
+
+	cells = (size_t)g->size * g->size;
+	g->signal = new unsigned char[cells];
+	g->mask = new unsigned char[cells];
+	g->processed = new bool[cells];
+	g->elevation = new short[cells];
+
+	memset(g->signal, 0, cells);
+	memset(g->mask, 0, cells);
+	memset(g->processed, 0, cells * sizeof(bool));
+
+	tm_grid = g;
+
+	/* The terrain the map is drawn over, from the pages */
+
+	for (i = 0; i < cells; i++) {
+		MetricSite((double)(i % g->size), (double)(i / g->size),
+			   &cell.lat, &cell.lon);
+
+		feet = GetElevation(cell);
+		g->elevation[i] = (feet == -5000.0 ? METRIC_NO_DEM :
+				   (short)rint(feet / 3.28084));
+	}
+
+	last_lat = last_lon = 1000.0;
+
+	if (debug)
+		fprintf(stderr, "Metric grid: %d x %d cells of %.1f m\n",
+			g->size, g->size, spacing);
+
+	return 0;
+}
+
+void FreeMetricGrid(void)
+{
+	if (tm_grid == NULL)
+		return;
+
+	delete [] tm_grid->signal;
+	delete [] tm_grid->mask;
+	delete [] tm_grid->processed;
+	delete [] tm_grid->elevation;
+	delete tm_grid;
+
+	tm_grid = NULL;
+}
+
+void MetricBounds(double *north, double *east, double *south, double *west)
+{
+	/* The extent of the grid's outer edges in degrees, east
+	   positive, as the stderr bounds line gives it */
+
+	double edge = tm_grid->size - 0.5, lat, lon, diff, tx_east;
+	int i, side;
+
+	*north = *south = tm_grid->lat;
+	*east = *west = 0.0;
+
+	for (i = 0; i <= tm_grid->size; i++)
+		for (side = 0; side < 4; side++) {
+			MetricSite(side < 2 ? i - 0.5 : side == 2 ? -0.5 : edge,
+				   side < 2 ? (side == 0 ? -0.5 : edge) : i - 0.5,
+				   &lat, &lon);
+
+			diff = LonDiff(tm_grid->lon, lon);
+
+			*north = MAX(*north, lat);
+			*south = MIN(*south, lat);
+			*east = MAX(*east, diff);
+			*west = MIN(*west, diff);
+		}
+
+	tx_east = (tm_grid->lon < 180.0 ? -tm_grid->lon : 360.0 - tm_grid->lon);
+	*east += tx_east;
+	*west += tx_east;
+}
+
+int WriteMetricWorld(char *imagefile)
+{
+	/* Writes a world file (.wld) and a .prj beside imagefile,
+	   placing it on the grid's transverse Mercator */
+
+	char name[PATH_MAX], *dot, *slash;
+	double corner = tm_grid->half * tm_grid->spacing;
+	FILE *fd;
+
+	strncpy(name, imagefile, sizeof(name) - 5);
+	name[sizeof(name) - 5] = 0;
+
+	dot = strrchr(name, '.');
+	slash = strrchr(name, '/');
+
+	if (dot == NULL || (slash != NULL && dot < slash) ||
+	    ((slash = strrchr(name, '\\')) != NULL && dot < slash))
+		dot = name + strlen(name);
+
+	strcpy(dot, ".wld");
+
+	if ((fd = fopen(name, "w")) == NULL)
+		return errno;
+
+	/* Cell size, rotations, and the centre of the top left cell */
+
+	fprintf(fd, "%.6f\n0.0\n0.0\n%.6f\n%.6f\n%.6f\n", tm_grid->spacing,
+		-tm_grid->spacing, -corner, corner);
+	fclose(fd);
+
+	strcpy(dot, ".prj");
+
+	if ((fd = fopen(name, "w")) == NULL)
+		return errno;
+
+	fprintf(fd, "PROJCS[\"Transverse Mercator about the Tx\",GEOGCS[\"WGS 84\","
+		"DATUM[\"WGS_1984\",SPHEROID[\"WGS 84\",%.0f,%.9f]],"
+		"PRIMEM[\"Greenwich\",0],UNIT[\"degree\",0.0174532925199433]],"
+		"PROJECTION[\"Transverse_Mercator\"],"
+		"PARAMETER[\"latitude_of_origin\",%.8f],"
+		"PARAMETER[\"central_meridian\",%.8f],"
+		"PARAMETER[\"scale_factor\",1],PARAMETER[\"false_easting\",0],"
+		"PARAMETER[\"false_northing\",0],UNIT[\"metre\",1]]\n",
+		TM_A, TM_INVF, tm_grid->lat,
+		(tm_grid->lon < 180.0 ? -tm_grid->lon : 360.0 - tm_grid->lon));
+	fclose(fd);
+
+	return 0;
+}
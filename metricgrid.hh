@@ -0,0 +1,38 @@
+#ifndef _METRICGRID_HH_
+#define _METRICGRID_HH_
+
+#include "common.h"
+
+/* A metric grid is a transverse Mercator projection of WGS84 centred
+   on the Tx, with square cells a fixed number of metres apart, that
+   the sweep and the map use in place of the degree pages.  Pages
+   hold as many pixels across a degree of longitude as of latitude,
+   so away from the equator they are narrow, and the sweep and the
+   renderer do about 1 / cos(latitude) times the work square cells
+   would need.  While a grid is in use, the signal and mask accessors
+   read and write its cells, and the map is drawn a cell a pixel,
+   north up along the Tx's meridian, with a world file and .prj to
+   place it. */
+
+#define METRIC_NO_DEM (-32768)
+
+struct metric_grid {
+	double spacing;		/* metres between cell centres */
+	double lat, lon;	/* the Tx, the origin (degrees west) */
+	int half, size;		/* size = 2 * half + 1 cells each way */
+	unsigned char *signal, *mask;
+	bool *processed;
+	short *elevation;	/* DEM metres, or METRIC_NO_DEM */
+};
+
+/* The grid in use, NULL unless -tm is set */
+extern struct metric_grid *tm_grid;
+
+int AllocMetricGrid(double spacing, struct site xmtr);
+void FreeMetricGrid(void);
+long MetricCell(double lat, double lon);
+void MetricSite(double x, double y, double *lat, double *lon);
+void MetricBounds(double *north, double *east, double *south, double *west);
+int WriteMetricWorld(char *imagefile);
+
+#endif /* _METRICGRID_HH_ */
@@ -2224,9 +2224,11 @@ double d1thx2(double pfl[], const double &x1, const double &x2,
 	return d1thx2v;
 }
 
-void qlrpfl(double pfl[], int klimx, int mdvarx, prop_type & prop,
-	    propa_type & propa, propv_type & propv)
+static void qlrpfl_terrain(double pfl[], prop_type & prop)
 {
+	/* The part of qlrpfl() that depends only on the profile, the
+	   antenna heights and prop.gme, not on the frequency */
+
 	int np, j;
 	double xl[2], q, za, zb, temp;
 
@@ -2285,7 +2287,11 @@ void qlrpfl(double pfl[], int klimx, int mdvarx, prop_type & prop,
 		prop.he[0] = prop.hg[0] + FORTRAN_DIM(pfl[2], za);
 		prop.he[1] = prop.hg[1] + FORTRAN_DIM(pfl[np + 2], zb);
 	}
+}
 
+static void qlrpfl_setup(int klimx, int mdvarx, prop_type & prop,
+			 propa_type & propa, propv_type & propv)
+{
 	prop.mdp = -1;
 	propv.lvar = mymax(propv.lvar, 3);
 
@@ -2302,6 +2308,13 @@ void qlrpfl(double pfl[], int klimx, int mdvarx, prop_type & prop,
 	lrprop(0.0, prop, propa);
 }
 
+void qlrpfl(double pfl[], int klimx, int mdvarx, prop_type & prop,
+	    propa_type & propa, propv_type & propv)
+{
+	qlrpfl_terrain(pfl, prop);
+	qlrpfl_setup(klimx, mdvarx, prop, propa, propv);
+}
+
 void qlrpfl2(double pfl[], int klimx, int mdvarx, prop_type & prop,
 	     propa_type & propa, propv_type & propv)
 {
@@ -2515,6 +2528,84 @@ Note that point_to_point has become point_to_point_ITM for use as the old ITM
 	errnum = prop.kwx;
 }
 
+void point_to_point_ITM_bands(double tht_m, double rht_m, double eps_dielect,
+			      double sgm_conductivity, double eno_ns_surfref,
+			      const double *frq_mhz, int bands,
+			      int radio_climate, int pol, const double *conf,
+			      const double *rel, int rels, double *dbloss,
+			      int &errnum)
+
+/******************************************************************************
+
+	point_to_point_ITM() over the same elev[] path at each of
+	the bands frequencies in frq_mhz[] and each of the rels
+	confidence/reliability pairs in conf[] and rel[], with the
+	losses returned in dbloss[band * rels + pair] and errnum
+	the worst of them.
+
+	The horizons (hzns), terrain irregularity (d1thx) and
+	effective heights found by qlrpfl() depend on the profile,
+	the antenna heights and the refractivity, not on the
+	frequency, so they are worked out once.  Only qlrps()
+	onward is evaluated per band.  Nothing before avar()
+	depends on the percentiles, and avar() keeps its set up
+	between calls, so each further pair costs little.
+
+*****************************************************************************/
+{
+	prop_type terrain, prop;
+	propv_type propv;
+	propa_type propa;
+	double zsys = 0;
+	double eno, enso, q;
+	long ja, jb, i, np;
+	double fs;
+	int b, k;
+
+	terrain.hg[0] = tht_m;
+	terrain.hg[1] = rht_m;
+	terrain.kwx = 0;
+	terrain.mdp = -1;
+	np = (long)elev[0];
+	eno = eno_ns_surfref;
+	enso = 0.0;
+	q = enso;
+
+	if (q <= 0.0) {
+		ja = (long)(3.0 + 0.1 * elev[0]);	/* added (long) to correct */
+		jb = np - ja + 6;
+
+		for (i = ja - 1; i < jb; ++i)
+			zsys += elev[i];
+
+		zsys /= (jb - ja + 1);
+		q = eno;
+	}
+
+	/* prop.gme, which the horizons use, comes from qlrps() */
+
+	qlrps(frq_mhz[0], zsys, q, pol, eps_dielect, sgm_conductivity, terrain);
+	qlrpfl_terrain(elev, terrain);
+
+	for (b = 0, errnum = 0; b < bands; b++) {
+		prop = terrain;
+		propv.klim = radio_climate;
+		propv.lvar = 5;
+		propv.mdvar = 12;
+
+		qlrps(frq_mhz[b], zsys, q, pol, eps_dielect, sgm_conductivity, prop);
+		qlrpfl_setup(propv.klim, propv.mdvar, prop, propa, propv);
+		fs = 32.45 + 20.0 * log10(frq_mhz[b]) + 20.0 * log10(prop.dist / 1000.0);
+
+		for (k = 0; k < rels; k++)
+			dbloss[b * rels + k] =
+			    avar(qerfi(rel[k]), 0.0, qerfi(conf[k]), prop, propv) + fs;
+
+		if (prop.kwx > errnum)
+			errnum = prop.kwx;
+	}
+}
+
 void point_to_point(double tht_m, double rht_m, double eps_dielect,
 		    double sgm_conductivity, double eno_ns_surfref,
 		    double frq_mhz, int radio_climate, int pol, double conf,
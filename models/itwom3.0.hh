@@ -6,6 +6,12 @@ void point_to_point_ITM(double tht_m, double rht_m, double eps_dielect,
 			double frq_mhz, int radio_climate, int pol,
 			double conf, double rel, double &dbloss, char *strmode,
 			int &errnum);
+void point_to_point_ITM_bands(double tht_m, double rht_m, double eps_dielect,
+			      double sgm_conductivity, double eno_ns_surfref,
+			      const double *frq_mhz, int bands,
+			      int radio_climate, int pol, const double *conf,
+			      const double *rel, int rels, double *dbloss,
+			      int &errnum);
 void point_to_point(double tht_m, double rht_m, double eps_dielect,
 		    double sgm_conductivity, double eno_ns_surfref,
 		    double frq_mhz, int radio_climate, int pol, double conf,
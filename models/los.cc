@@ -12,6 +12,10 @@
 #include "pel.hh"
 #include "egli.hh"
 #include "soil.hh"
+#include "../lossmap.hh"
+#include "../aoi.hh"
+#include "../ano.hh"
+#include "../metricgrid.hh"
 #include <Windows.h>
 #include <mutex>
 
@@ -23,6 +27,7 @@ namespace {
 	std::mutex maskMutex;
 	bool ***processed;
 	bool has_init_processed = false;
+	thread_local unsigned long et_skipped = 0;
 
 	struct propagationRange {
 		double min_west, max_west, min_north, max_north;
@@ -31,23 +36,275 @@ namespace {
 		site source;
 		unsigned char mask_value;
 		FILE *fd;
-		int propmodel, knifeedge, pmenv;
+		int propmodel, knifeedge, pmenv, packet;
+		bool raster;
+		int side, rings;
+		bool polar;
+		int phase;
+		struct polarGrid *grid;
+		unsigned long skipped;
 	};
 
+	/* Path loss sampled on a grid centred on the transmitter: one
+	   row of bins per azimuth step, bin b lying (b + 1) * step
+	   miles out.  Cells are indexed [azimuth * bins + bin]. */
+	struct polarGrid {
+		int azimuths, bins;
+		double az_step, step;
+		float *loss;		/* NAN where the path fell short */
+		float *elevation;	/* kept for patterns and .ano only */
+		char *block;		/* kept for .ano only */
+	};
+
+	void* polarSection(propagationRange *v);
+
+	/* Ray packets hold the profiles of up to MAX_PACKET adjacent rays
+	   interleaved as [sample * stride + lane], stride being the -pkt
+	   lane count, so the per-sample geometry of every ray in the
+	   packet sits in one contiguous run that the compiler can
+	   vectorise across lanes.  The arrays only grow to the samples
+	   the packets out to max_range have needed. */
+	struct rayPacket {
+		int stride, samples;	/* lanes, and samples per lane held */
+		int length[MAX_PACKET];
+		double *lat;
+		double *lon;
+		double *elevation;
+		double *distance;
+		double *cos_test;	/* cosine of terrain angle seen by the Tx */
+		double *horizon;	/* running minimum of cos_test */
+		double *elev[MAX_PACKET];	/* per lane profiles for the models */
+	};
+
+	thread_local rayPacket packet;
+
+	void free_packet()
+	{
+		delete [] packet.lat;
+		delete [] packet.lon;
+		delete [] packet.elevation;
+		delete [] packet.distance;
+		delete [] packet.cos_test;
+		delete [] packet.horizon;
+		for (int l = 0; l < packet.stride; l++)
+			delete [] packet.elev[l];
+
+		packet.samples = 0;
+	}
+
+	void alloc_packet(int lanes)
+	{
+		/* Nothing is held until the first packet is read */
+
+		packet.stride = lanes;
+		packet.samples = 0;
+		packet.lat = packet.lon = packet.elevation = NULL;
+		packet.distance = packet.cos_test = packet.horizon = NULL;
+		for (int l = 0; l < lanes; l++)
+			packet.elev[l] = NULL;
+	}
+
+	void size_packet(int samples)
+	{
+		/* Room for samples points of every lane */
+
+		size_t size = (size_t)samples * packet.stride;
+
+		if (samples <= packet.samples)
+			return;
+
+		free_packet();
+
+		packet.lat = new double[size];
+		packet.lon = new double[size];
+		packet.elevation = new double[size];
+		packet.distance = new double[size];
+		packet.cos_test = new double[size];
+		packet.horizon = new double[size];
+		for (int l = 0; l < packet.stride; l++)
+			packet.elev[l] = new double[samples + 10];
+
+		packet.samples = samples;
+	}
+
+	void* viewshedSide(propagationRange *v)
+	{
+		/* Raster viewshed in the style of XDraw. The grid is walked
+		   in square rings outward from the transmitter, and this
+		   function handles one side of every ring: cells (k, t) for
+		   t in [-k, k], where side 0 is east, 1 west, 2 north and
+		   3 south. The ray from the transmitter to a cell crosses
+		   ring k-1 at t*(k-1)/k on the same side, so the horizon
+		   slope there is interpolated from the previous ring alone.
+		   That keeps each side independent of the others and lets
+		   every cell be evaluated exactly once. Heights are reduced
+		   by d^2/2R to account for the curvature of the earth. */
+
+		int k, t, t0, dx, dy;
+		double *prev = new double[2 * v->rings + 1];
+		double *cur = new double[2 * v->rings + 1];
+		double *swap, q, frac, horizon, ground, d, drop, h0, slope;
+		site p;
+
+		h0 = GetElevation(v->source) + v->source.alt;
+		/* Nothing obstructs ring 1.  The horizon is kept finite, as
+		   cells off the terrain pass it on and -HUGE_VAL would then
+		   interpolate to NaN against a neighbour. */
+		prev[0] = -1e30;
+
+		for (k = 1; k <= v->rings; k++) {
+			for (t = -k; t <= k; t++) {
+				q = (double)t * (double)(k - 1) / (double)k;
+				t0 = (int)floor(q);
+				frac = q - (double)t0;
+
+				horizon = prev[t0 + k - 1];
+				if (frac > 0.0)
+					horizon += frac * (prev[t0 + k] - horizon);
+
+				cur[t + k] = horizon;
+
+				dx = (v->side == 0 ? k : v->side == 1 ? -k : t);
+				dy = (v->side == 2 ? k : v->side == 3 ? -k : t);
+
+				p.lat = v->source.lat + dpp * (double)dy;
+				p.lon = v->source.lon - dpp * (double)dx;
+
+				if (p.lon < 0.0)
+					p.lon += 360.0;
+
+				if (p.lon >= 360.0)
+					p.lon -= 360.0;
+
+				ground = GetElevation(p);
+
+				if (ground == -5000.0)
+					continue;	/* Off the loaded terrain */
+
+				d = Distance(v->source, p);
+				drop = (FEET_PER_MILE * d) * (FEET_PER_MILE * d) /
+				    (2.0 * earthradius);
+
+				/* Can a receiver here see over the horizon so far? */
+
+				slope = (ground + v->altitude - drop - h0) /
+				    (FEET_PER_MILE * d);
+
+				/* North and south leave their corners to east and west */
+
+				if (slope >= horizon && d <= max_range
+				    && (v->side < 2 || (t != -k && t != k))
+				    && InAOI(p.lat, p.lon))
+					OrMask(p.lat, p.lon, v->mask_value);
+
+				/* Does the terrain here raise the horizon? */
+
+				slope = ((ground == 0.0 ? ground : ground + clutter) -
+					 drop - h0) / (FEET_PER_MILE * d);
+
+				if (slope > cur[t + k])
+					cur[t + k] = slope;
+			}
+
+			swap = prev;
+			prev = cur;
+			cur = swap;
+		}
+
+		delete [] prev;
+		delete [] cur;
+
+		return NULL;
+	}
+
+	void traceEdge(propagationRange *v, site edge, site *edges, int *lanes,
+		       bool packets)
+	{
+		/* Rays outside a -sec window are never traced */
+
+		if(!InSector(Azimuth(v->source, edge), 0.0))
+			return;
+
+		if(v->los)
+			PlotLOSPath(v->source, edge, v->mask_value, v->fd);
+		else if(packets) {
+			/* Gather adjacent edge points and trace them together */
+			edges[(*lanes)++] = edge;
+			if(*lanes == v->packet) {
+				PlotPropPacket(v->source, edges, *lanes, v->mask_value, v->fd,
+					v->propmodel, v->knifeedge, v->pmenv);
+				*lanes = 0;
+			}
+		}
+		else
+			PlotPropPath(v->source, edge, v->mask_value, v->fd, v->propmodel,
+				v->knifeedge, v->pmenv);
+	}
+
+	void metricEdges(propagationRange *v, site *edges, int *lanes,
+			 bool packets)
+	{
+		/* Rays to the cells of one side of the metric grid, the
+		   north, east, south or west, each from the corner it
+		   shares with the one before, clockwise */
+
+		int i, last = tm_grid->size - 1;
+		site edge;
+
+		edge.alt = v->altitude;
+
+		for (i = 0; i < last; i++) {
+			switch (v->side) {
+			case 0:
+				MetricSite(i, 0, &edge.lat, &edge.lon);
+				break;
+			case 1:
+				MetricSite(last, i, &edge.lat, &edge.lon);
+				break;
+			case 2:
+				MetricSite(last - i, last, &edge.lat, &edge.lon);
+				break;
+			default:
+				MetricSite(0, last - i, &edge.lat, &edge.lon);
+			}
+
+			traceEdge(v, edge, edges, lanes, packets);
+		}
+	}
+
 	void* rangePropagation(void *parameters)
 	{
 		propagationRange *v = (propagationRange*)parameters;
+
+		if(v->raster)
+			return viewshedSide(v);
+
+		if(v->polar)
+			return polarSection(v);
+
 		if(v->use_threads) {
 			alloc_elev();
 			alloc_path();
 		}
 
+		unsigned long skipped = et_skipped;
+
+		bool packets = !v->los && v->packet > 1;
+		site edges[MAX_PACKET];
+		int lanes = 0;
+
+		if(packets)
+			alloc_packet(v->packet);
+
 		double minwest = dpp + (double)v->min_west;
 		double lon = v->eastwest ? minwest : v->min_west;
 		double lat = v->min_north;
 		int y = 0;
 
-		do {
+		if(tm_grid != NULL)
+			metricEdges(v, edges, &lanes, packets);
+
+		else do {
 			if (lon >= 360.0)
 				lon -= 360.0;
 
@@ -56,11 +313,7 @@ namespace {
 			edge.lon = lon;
 			edge.alt = v->altitude;
 
-			if(v->los)
-				PlotLOSPath(v->source, edge, v->mask_value, v->fd);
-			else
-				PlotPropPath(v->source, edge, v->mask_value, v->fd, v->propmodel,
-					v->knifeedge, v->pmenv);
+			traceEdge(v, edge, edges, &lanes, packets);
 
 			++y;
 			if(v->eastwest)
@@ -73,6 +326,15 @@ namespace {
 				? (LonDiff(lon, (double)v->max_west) <= 0.0)
 				: (lat < (double)v->max_north) );
 
+			if(lanes > 0)
+				PlotPropPacket(v->source, edges, lanes, v->mask_value, v->fd,
+					v->propmodel, v->knifeedge, v->pmenv);
+
+			if(packets)
+				free_packet();
+
+			v->skipped = et_skipped - skipped;
+
 			if(v->use_threads) {
 				free_elev();
 				free_path();
@@ -112,8 +374,25 @@ namespace {
 		pointed to. */
 
 		int x, y, indx;
+		long cell;
 		char found;
 		bool rtn = false;
+		bool ***done = (site_layer != NULL ? site_layer->processed : processed);
+
+		if (tm_grid != NULL) {
+			/* Likewise for the cells of a metric grid */
+
+			if ((cell = MetricCell(lat, lon)) < 0 || tm_grid->processed[cell])
+				return false;
+
+			std::lock_guard<std::mutex> lock(maskMutex);
+
+			if (tm_grid->processed[cell])
+				return false;
+
+			tm_grid->processed[cell] = true;
+			return true;
+		}
 
 		for (indx = 0, found = 0; indx < MAXPAGES && found == 0;) {
 			x = (int)rint(ppd * (lat - dem[indx].min_north));
@@ -131,12 +410,12 @@ namespace {
 			conditions. But we must lock the mutex before updating the 
 			value. */
 
-			if(!processed[indx][x][y]) {
+			if(!done[indx][x][y]) {
 				std::lock_guard<std::mutex> lock(maskMutex);
 
-				if(!processed[indx][x][y]) {
+				if(!done[indx][x][y]) {
 					rtn = true;
-					processed[indx][x][y] = true;
+					done[indx][x][y] = true;
 				}
 			}
 
@@ -144,12 +423,13 @@ namespace {
 		return rtn;
 	}
   
-	void beginThread(void *arg)
+	void beginThread(propagationRange *arg)
 	{
-		if(!has_init_processed)
+		/* Polar sections own their cells outright */
+		if(!has_init_processed && !arg->polar)
 			init_processed();
 
-	  threads[thread_count] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ rangePropagation(arg); return 0; }, arg, 0, 0);
+	  threads[thread_count] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ rangePropagation(arg); AnoFlush(); MergeSignalBounds(); return 0; }, arg, 0, 0);
 		if (threads[thread_count] == nullptr)
 			fprintf(stderr,"ERROR; return code from pthread_create() is %d\n", 0);
 		else
@@ -240,6 +520,8 @@ void PlotLOSPath(struct site source, struct site destination, char mask_value,
 	double distance, rx_alt, tx_alt;
 
 	ReadPath(source, destination);
+	path.length = AOIPathLength(path.lat, path.lon, path.length, 1);
+
         for (y = 0; (y < (path.length - 1) && path.distance[y] <= max_range);
              y++) {
 	//for (y = 0; y < path.length; y++) {
@@ -247,6 +529,7 @@ void PlotLOSPath(struct site source, struct site destination, char mask_value,
 		   tested and found to be free of obstructions. */
 
 		if ((GetMask(path.lat[y], path.lon[y]) & mask_value) == 0
+			&& InAOI(path.lat[y], path.lon[y])
 			&& can_process(path.lat[y], path.lon[y])) {
 
 			distance = FEET_PER_MILE * path.distance[y];
@@ -293,24 +576,314 @@ void PlotLOSPath(struct site source, struct site destination, char mask_value,
 	}
 }
 
-void PlotPropPath(struct site source, struct site destination,
-		  unsigned char mask_value, FILE * fd, int propmodel,
-		  int knifeedge, int pmenv)
+static double PropModelLoss(struct site source, struct site destination,
+			    double rx_ground, float dkm, double frq_mhz,
+			    int propmodel, int knifeedge, int pmenv)
 {
+	/* This function returns the path loss (dB) predicted by the
+	   selected propagation model at frq_mhz for the terrain profile
+	   currently held in elev[].  rx_ground is the terrain elevation
+	   (feet) under the receiver, as used by the empirical models. */
 
-	int x, y, ifs, ofs, errnum;
-	char block = 0, strmode[100];
-	double loss, azimuth, pattern = 0.0,
-	    xmtr_alt, dest_alt, xmtr_alt2, dest_alt2,
-	    cos_rcvr_angle, cos_test_angle = 0.0, test_alt,
-	    elevation = 0.0, distance = 0.0, four_thirds_earth,
-	    field_strength = 0.0, rxp, dBm, diffloss;
-	struct site temp;
-	float dkm;
+	int errnum;
+	char strmode[100];
+	double loss, diffloss;
 
-	ReadPath(source, destination);
+	switch (propmodel) {
+	case 1:
+		// Longley Rice ITM
+		point_to_point_ITM(source.alt * METERS_PER_FOOT,
+				   destination.alt *
+				   METERS_PER_FOOT,
+				   LR.eps_dielect,
+				   LR.sgm_conductivity,
+				   LR.eno_ns_surfref,
+				   frq_mhz, LR.radio_climate,
+				   LR.pol, LR.conf, LR.rel,
+				   loss, strmode, errnum);
+		break;
+	case 3:
+		//HATA 1, 2 & 3
+		loss =
+		    HATApathLoss(frq_mhz, source.alt * METERS_PER_FOOT,
+				(rx_ground * METERS_PER_FOOT) +	 (destination.alt * METERS_PER_FOOT), dkm, pmenv);
+		break;
+	case 4:
+		// ECC33
+		loss =
+		    ECC33pathLoss(frq_mhz, source.alt * METERS_PER_FOOT,
+				(rx_ground *
+				 METERS_PER_FOOT) +
+				  (destination.alt *
+				   METERS_PER_FOOT), dkm,
+				  pmenv);
+		break;
+	case 5:
+		// SUI
+		loss =
+		    SUIpathLoss(frq_mhz, source.alt * METERS_PER_FOOT,
+				(rx_ground *
+				 METERS_PER_FOOT) +
+				(destination.alt *
+				 METERS_PER_FOOT), dkm, pmenv);
+		break;
+	case 6:
+		// COST231-Hata
+		loss =
+		    COST231pathLoss(frq_mhz, source.alt * METERS_PER_FOOT,
+				(rx_ground *
+				 METERS_PER_FOOT) +
+				    (destination.alt *
+				     METERS_PER_FOOT), dkm,
+				    pmenv);
+		break;
+	case 7:
+		// ITU-R P.525 Free space path loss
+		loss = FSPLpathLoss(frq_mhz, dkm);
+		break;
+	case 8:
+		// ITWOM 3.0
+		point_to_point(source.alt * METERS_PER_FOOT,
+			       destination.alt *
+			       METERS_PER_FOOT, LR.eps_dielect,
+			       LR.sgm_conductivity,
+
+			       LR.eno_ns_surfref, frq_mhz,
+			       LR.radio_climate, LR.pol,
+			       LR.conf, LR.rel, loss, strmode,
+			       errnum);
+		break;
+	case 9:
+		// Ericsson
+		loss =
+		    EricssonpathLoss(frq_mhz, source.alt * METERS_PER_FOOT,
+				(rx_ground *
+				 METERS_PER_FOOT) +
+				     (destination.alt *
+				      METERS_PER_FOOT), dkm,
+				     pmenv);
+		break;
+	case 10:
+		// Plane earth
+		loss =	PlaneEarthLoss(dkm, source.alt * METERS_PER_FOOT, (rx_ground * METERS_PER_FOOT) + (destination.alt * METERS_PER_FOOT));
+		break;
+	case 11:
+		// Egli VHF/UHF
+		loss = EgliPathLoss(frq_mhz, source.alt * METERS_PER_FOOT, (rx_ground * METERS_PER_FOOT) + (destination.alt * METERS_PER_FOOT),dkm);
+		break;
+	case 12:
+		// Soil
+		loss = SoilPathLoss(frq_mhz, dkm, LR.eps_dielect);
+		break;
 
-	four_thirds_earth = FOUR_THIRDS * EARTHRADIUS;
+
+	default:
+		point_to_point_ITM(source.alt * METERS_PER_FOOT,
+				   destination.alt *
+				   METERS_PER_FOOT,
+				   LR.eps_dielect,
+				   LR.sgm_conductivity,
+				   LR.eno_ns_surfref,
+				   frq_mhz, LR.radio_climate,
+				   LR.pol, LR.conf, LR.rel,
+				   loss, strmode, errnum);
+
+	}
+
+
+	if (knifeedge == 1 && propmodel > 1) {
+		diffloss =
+		    ked(frq_mhz,
+			destination.alt * METERS_PER_FOOT, dkm);
+		loss += (diffloss);	// ;)
+	}
+
+	return loss;
+}
+
+double PatternLoss(double loss, double azimuth, double elevation)
+{
+	/* Integrate the antenna's radiation
+	   pattern into the overall path loss. */
+
+	int x;
+
+	if (got_elevation_pattern) {
+		x = (int)rint(10.0 * (10.0 - elevation));
+
+		if (x >= 0 && x <= 1000) {
+			azimuth = rint(azimuth);
+			loss -= PATTERN_DB((int)azimuth, x);
+		}
+	}
+
+	return loss;
+}
+
+static double ThresholdMargin(double loss, double frq_mhz)
+{
+	/* This function returns by how many dB the path loss (with
+	   the antenna pattern already integrated) clears the receiver
+	   threshold, in the units being plotted.  It is negative
+	   where the point will be drawn as having no signal. */
+
+	if (LR.erp == 0.0)
+		return abs(contour_threshold) - loss;
+
+	if (dbm)
+		return 10.0 * log10(LR.erp / pow(10.0, (loss - 2.14) / 10.0)
+				    * 1000.0) - contour_threshold;
+
+	return (139.4 + (20.0 * log10(frq_mhz)) - loss) +
+	    (10.0 * log10(LR.erp / 1000.0)) - contour_threshold;
+}
+
+static bool EarlyTermination(double margin, double distance,
+			     double *below_from)
+{
+	/* Returns true once a ray has stayed et_margin dB or more
+	   below the receiver threshold for et_distance miles, from
+	   when it was first seen there (*below_from, or -1.0). */
+
+	if (margin > -et_margin) {
+		*below_from = -1.0;
+		return false;
+	}
+
+	if (*below_from < 0.0)
+		*below_from = distance;
+
+	return distance - *below_from >= et_distance;
+}
+
+double SignalValue(double loss, double frq_mhz)
+{
+	/* This function converts a path loss (dB), antenna pattern
+	   included, to what the map shows: received power (dBm),
+	   field strength (dBuV/m), or the path loss itself if ERP
+	   is 0. */
+
+	if (LR.erp == 0.0)
+		return loss;
+
+	if (dbm)	/* dBm is based on EIRP (ERP + 2.14) */
+		return 10.0 * (log10(LR.erp /
+				     (pow(10.0, (loss - 2.14) / 10.0)) * 1000.0));
+
+	return (139.4 + (20.0 * log10(frq_mhz)) - loss) +
+	    (10.0 * log10(LR.erp / 1000.0));
+}
+
+unsigned char SignalLevel(double loss, double frq_mhz)
+{
+	/* This function converts a path loss (dB), antenna pattern
+	   included, to the byte the renderers draw: 200 + dBm, or
+	   100 + dBuV/m, or the path loss itself if ERP is 0. */
+
+	int ifs;
+
+	if (LR.erp != 0.0) {
+		ifs = (dbm ? 200 : 100) + (int)rint(SignalValue(loss, frq_mhz));
+
+		/* Scale roughly between 0 and 255 */
+
+		if (ifs < 0)
+			ifs = 0;
+
+		if (ifs > 255)
+			ifs = 255;
+	}
+
+	else if (loss > 255)
+		ifs = 255;
+
+	else
+		ifs = (int)rint(loss);
+
+	return (unsigned char)ifs;
+}
+
+static double PutPropSignal(double lat, double lon, double loss,
+			    double frq_mhz, double azimuth, double elevation,
+			    char block, unsigned char mask_value, FILE *fd)
+{
+	/* This function takes the path loss (dB) predicted for
+	   the point at lat/lon, integrates the antenna pattern,
+	   converts it to field strength or received power as
+	   appropriate and stores the result in the signal[][]
+	   array and the alphanumeric output file (if any).
+	   It returns the margin over the receiver threshold. */
+
+	int ifs, ofs;
+	double raw_loss, value;
+
+	raw_loss = loss;
+	loss = PatternLoss(loss, azimuth, elevation);
+
+	/* Received power in mW for interference in batch mode */
+
+	if (LR.erp != 0.0 && site_layer != NULL && site_layer->power != NULL)
+		PutPower(lat, lon,
+			 LR.erp / pow(10.0, (loss - 2.14) / 10.0) * 1000.0);
+
+	/* The loss itself for -lf, from the main sweep only */
+
+	if (site_layer == NULL)
+		PutLoss(lat, lon, raw_loss, loss, azimuth, elevation);
+
+	/* If ERP==0, write path loss to alphanumeric
+	   output file.  Otherwise, write field strength
+	   or received power level, as appropriate. */
+
+	if (fd != NULL) {
+		value = (LR.erp == 0.0 ? raw_loss : SignalValue(loss, frq_mhz));
+
+		if (ano_binary)
+			AnoRecord(lat, lon, azimuth, elevation, value, block);
+		else
+			fprintf(fd, (LR.erp == 0.0 ? "%.7f, %.7f, %.3f, %.3f, %.2f%s\n" :
+				     "%.7f, %.7f, %.3f, %.3f, %.3f%s\n"),
+				lat, lon, azimuth, elevation, value,
+				(block ? " *" : ""));
+	}
+
+	/* Keep the strongest signal (least loss) seen here */
+
+	ifs = SignalLevel(loss, frq_mhz);
+	ofs = GetSignal(lat, lon);
+
+	if (LR.erp != 0.0 ? ofs > ifs : (ofs < ifs && ofs != 0))
+		ifs = ofs;
+
+	PutSignal(lat, lon, (unsigned char)ifs);
+
+	/* Mark this point as having been analyzed */
+
+	PutMask(lat, lon,
+		(GetMask(lat, lon) & 7) +
+		(mask_value << 3));
+
+	/* Only what will be drawn counts towards the crop.  The
+	   renderer holds the stored byte, not the margin, to -rt. */
+
+	if (ifs != 0 && (contour_threshold == 0 ||
+			 (LR.erp == 0.0 ? ifs <= abs(contour_threshold) :
+			  ifs - (dbm ? 200 : 100) >= contour_threshold)))
+		GrowSignalBounds(lat, lon);
+
+	return ThresholdMargin(loss, frq_mhz);
+}
+
+static void ReadPropPath(struct site source, struct site destination)
+{
+	/* This function reads the path between source and destination
+	   and loads its profile, with clutter added between the end
+	   points, into elev[] in the form the propagation models use. */
+
+	int x;
+
+	ReadPath(source, destination);
+	path.length = AOIPathLength(path.lat, path.lon, path.length, 1);
 
 	for (x = 1; x < path.length - 1; x++)
 		elev[x + 2] =
@@ -327,6 +900,29 @@ void PlotPropPath(struct site source, struct site destination,
 
 	elev[path.length + 1] =
 	    path.elevation[path.length - 1] * METERS_PER_FOOT;
+}
+
+/* Most receiver heights, bands or percentiles in one sweep */
+#define MAX_SWEEP_LAYERS MAX(MAX_RX_HEIGHTS, MAX(MAX_BANDS, MAX_PERCENTILES))
+
+static double PropPathLoss(struct site source, struct site destination,
+			   int y, FILE *fd, int propmodel, int knifeedge,
+			   int pmenv, double *elevation, char *block,
+			   double *losses)
+{
+	/* This function returns the path loss (dB) from the source to
+	   point y of the path loaded by ReadPropPath().  If an elevation
+	   pattern or an .ano file is in use, the elevation angle of the
+	   receiver or of the first obstruction before it is returned in
+	   elevation, and block is set if there is such an obstruction.
+	   With losses the loss at every -f band or, for ITM, every -rel
+	   percentile is returned there, as these share the profile. */
+
+	int x, errnum;
+	double distance, xmtr_alt, dest_alt, xmtr_alt2, dest_alt2,
+	    cos_rcvr_angle, cos_test_angle = 0.0, test_alt,
+	    four_thirds_earth;
+	float dkm;
 
 	/* Since the only energy the Longley-Rice model considers
 	   reaching the destination is based on what is scattered
@@ -339,368 +935,878 @@ void PlotPropPath(struct site source, struct site destination,
 	   calculation for overall path loss. */
 	//if(debug)
 	//	fprintf(stderr,"four_thirds_earth %.1f source.alt %.1f path.elevation[0] %.1f\n",four_thirds_earth,source.alt,path.elevation[0]);
+
+	four_thirds_earth = FOUR_THIRDS * EARTHRADIUS;
+
+	distance = FEET_PER_MILE * path.distance[y];
+	xmtr_alt =
+	    four_thirds_earth + source.alt + path.elevation[0];
+	dest_alt =
+	    four_thirds_earth + destination.alt +
+	    path.elevation[y];
+	dest_alt2 = dest_alt * dest_alt;
+	xmtr_alt2 = xmtr_alt * xmtr_alt;
+
+	/* Calculate the cosine of the elevation of
+	   the receiver as seen by the transmitter. */
+
+	cos_rcvr_angle =
+	    ((xmtr_alt2) + (distance * distance) -
+	     (dest_alt2)) / (2.0 * xmtr_alt * distance);
+
+	if (cos_rcvr_angle > 1.0)
+		cos_rcvr_angle = 1.0;
+
+	if (cos_rcvr_angle < -1.0)
+		cos_rcvr_angle = -1.0;
+
+	if (got_elevation_pattern || angle_map || fd != NULL) {
+		/* Determine the elevation angle to the first obstruction
+		   along the path IF elevation pattern data is available,
+		   an angle map is being kept or an output (.ano) file has
+		   been designated. */
+
+		for (x = 2, *block = 0; (x < y && *block == 0);
+		     x++) {
+			distance = FEET_PER_MILE * path.distance[x];
+
+			test_alt =
+			    four_thirds_earth +
+			    (path.elevation[x] ==
+			     0.0 ? path.elevation[x] : path.
+			     elevation[x] + clutter);
+
+			/* Calculate the cosine of the elevation
+			   angle of the terrain (test point)
+			   as seen by the transmitter. */
+
+			cos_test_angle =
+			    ((xmtr_alt2) +
+			     (distance * distance) -
+			     (test_alt * test_alt)) / (2.0 *
+						       xmtr_alt
+						       *
+						       distance);
+
+			if (cos_test_angle > 1.0)
+				cos_test_angle = 1.0;
+
+			if (cos_test_angle < -1.0)
+				cos_test_angle = -1.0;
+
+			/* Compare these two angles to determine if
+			   an obstruction exists.  Since we're comparing
+			   the cosines of these angles rather than
+			   the angles themselves, the sense of the
+			   following "if" statement is reversed from
+			   what it would be if the angles themselves
+			   were compared. */
+
+			if (cos_rcvr_angle >= cos_test_angle)
+				*block = 1;
+		}
+
+		if (*block)
+			*elevation =
+			    ((acos(cos_test_angle)) / DEG2RAD) -
+			    90.0;
+		else
+			*elevation =
+			    ((acos(cos_rcvr_angle)) / DEG2RAD) -
+			    90.0;
+	}
+
+	/* Determine attenuation for each point along the
+	   path using a prop model starting at y=2 (number_of_points = 1), the
+	   shortest distance terrain can play a role in
+	   path loss. */
+
+	elev[0] = y - 1;	/* (number of points - 1) */
+
+	/* Distance between elevation samples */
+
+	elev[1] =
+	    METERS_PER_MILE * (path.distance[y] -
+			       path.distance[y - 1]);
+
+	if (path.elevation[y] < 1) {
+		path.elevation[y] = 1;
+	}
+
+	dkm = (elev[1] * elev[0]) / 1000;	// km
+
+	if (losses == NULL)
+		return PropModelLoss(source, destination,
+				     path.elevation[y], dkm, LR.frq_mhz,
+				     propmodel, knifeedge, pmenv);
+
+	if (propmodel >= 3 && propmodel <= 12) {
+		for (x = 0; x < band_count; x++)
+			losses[x] = PropModelLoss(source, destination,
+						  path.elevation[y], dkm,
+						  frequencies[x], propmodel,
+						  knifeedge, pmenv);
+	} else {
+		/* ITM, which shares its terrain analysis across bands
+		   and its variability set up across percentiles */
+
+		point_to_point_ITM_bands(source.alt * METERS_PER_FOOT,
+					 destination.alt * METERS_PER_FOOT,
+					 LR.eps_dielect, LR.sgm_conductivity,
+					 LR.eno_ns_surfref, frequencies,
+					 band_count, LR.radio_climate, LR.pol,
+					 (rel_count > 1 ? reliabilities : &LR.conf),
+					 (rel_count > 1 ? reliabilities : &LR.rel),
+					 rel_count, losses, errnum);
+	}
+
+	return losses[0];
+}
+
+void PlotPropPath(struct site source, struct site destination,
+		  unsigned char mask_value, FILE * fd, int propmodel,
+		  int knifeedge, int pmenv)
+{
+	/* With a -rxh, -f or -rel list every point is evaluated at
+	   each receiver height, band or percentile in turn, sharing
+	   the profile and the bookkeeping, and for bands and
+	   percentiles the model's work that does not depend on them.
+	   All but the first go into layers of their own. */
+
+	int y, h, variants, live;
+	char block = 0;
+	bool shared = (band_count > 1 || rel_count > 1);
+	double loss, azimuth, elevation = 0.0, margin,
+	    below_from[MAX_SWEEP_LAYERS], losses[MAX_SWEEP_LAYERS];
+	struct site temp, receiver = destination;
+	struct layer *own = site_layer, **layers;
+	bool terminated[MAX_SWEEP_LAYERS];
+
+	if (band_count > 1) {
+		variants = band_count;
+		layers = band_layers;
+	} else if (rel_count > 1) {
+		variants = rel_count;
+		layers = rel_layers;
+	} else {
+		variants = rx_height_count;
+		layers = height_layers;
+	}
+
+	live = variants;
+
+	for (h = 0; h < variants; h++) {
+		below_from[h] = -1.0;
+		terminated[h] = false;
+	}
+
+	ReadPropPath(source, destination);
+
 	for (y = 2; (y < (path.length - 1) && path.distance[y] <= max_range);
 	     y++) {
+		/* Points past an early termination are left unset,
+		   which the renderers draw as below the threshold */
+
+		if (live == 0) {
+			et_skipped++;
+			continue;
+		}
+
 		/* Process this point only if it
 		   has not already been processed. */
 
 		if ( (GetMask(path.lat[y], path.lon[y]) & 248) !=
-			(mask_value << 3) && can_process(path.lat[y], path.lon[y])) {
+			(mask_value << 3) && InAOI(path.lat[y], path.lon[y])
+			&& can_process(path.lat[y], path.lon[y])) {
 
-			char fd_buffer[64];
-			int buffer_offset = 0;
+			temp.lat = path.lat[y];
+			temp.lon = path.lon[y];
 
-			distance = FEET_PER_MILE * path.distance[y];
-			xmtr_alt =
-			    four_thirds_earth + source.alt + path.elevation[0];
-			dest_alt =
-			    four_thirds_earth + destination.alt +
-			    path.elevation[y];
-			dest_alt2 = dest_alt * dest_alt;
-			xmtr_alt2 = xmtr_alt * xmtr_alt;
-
-			/* Calculate the cosine of the elevation of
-			   the receiver as seen by the transmitter. */
-
-			cos_rcvr_angle =
-			    ((xmtr_alt2) + (distance * distance) -
-			     (dest_alt2)) / (2.0 * xmtr_alt * distance);
-
-			if (cos_rcvr_angle > 1.0)
-				cos_rcvr_angle = 1.0;
-
-			if (cos_rcvr_angle < -1.0)
-				cos_rcvr_angle = -1.0;
-
-			if (got_elevation_pattern || fd != NULL) {
-				/* Determine the elevation angle to the first obstruction
-				   along the path IF elevation pattern data is available
-				   or an output (.ano) file has been designated. */
-
-				for (x = 2, block = 0; (x < y && block == 0);
-				     x++) {
-					distance = FEET_PER_MILE * path.distance[x];
-
-					test_alt =
-					    four_thirds_earth +
-					    (path.elevation[x] ==
-					     0.0 ? path.elevation[x] : path.
-					     elevation[x] + clutter);
-
-					/* Calculate the cosine of the elevation
-					   angle of the terrain (test point)
-					   as seen by the transmitter. */
-
-					cos_test_angle =
-					    ((xmtr_alt2) +
-					     (distance * distance) -
-					     (test_alt * test_alt)) / (2.0 *
-								       xmtr_alt
-								       *
-								       distance);
-
-					if (cos_test_angle > 1.0)
-						cos_test_angle = 1.0;
-
-					if (cos_test_angle < -1.0)
-						cos_test_angle = -1.0;
-
-					/* Compare these two angles to determine if
-					   an obstruction exists.  Since we're comparing
-					   the cosines of these angles rather than
-					   the angles themselves, the sense of the
-					   following "if" statement is reversed from
-					   what it would be if the angles themselves
-					   were compared. */
-
-					if (cos_rcvr_angle >= cos_test_angle)
-						block = 1;
+			azimuth = (Azimuth(source, temp));
+
+			if (shared)
+				PropPathLoss(source, destination, y, fd,
+					     propmodel, knifeedge, pmenv,
+					     &elevation, &block, losses);
+
+			for (h = 0; h < variants; h++) {
+				if (terminated[h])
+					continue;
+
+				if (h > 0)
+					site_layer = layers[h];
+
+				if (shared)
+					loss = losses[h];
+
+				else {
+					receiver.alt = rx_heights[h];
+
+					loss = PropPathLoss(source,
+							    (h == 0 ? destination : receiver), y,
+							    (h == 0 ? fd : NULL),
+							    propmodel, knifeedge, pmenv,
+							    &elevation, &block, NULL);
 				}
 
-				if (block)
-					elevation =
-					    ((acos(cos_test_angle)) / DEG2RAD) -
-					    90.0;
-				else
-					elevation =
-					    ((acos(cos_rcvr_angle)) / DEG2RAD) -
-					    90.0;
+				//Key stage. Link dB for p2p is returned as 'loss'.
+
+				margin = PutPropSignal(path.lat[y], path.lon[y],
+						       loss, (band_count > 1 ?
+						       frequencies[h] : LR.frq_mhz),
+						       azimuth, elevation, block,
+						       mask_value, (h == 0 ? fd : NULL));
+
+				site_layer = own;
+
+				if (early_termination &&
+				    EarlyTermination(margin, path.distance[y],
+						     &below_from[h])) {
+					terminated[h] = true;
+					live--;
+				}
 			}
+		}
+	}
+}
 
-			/* Determine attenuation for each point along the
-			   path using a prop model starting at y=2 (number_of_points = 1), the
-			   shortest distance terrain can play a role in
-			   path loss. */
+static void ReadPathPacket(struct site source, struct site *destination,
+			   int lanes)
+{
+	/* This function is the ray packet counterpart of ReadPath().
+	   The great circle paths from the source to every destination
+	   in the packet are stepped together, one lane per ray, and
+	   the resulting profiles are stored interleaved in "packet". */
+
+	int c, l, i, steps = 0, end[MAX_PACKET], samples = 3,
+	    stride = packet.stride;
+	double lat1, lon1, lat2, lon2, dx, dy, path_length, num, den,
+	    samples_per_radian, azimuth[MAX_PACKET], cos_azimuth[MAX_PACKET],
+	    total_distance[MAX_PACKET], miles_per_sample[MAX_PACKET],
+	    beta[MAX_PACKET], sin_beta[MAX_PACKET], cos_beta[MAX_PACKET],
+	    lat[MAX_PACKET];
+	struct site tempsite;
+
+	lat1 = source.lat * DEG2RAD;
+	lon1 = source.lon * DEG2RAD;
+	samples_per_radian = ppd * 57.295833;
+
+	for (l = 0; l < lanes; l++) {
+		lat2 = destination[l].lat * DEG2RAD;
+		lon2 = destination[l].lon * DEG2RAD;
+		azimuth[l] = Azimuth(source, destination[l]) * DEG2RAD;
+		cos_azimuth[l] = cos(azimuth[l]);
+		total_distance[l] = Distance(source, destination[l]);
+
+		if (total_distance[l] > (30.0 / ppd)) {
+			dx = samples_per_radian * acos(cos(lon1 - lon2));
+			dy = samples_per_radian * acos(cos(lat1 - lat2));
+			path_length = sqrt((dx * dx) + (dy * dy));
+			miles_per_sample[l] = total_distance[l] / path_length;
+			end[l] = -1;
+
+			/* Every sample out to max_range, the next one, which
+			   retires the lane, and the destination if it is in
+			   range */
+
+			samples = MAX(samples, (int)(MIN(total_distance[l], max_range) /
+						     miles_per_sample[l]) + 3);
+		}
 
-			elev[0] = y - 1;	/* (number of points - 1) */
+		else {
+			/* Too short to trace, as in ReadPath() only
+			   the destination point is recorded */
+			total_distance[l] = 0.0;
+			miles_per_sample[l] = 0.0;
+			end[l] = 0;
+		}
+	}
 
-			/* Distance between elevation samples */
+	samples = MIN(samples, ARRAYSIZE);
+	size_packet(samples);
 
-			elev[1] =
-			    METERS_PER_MILE * (path.distance[y] -
-					       path.distance[y - 1]);
+	for (c = 0; c < samples; c++) {
+		/* The trigonometry is evaluated for every lane together */
 
-			if (path.elevation[y] < 1) {
-				path.elevation[y] = 1;
+		for (l = 0; l < lanes; l++) {
+			beta[l] = (miles_per_sample[l] * (double)c) / 3959.0;
+			sin_beta[l] = sin(beta[l]);
+			cos_beta[l] = cos(beta[l]);
+			lat[l] = asin(sin(lat1) * cos_beta[l] +
+				      cos_azimuth[l] * sin_beta[l] * cos(lat1));
+		}
+
+		for (l = 0, steps = 0; l < lanes; l++) {
+			if (end[l] != -1)
+				continue;
+
+			if (miles_per_sample[l] * (double)c > total_distance[l]) {
+				end[l] = c;
+				continue;
 			}
 
-			dkm = (elev[1] * elev[0]) / 1000;	// km
+			steps++;
+			lat2 = lat[l];
+			num = cos_beta[l] - (sin(lat1) * sin(lat2));
+			den = cos(lat1) * cos(lat2);
 
-			switch (propmodel) {
-			case 1:
-				// Longley Rice ITM
-				point_to_point_ITM(source.alt * METERS_PER_FOOT,
-						   destination.alt *
-						   METERS_PER_FOOT,
-						   LR.eps_dielect,
-						   LR.sgm_conductivity,
-						   LR.eno_ns_surfref,
-						   LR.frq_mhz, LR.radio_climate,
-						   LR.pol, LR.conf, LR.rel,
-						   loss, strmode, errnum);
-				break;
-			case 3:
-				//HATA 1, 2 & 3
-				loss =
-				    HATApathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT,
-						(path.elevation[y] * METERS_PER_FOOT) +	 (destination.alt * METERS_PER_FOOT), dkm, pmenv);
-				break;
-			case 4:
-				// ECC33
-				loss =
-				    ECC33pathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT,
-						(path.elevation[y] *
-						 METERS_PER_FOOT) +
-						  (destination.alt *
-						   METERS_PER_FOOT), dkm,
-						  pmenv);
-				break;
-			case 5:
-				// SUI
-				loss =
-				    SUIpathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT,
-						(path.elevation[y] *
-						 METERS_PER_FOOT) +
-						(destination.alt *
-						 METERS_PER_FOOT), dkm, pmenv);
-				break;
-			case 6:
-				// COST231-Hata
-				loss =
-				    COST231pathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT,
-						(path.elevation[y] *
-						 METERS_PER_FOOT) +
-						    (destination.alt *
-						     METERS_PER_FOOT), dkm,
-						    pmenv);
-				break;
-			case 7:
-				// ITU-R P.525 Free space path loss
-				loss = FSPLpathLoss(LR.frq_mhz, dkm);
-				break;
-			case 8:
-				// ITWOM 3.0
-				point_to_point(source.alt * METERS_PER_FOOT,
-					       destination.alt *
-					       METERS_PER_FOOT, LR.eps_dielect,
-					       LR.sgm_conductivity,
-
-					       LR.eno_ns_surfref, LR.frq_mhz,
-					       LR.radio_climate, LR.pol,
-					       LR.conf, LR.rel, loss, strmode,
-					       errnum);
-				break;
-			case 9:
-				// Ericsson
-				loss =
-				    EricssonpathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT,
-						(path.elevation[y] *
-						 METERS_PER_FOOT) +
-						     (destination.alt *
-						      METERS_PER_FOOT), dkm,
-						     pmenv);
-				break;
-			case 10:
-				// Plane earth
-				loss =	PlaneEarthLoss(dkm, source.alt * METERS_PER_FOOT, (path.elevation[y] * METERS_PER_FOOT) + (destination.alt * METERS_PER_FOOT));
-				break;
-			case 11:
-				// Egli VHF/UHF
-				loss = EgliPathLoss(LR.frq_mhz, source.alt * METERS_PER_FOOT, (path.elevation[y] * METERS_PER_FOOT) + (destination.alt * METERS_PER_FOOT),dkm);
-				break;
-                        case 12:
-                                // Soil
-                                loss = SoilPathLoss(LR.frq_mhz, dkm, LR.eps_dielect);
-                                break;
+			if (azimuth[l] == 0.0 && (beta[l] > HALFPI - lat1))
+				lon2 = lon1 + PI;
 
+			else if (azimuth[l] == HALFPI && (beta[l] > HALFPI + lat1))
+				lon2 = lon1 + PI;
 
-			default:
-				point_to_point_ITM(source.alt * METERS_PER_FOOT,
-						   destination.alt *
-						   METERS_PER_FOOT,
-						   LR.eps_dielect,
-						   LR.sgm_conductivity,
-						   LR.eno_ns_surfref,
-						   LR.frq_mhz, LR.radio_climate,
-						   LR.pol, LR.conf, LR.rel,
-						   loss, strmode, errnum);
+			else if (fabs(num / den) > 1.0)
+				lon2 = lon1;
 
+			else {
+				if ((PI - azimuth[l]) >= 0.0)
+					lon2 = lon1 - arccos(num, den);
+				else
+					lon2 = lon1 + arccos(num, den);
 			}
 
+			while (lon2 < 0.0)
+				lon2 += TWOPI;
+
+			while (lon2 > TWOPI)
+				lon2 -= TWOPI;
+
+			i = c * stride + l;
+			packet.lat[i] = lat2 / DEG2RAD;
+			packet.lon[i] = lon2 / DEG2RAD;
+			tempsite.lat = packet.lat[i];
+			tempsite.lon = packet.lon[i];
+			packet.elevation[i] = GetElevation(tempsite);
+			// fix for tile gaps in multi-tile LIDAR plots
+			if (c > 0 && packet.elevation[i] == 0
+			    && packet.elevation[i - stride] > 10)
+				packet.elevation[i] = packet.elevation[i - stride];
+			packet.distance[i] = miles_per_sample[l] * (double)c;
+		}
 
-			if (knifeedge == 1 && propmodel > 1) {
-				diffloss =
-				    ked(LR.frq_mhz,
-					destination.alt * METERS_PER_FOOT, dkm);
-				loss += (diffloss);	// ;)
-			}
-			//Key stage. Link dB for p2p is returned as 'loss'.
+		if (steps == 0)
+			break;
+	}
 
-			temp.lat = path.lat[y];
-			temp.lon = path.lon[y];
+	/* Make sure exact destination point is recorded at length-1 */
 
-			azimuth = (Azimuth(source, temp));
+	for (l = 0; l < lanes; l++) {
+		c = (end[l] == -1 ? samples : end[l]);
 
-			if (fd != NULL)
-				buffer_offset += sprintf(fd_buffer+buffer_offset,
-					"%.7f, %.7f, %.3f, %.3f, ",
-					path.lat[y], path.lon[y], azimuth,
-					elevation);
+		if (c < samples) {
+			i = c * stride + l;
+			packet.lat[i] = destination[l].lat;
+			packet.lon[i] = destination[l].lon;
+			packet.elevation[i] = GetElevation(destination[l]);
+			packet.distance[i] = total_distance[l];
+			c++;
+		}
 
-			/* If ERP==0, write path loss to alphanumeric
-			   output file.  Otherwise, write field strength
-			   or received power level (below), as appropriate. */
+		if (c < samples)
+			packet.length[l] = c;
+		else
+			packet.length[l] = samples - 1;
+	}
+}
 
-			if (fd != NULL && LR.erp == 0.0)
-				buffer_offset += sprintf(fd_buffer+buffer_offset,
-					"%.2f", loss);
+void PlotPropPacket(struct site source, struct site *destination, int lanes,
+		    unsigned char mask_value, FILE *fd, int propmodel,
+		    int knifeedge, int pmenv)
+{
+	/* This function is equivalent to calling PlotPropPath() for
+	   each of a packet of up to MAX_PACKET adjacent rays, but
+	   advances all of them together, one lane per ray.  The
+	   profiles are generated in lanes, and the receiver and
+	   terrain angles are evaluated across lanes for each sample.
+	   Rather than rescanning the path for the first obstruction
+	   at every sample, each lane keeps a running minimum of the
+	   terrain cosines so the obstruction is found by bisection. */
+
+	int x, y, l, i, lo, hi, longest = 0;
+	bool active[MAX_PACKET], claimed[MAX_PACKET];
+	char block;
+	double loss, azimuth, distance, test_alt, elevation = 0.0, margin,
+	    below_from[MAX_PACKET],
+	    four_thirds_earth, dest_alt, *ray_elev,
+	    xmtr_alt[MAX_PACKET], xmtr_alt2[MAX_PACKET],
+	    cos_rcvr_angle[MAX_PACKET];
+	struct site temp;
+	float dkm;
 
-			/* Integrate the antenna's radiation
-			   pattern into the overall path loss. */
+	ReadPathPacket(source, destination, lanes);
 
-			x = (int)rint(10.0 * (10.0 - elevation));
+	four_thirds_earth = FOUR_THIRDS * EARTHRADIUS;
 
-			if (x >= 0 && x <= 1000) {
-				azimuth = rint(azimuth);
+	for (l = 0; l < lanes; l++) {
+		double *e = packet.elev[l];
+		int length;
+
+		length = packet.length[l] = AOIPathLength(packet.lat + l,
+							  packet.lon + l,
+							  packet.length[l],
+							  packet.stride);
+
+		for (x = 1; x < length - 1; x++) {
+			i = x * packet.stride + l;
+			e[x + 2] =
+			    (packet.elevation[i] ==
+			     0.0 ? packet.elevation[i] * METERS_PER_FOOT :
+			     (clutter + packet.elevation[i]) * METERS_PER_FOOT);
+		}
 
-				pattern =
-				    (double)LR.antenna_pattern[(int)azimuth][x];
+		/* Copy ending points without clutter */
 
-				if (pattern != 0.0) {
-					pattern = 20.0 * log10(pattern);
-					loss -= pattern;
-				}
-			}
+		e[2] = packet.elevation[l] * METERS_PER_FOOT;
+		e[length + 1] =
+		    packet.elevation[(length - 1) * packet.stride + l] *
+		    METERS_PER_FOOT;
 
-			if (LR.erp != 0.0) {
-				if (dbm) {
-					/* dBm is based on EIRP (ERP + 2.14) */
+		xmtr_alt[l] = four_thirds_earth + source.alt + packet.elevation[l];
+		xmtr_alt2[l] = xmtr_alt[l] * xmtr_alt[l];
+		active[l] = true;
+		below_from[l] = -1.0;
 
-					rxp =
-					    LR.erp /
-					    (pow(10.0, (loss - 2.14) / 10.0));
+		if (length > longest)
+			longest = length;
+	}
 
-					dBm = 10.0 * (log10(rxp * 1000.0));
+	ray_elev = elev;
 
-					if (fd != NULL)
-						buffer_offset += sprintf(fd_buffer+buffer_offset,
-							"%.3f", dBm);
+	for (y = 2; y < longest - 1; y++) {
+		/* Retire lanes that have reached their end or max_range */
 
-					/* Scale roughly between 0 and 255 */
+		for (l = 0; l < lanes; l++) {
+			if (active[l] && (y >= packet.length[l] - 1
+			    || packet.distance[y * packet.stride + l] > max_range))
+				active[l] = false;
+		}
 
-					ifs = 200 + (int)rint(dBm);
+		/* Cosine of the elevation of the receiver as seen
+		   by the transmitter, for all lanes at once */
 
-					if (ifs < 0)
-						ifs = 0;
+		for (l = 0; l < lanes; l++) {
+			i = y * packet.stride + l;
+			distance = FEET_PER_MILE * packet.distance[i];
+			dest_alt = four_thirds_earth + destination[l].alt +
+			    packet.elevation[i];
 
-					if (ifs > 255)
-						ifs = 255;
+			cos_rcvr_angle[l] =
+			    ((xmtr_alt2[l]) + (distance * distance) -
+			     (dest_alt * dest_alt)) / (2.0 * xmtr_alt[l] *
+						       distance);
 
-					ofs =
-					    GetSignal(path.lat[y], path.lon[y]);
+			if (cos_rcvr_angle[l] > 1.0)
+				cos_rcvr_angle[l] = 1.0;
 
-					if (ofs > ifs)
-						ifs = ofs;
+			if (cos_rcvr_angle[l] < -1.0)
+				cos_rcvr_angle[l] = -1.0;
+		}
 
-					PutSignal(path.lat[y], path.lon[y],
-						  (unsigned char)ifs);
+		for (l = 0; l < lanes; l++) {
+			i = y * packet.stride + l;
 
-				}
+			/* Each lane claims its own pixel */
 
-				else {
-					field_strength =
-					    (139.4 +
-					     (20.0 * log10(LR.frq_mhz)) -
-					     loss) +
-					    (10.0 * log10(LR.erp / 1000.0));
+			claimed[l] = active[l]
+			    && (GetMask(packet.lat[i], packet.lon[i]) & 248) !=
+			    (mask_value << 3)
+			    && InAOI(packet.lat[i], packet.lon[i])
+			    && can_process(packet.lat[i], packet.lon[i]);
 
-					ifs = 100 + (int)rint(field_strength);
+			if (!claimed[l])
+				continue;
 
-					if (ifs < 0)
-						ifs = 0;
+			block = 0;
 
-					if (ifs > 255)
-						ifs = 255;
+			if (got_elevation_pattern || angle_map || fd != NULL) {
+				/* The first obstruction is the first sample
+				   whose running minimum drops to the receiver's
+				   cosine, found by bisection over [2, y) */
 
-					ofs =
-					    GetSignal(path.lat[y], path.lon[y]);
+				lo = 2;
+				hi = y;
 
-					if (ofs > ifs)
-						ifs = ofs;
+				while (lo < hi) {
+					x = (lo + hi) / 2;
 
-					PutSignal(path.lat[y], path.lon[y],
-						  (unsigned char)ifs);
+					if (cos_rcvr_angle[l] >=
+					    packet.horizon[x * packet.stride + l])
+						hi = x;
+					else
+						lo = x + 1;
+				}
 
-					if (fd != NULL)
-						buffer_offset += sprintf(fd_buffer+buffer_offset,
-							"%.3f",
-							field_strength);
+				if (lo < y) {
+					block = 1;
+					elevation =
+					    ((acos(packet.cos_test[lo * packet.stride + l])) /
+					     DEG2RAD) - 90.0;
 				}
-			}
 
-			else {
-				if (loss > 255)
-					ifs = 255;
 				else
-					ifs = (int)rint(loss);
-				
-				ofs = GetSignal(path.lat[y], path.lon[y]);
+					elevation =
+					    ((acos(cos_rcvr_angle[l])) / DEG2RAD) -
+					    90.0;
+			}
+
+			elev = packet.elev[l];
+			elev[0] = y - 1;	/* (number of points - 1) */
 
-				if (ofs < ifs && ofs != 0)
-					ifs = ofs;
+			/* Distance between elevation samples */
+
+			elev[1] =
+			    METERS_PER_MILE * (packet.distance[i] -
+					       packet.distance[i - packet.stride]);
 
-				PutSignal(path.lat[y], path.lon[y],
-					  (unsigned char)ifs);
+			if (packet.elevation[i] < 1) {
+				packet.elevation[i] = 1;
 			}
 
-			if (fd != NULL) {
-				if (block)
-					buffer_offset += sprintf(fd_buffer+buffer_offset,
-						" *");
-				fprintf(fd, "%s\n", fd_buffer);
+			dkm = (elev[1] * elev[0]) / 1000;	// km
+
+			loss = PropModelLoss(source, destination[l],
+					     packet.elevation[i], dkm, LR.frq_mhz,
+					     propmodel, knifeedge, pmenv);
+
+			temp.lat = packet.lat[i];
+			temp.lon = packet.lon[i];
+
+			azimuth = (Azimuth(source, temp));
+
+			margin = PutPropSignal(packet.lat[i], packet.lon[i], loss,
+					       LR.frq_mhz, azimuth, elevation,
+					       block, mask_value, fd);
+
+			/* Retire a lane that terminates early, counting the
+			   points it leaves unset as PlotPropPath() does */
+
+			if (early_termination &&
+			    EarlyTermination(margin, packet.distance[i],
+					     &below_from[l])) {
+				active[l] = false;
+
+				for (x = y + 1; x < packet.length[l] - 1 &&
+				     packet.distance[x * packet.stride + l] <= max_range;
+				     x++)
+					et_skipped++;
 			}
+		}
+
+		/* Terrain angle and running minimum for this sample. These
+		   are taken after the receiver clamp above, as PlotPropPath()
+		   sees the clamped elevation when testing later samples. */
+
+		for (l = 0; l < lanes; l++) {
+			i = y * packet.stride + l;
+			distance = FEET_PER_MILE * packet.distance[i];
+
+			test_alt =
+			    four_thirds_earth +
+			    (packet.elevation[i] ==
+			     0.0 ? packet.elevation[i] : packet.elevation[i] +
+			     clutter);
 
-			/* Mark this point as having been analyzed */
+			packet.cos_test[i] =
+			    ((xmtr_alt2[l]) + (distance * distance) -
+			     (test_alt * test_alt)) / (2.0 * xmtr_alt[l] *
+						       distance);
 
-			PutMask(path.lat[y], path.lon[y],
-				(GetMask(path.lat[y], path.lon[y]) & 7) +
-				(mask_value << 3));
+			if (packet.cos_test[i] > 1.0)
+				packet.cos_test[i] = 1.0;
+
+			if (packet.cos_test[i] < -1.0)
+				packet.cos_test[i] = -1.0;
+
+			if (y == 2 || packet.cos_test[i] <
+			    packet.horizon[i - packet.stride])
+				packet.horizon[i] = packet.cos_test[i];
+			else
+				packet.horizon[i] = packet.horizon[i - packet.stride];
 		}
 	}
 
-	if(path.lat[y]>cropLat)
-		cropLat=path.lat[y];
+	elev = ray_elev;
+}
 
-	
-	if(y>cropLon)
-		cropLon=y;
+namespace {
+	void polarRays(propagationRange *v)
+	{
+		/* Trace the rays of this thread's share of the azimuths
+		   out to max_range and sample the loss at every bin. */
+
+		polarGrid *g = v->grid;
+		int a, b, y, cell;
+		char block = 0;
+		double azimuth, beta, lat1, lon1, lat2, d, elevation = 0.0,
+		    below_from;
+		bool terminated;
+		site destination;
+
+		lat1 = v->source.lat * DEG2RAD;
+		lon1 = v->source.lon * DEG2RAD;
+		beta = (max_range + g->step) / 3959.0;
+
+		for (a = v->side * g->azimuths / NUM_SECTIONS;
+		     a < (v->side + 1) * g->azimuths / NUM_SECTIONS; a++) {
+			/* Rows outside a -sec window stay empty, but for
+			   one either side so the edges interpolate */
+
+			if (!InSector(a * g->az_step, g->az_step)) {
+				for (b = 0; b < g->bins; b++)
+					g->loss[a * g->bins + b] = NAN;
+				continue;
+			}
+
+			azimuth = a * g->az_step * DEG2RAD;
+
+			/* Great circle destination, longitudes positive west */
+
+			lat2 = asin(sin(lat1) * cos(beta) +
+				    cos(azimuth) * sin(beta) * cos(lat1));
+			destination.lat = lat2 / DEG2RAD;
+			destination.lon = (lon1 - atan2(sin(azimuth) * sin(beta) * cos(lat1),
+							cos(beta) - sin(lat1) * sin(lat2))) / DEG2RAD;
+			destination.alt = v->altitude;
+
+			if (destination.lon < 0.0)
+				destination.lon += 360.0;
+
+			if (destination.lon >= 360.0)
+				destination.lon -= 360.0;
+
+			ReadPropPath(v->source, destination);
+			terminated = false;
+			below_from = -1.0;
+
+			for (b = 0, y = 2; b < g->bins; b++) {
+				cell = a * g->bins + b;
+				d = (b + 1) * g->step;
+
+				if (terminated) {
+					g->loss[cell] = NAN;
+					et_skipped++;
+					continue;
+				}
+
+				/* Nearest path sample to this bin */
+
+				while (y + 1 < path.length - 1 &&
+				       fabs(path.distance[y + 1] - d) <
+				       fabs(path.distance[y] - d))
+					y++;
 
-	//if(cropLon>180)
-	//	cropLon-=360;
+				if (y >= path.length - 1 ||
+				    fabs(path.distance[y] - d) > g->step) {
+					g->loss[cell] = NAN;
+					continue;
+				}
+
+				g->loss[cell] = (float)PropPathLoss(v->source, destination,
+							y, v->fd, v->propmodel, v->knifeedge,
+							v->pmenv, &elevation, &block, NULL);
+
+				if (g->elevation != NULL)
+					g->elevation[cell] = (float)elevation;
+
+				if (g->block != NULL)
+					g->block[cell] = block;
+
+				if (early_termination)
+					terminated = EarlyTermination(
+						ThresholdMargin(PatternLoss(g->loss[cell],
+							a * g->az_step, elevation), LR.frq_mhz),
+						d, &below_from);
+			}
+		}
+	}
+
+	void polarScan(propagationRange *v)
+	{
+		/* Scan convert the polar grid into this thread's band of
+		   rows of every DEM page.  Each pixel takes the loss (and
+		   elevation angle) interpolated between the four cells
+		   around it, so no pixel is written by two threads. */
+
+		polarGrid *g = v->grid;
+		int indx, x, y, a0, a1, b0, i, cell[4];
+		char block;
+		double fa, fb, wa, wb, w[4], wsum, loss, elevation, azimuth, d;
+		site p;
+
+		for (indx = 0; indx < MAXPAGES; indx++) {
+			if (dem[indx].max_north < dem[indx].min_north)
+				continue;	/* Page not in use */
+
+			for (x = v->side * ippd / NUM_SECTIONS;
+			     x < (v->side + 1) * ippd / NUM_SECTIONS; x++)
+				for (y = 0; y <= mpi; y++) {
+					p.lat = dem[indx].min_north + dpp * (double)x;
+					p.lon = dem[indx].max_west - (double)(mpi - y) / yppd;
+
+					if (p.lon < 0.0)
+						p.lon += 360.0;
+
+					d = Distance(v->source, p);
+
+					if (d > max_range || d == 0.0 || !InAOI(p.lat, p.lon))
+						continue;
+
+					azimuth = Azimuth(v->source, p);
+
+					fa = azimuth / g->az_step;
+					a0 = (int)floor(fa);
+					wa = fa - (double)a0;
+					a0 %= g->azimuths;
+					a1 = (a0 + 1) % g->azimuths;
+
+					fb = d / g->step - 1.0;
+					if (fb < 0.0)
+						fb = 0.0;
+					b0 = (int)floor(fb);
+					if (b0 > g->bins - 2)
+						b0 = g->bins - 2;
+					wb = fb - (double)b0;
+
+					cell[0] = a0 * g->bins + b0;
+					cell[1] = a1 * g->bins + b0;
+					cell[2] = a0 * g->bins + b0 + 1;
+					cell[3] = a1 * g->bins + b0 + 1;
+					w[0] = (1.0 - wa) * (1.0 - wb);
+					w[1] = wa * (1.0 - wb);
+					w[2] = (1.0 - wa) * wb;
+					w[3] = wa * wb;
+
+					/* Leave out cells the rays never reached */
+
+					for (i = 0, wsum = loss = elevation = 0.0; i < 4; i++)
+						if (!isnan(g->loss[cell[i]])) {
+							wsum += w[i];
+							loss += w[i] * g->loss[cell[i]];
+							if (g->elevation != NULL)
+								elevation += w[i] * g->elevation[cell[i]];
+						}
+
+					if (wsum == 0.0)
+						continue;
+
+					loss /= wsum;
+					elevation /= wsum;
+					block = (g->block == NULL ? 0 :
+						 g->block[cell[(wa > 0.5 ? 1 : 0) + (wb > 0.5 ? 2 : 0)]]);
+
+					PutPropSignal(p.lat, p.lon, loss, LR.frq_mhz,
+						      azimuth, elevation, block,
+						      v->mask_value, v->fd);
+				}
+		}
+	}
+
+	void* polarSection(propagationRange *v)
+	{
+		unsigned long skipped = et_skipped;
+
+		if(v->use_threads && v->phase == 0) {
+			alloc_elev();
+			alloc_path();
+		}
+
+		if(v->phase == 0)
+			polarRays(v);
+		else
+			polarScan(v);
+
+		v->skipped = et_skipped - skipped;
+
+		if(v->use_threads && v->phase == 0) {
+			free_elev();
+			free_path();
+		}
+		return NULL;
+	}
+}
+
+static unsigned long PlotPolarPropagation(struct site source, double altitude,
+				 FILE *fd, unsigned char mask_value,
+				 int propmodel, int knifeedge, int pmenv,
+				 bool use_threads)
+{
+	/* This function computes the coverage on a polar grid centred
+	   on the transmitter, with uniform azimuth steps and uniform
+	   range bins, and then scan converts it into the signal[][]
+	   raster.  The rays sample every bin whether or not a pixel
+	   lies there, so the cost of a run depends only on max_range
+	   and the resolution, and as each thread owns its rays and
+	   then its rows of pixels, no locking is needed.  Returns
+	   the number of samples skipped by early termination. */
+
+	polarGrid grid;
+	propagationRange r[NUM_SECTIONS];
+	double pixel;
+	size_t cells;
+	unsigned long skipped = 0;
+	int i, phase;
+
+	/* Bins no longer than a pixel, where pixels are narrowest, and
+	   enough azimuths to step one pixel along the outermost bin */
+
+	pixel = 69.05 * cos(source.lat * DEG2RAD) / ppd;
+	grid.bins = (int)ceil(max_range / pixel);
+	if (grid.bins < 2)
+		grid.bins = 2;
+	grid.step = max_range / (double)grid.bins;
+	grid.azimuths = (int)ceil(TWOPI * grid.bins / NUM_SECTIONS) * NUM_SECTIONS;
+	grid.az_step = 360.0 / (double)grid.azimuths;
+
+	cells = (size_t)grid.azimuths * grid.bins;
+	grid.loss = new float[cells];
+	grid.elevation = (got_elevation_pattern || angle_map || fd != NULL ? new float[cells] : NULL);
+	grid.block = (fd != NULL ? new char[cells] : NULL);
+
+	if (debug)
+		fprintf(stderr, "Polar grid: %d azimuths x %d bins of %.4f miles\n",
+			grid.azimuths, grid.bins, grid.step);
+
+	for (phase = 0; phase < 2; phase++) {
+		for (i = 0; i < NUM_SECTIONS; i++) {
+			r[i].los = false;
+			r[i].raster = false;
+			r[i].polar = true;
+			r[i].phase = phase;
+			r[i].side = i;
+			r[i].grid = &grid;
+			r[i].use_threads = use_threads;
+			r[i].altitude = altitude;
+			r[i].source = source;
+			r[i].mask_value = mask_value;
+			r[i].fd = fd;
+			r[i].propmodel = propmodel;
+			r[i].knifeedge = knifeedge;
+			r[i].pmenv = pmenv;
+			r[i].packet = 0;
+
+			if(use_threads)
+				beginThread(&r[i]);
+			else
+				rangePropagation(&r[i]);
+		}
+
+		if(use_threads)
+			finishThreads();
+
+		for (i = 0; i < NUM_SECTIONS; i++)
+			skipped += r[i].skipped;
+	}
+
+	delete [] grid.loss;
+	delete [] grid.elevation;
+	delete [] grid.block;
+
+	return skipped;
 }
 
 void PlotLOSMap(struct site source, double altitude, char *plo_filename,
-		bool use_threads)
+		bool use_threads, bool raster)
 {
 	/* This function performs a 360 degree sweep around the
 	   transmitter site (source location), and plots the
@@ -709,15 +1815,18 @@ void PlotLOSMap(struct site source, double altitude, char *plo_filename,
 	   at the specified altitude (in feet AGL).  Results
 	   are stored in memory, and written out in the form
 	   of a topographic map when the WritePPM() function
-	   is later invoked. */
+	   is later invoked.  If raster is set the rays are
+	   replaced by a raster viewshed that visits every
+	   pixel once, one thread per side of the rings. */
 
 	static thread_local unsigned char mask_value = 1;
 	FILE *fd = NULL;
+	int rings = 0;
 
 	if (plo_filename[0] != 0)
 		fd = fopen(plo_filename, "wb");
 
-	if (fd != NULL) {
+	if (fd != NULL && !ano_binary) {
 		fprintf(fd,
 			"%.3f, %.3f\t; max_west, min_west\n%.3f, %.3f\t; max_north, min_north\n",
 			max_west, min_west, max_north, min_north);
@@ -732,11 +1841,37 @@ void PlotLOSMap(struct site source, double altitude, char *plo_filename,
 	double range_max_north[] = {max_north, max_north, min_north, max_north};
 	propagationRange* r[NUM_SECTIONS];
 
+	if (raster) {
+		/* Enough rings to reach max_range east/west, where the
+		   pixels are narrowest, or the furthest edge of the map */
+
+		double extent[] = {LonDiff(source.lon, min_west),
+				   LonDiff(max_west, source.lon),
+				   max_north - source.lat,
+				   source.lat - min_north};
+
+		for (int i = 0; i < NUM_SECTIONS; ++i)
+			if (ppd * extent[i] > rings)
+				rings = (int)ceil(ppd * extent[i]);
+
+		double lon_miles = 69.05 * cos(source.lat * DEG2RAD);
+
+		if (lon_miles > 0.0 && ceil(ppd * max_range / lon_miles) < rings)
+			rings = (int)ceil(ppd * max_range / lon_miles);
+
+		OrMask(source.lat, source.lon, mask_value);
+	}
+
 	for(int i = 0; i < NUM_SECTIONS; ++i) {
 		propagationRange *range = new propagationRange;
 		r[i] = range;
 		range->los = true;
+		range->raster = raster;
+		range->polar = false;
+		range->side = i;
+		range->rings = rings;
 
+		range->side = i;
 		range->eastwest = (range_min_west[i] == range_max_west[i] ? false : true);
 		range->min_west = range_min_west[i];
 		range->max_west = range_max_west[i];
@@ -748,6 +1883,7 @@ void PlotLOSMap(struct site source, double altitude, char *plo_filename,
 		range->source = source;
 		range->mask_value = mask_value;
 		range->fd = fd;
+		range->packet = 0;
 
 		if(use_threads)
 			beginThread(range);
@@ -763,6 +1899,12 @@ void PlotLOSMap(struct site source, double altitude, char *plo_filename,
 		delete r[i];
 	}
 
+	if (fd != NULL) {
+		if (ano_binary && WriteAno(fd) != 0)
+			fprintf(stderr, "Error writing %s\n", plo_filename);
+		fclose(fd);
+	}
+
 	switch (mask_value) {
 	case 1:
 		mask_value = 8;
@@ -780,7 +1922,7 @@ void PlotLOSMap(struct site source, double altitude, char *plo_filename,
 
 void PlotPropagation(struct site source, double altitude, char *plo_filename,
 		     int propmodel, int knifeedge, int haf, int pmenv, bool
-		     use_threads)
+		     use_threads, int packet, bool polar)
 {
 	static thread_local unsigned char mask_value = 1;
 	FILE *fd = NULL;
@@ -813,13 +1955,35 @@ void PlotPropagation(struct site source, double altitude, char *plo_filename,
 	if (plo_filename[0] != 0)
 		fd = fopen(plo_filename, "wb");
 
-	if (fd != NULL) {
+	if (fd != NULL && !ano_binary) {
 		fprintf(fd,
 			"%.3f, %.3f\t; max_west, min_west\n%.3f, %.3f\t; max_north, min_north\n",
 			max_west, min_west, max_north, min_north);
 	}
 
-	
+	unsigned long skipped = 0;
+
+	if (polar) {
+		skipped = PlotPolarPropagation(source, altitude, fd, mask_value,
+					       propmodel, knifeedge, pmenv,
+					       use_threads);
+
+		if (fd != NULL) {
+			if (ano_binary && WriteAno(fd) != 0)
+				fprintf(stderr, "Error writing %s\n", plo_filename);
+			fclose(fd);
+		}
+
+		if (mask_value < 30)
+			mask_value++;
+
+		if (early_termination)
+			fprintf(stderr, "Early termination skipped %lu samples\n",
+				skipped);
+
+		return;
+	}
+
 	// Four sections start here
 	// Process north edge east/west, east edge north/south,
 	// south edge east/west, west edge north/south
@@ -833,6 +1997,9 @@ void PlotPropagation(struct site source, double altitude, char *plo_filename,
 		propagationRange *range = new propagationRange;
 		r[i] = range;
 		range->los = false;
+		range->raster = false;
+		range->polar = false;
+		range->skipped = 0;
 
 		// Only process correct half
 		if((NUM_SECTIONS - i) <= (NUM_SECTIONS / 2) && haf == 1)
@@ -841,6 +2008,7 @@ void PlotPropagation(struct site source, double altitude, char *plo_filename,
 			continue;
 
 
+		range->side = i;
 		range->eastwest = (range_min_west[i] == range_max_west[i] ? false : true);
 		range->min_west = range_min_west[i];
 		range->max_west = range_max_west[i];
@@ -855,6 +2023,7 @@ void PlotPropagation(struct site source, double altitude, char *plo_filename,
 		range->propmodel = propmodel;
 		range->knifeedge = knifeedge;
 		range->pmenv = pmenv;
+		range->packet = packet;
 
 		if(use_threads)
 			beginThread(range);
@@ -867,14 +2036,22 @@ void PlotPropagation(struct site source, double altitude, char *plo_filename,
 		finishThreads();
 
 	for(int i = 0; i < NUM_SECTIONS; ++i){
+		skipped += r[i]->skipped;
 		delete r[i];
 	}
 
-       if (fd != NULL)
+	if (fd != NULL) {
+		if (ano_binary && WriteAno(fd) != 0)
+			fprintf(stderr, "Error writing %s\n", plo_filename);
 		fclose(fd);
+	}
 
 	if (mask_value < 30)
 		mask_value++;
+
+	if (early_termination)
+		fprintf(stderr, "Early termination skipped %lu samples\n",
+			skipped);
 }
 
 void PlotPath(struct site source, struct site destination, char mask_value)
@@ -5,14 +5,25 @@
 
 #include "../common.h"
 
+/* Largest number of adjacent rays traced together in packet mode */
+#define MAX_PACKET 16
+
 void PlotLOSPath(struct site source, struct site destination, char mask_value,
 		 FILE *fd);
 void PlotPropPath(struct site source, struct site destination,
 		  unsigned char mask_value, FILE * fd, int propmodel,
 		  int knifeedge, int pmenv);
-void PlotLOSMap(struct site source, double altitude, char *plo_filename, bool use_threads);
+void PlotPropPacket(struct site source, struct site *destination, int lanes,
+		    unsigned char mask_value, FILE *fd, int propmodel,
+		    int knifeedge, int pmenv);
+void PlotLOSMap(struct site source, double altitude, char *plo_filename,
+		bool use_threads, bool raster);
 void PlotPropagation(struct site source, double altitude, char *plo_filename,
-		     int propmodel, int knifeedge, int haf, int pmenv, bool use_threads);
+		     int propmodel, int knifeedge, int haf, int pmenv, bool use_threads,
+		     int packet, bool polar);
 void PlotPath(struct site source, struct site destination, char mask_value);
+double SignalValue(double loss, double frq_mhz);
+unsigned char SignalLevel(double loss, double frq_mhz);
+double PatternLoss(double loss, double azimuth, double elevation);
 
 #endif /* _LOS_HH_ */
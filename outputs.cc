@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <errno.h>
 
 #include "common.h"
 #include "main.hh"
@@ -15,989 +16,991 @@
 #include "models/itwom3.0.hh"
 #include "models/sui.hh"
 #include "image.hh"
+#include "metricgrid.hh"
+#include <Windows.h>
+
+#define RENDER_THREADS 4
+
+/* Rows drawn at once, and so the most the renderer holds in memory */
+#define RENDER_BLOCK (64 * RENDER_THREADS)
+
+/* Side of a web map tile, in pixels */
+#define XYZ_TILE 256
+
+/* What a pixel of a coverage map shows, by its signal byte (or its
+   mask for LOS maps), when it is not a label or a boundary */
+enum {
+	RENDER_COLOUR,		/* a colour of the region table */
+	RENDER_TERRAIN,		/* terrain, or white without it (-ngs) */
+	RENDER_GROUND		/* terrain even with -ngs */
+};
+
+enum { RENDER_LOSS, RENDER_SIGNAL, RENDER_POWER, RENDER_LOS };
+
+namespace {
+	/* Everything a pixel's colour depends on, tabulated once per
+	   map.  Signal bytes index colour[], label[] and kind[] (mask
+	   bytes for LOS maps), and elevations index grey[] from
+	   min_elevation, so the pixel loop does no searching or pow() */
+	struct renderTables {
+		uint8_t colour[256][3];
+		uint8_t label[256][3];
+		uint8_t kind[256];
+		uint8_t county[3];
+		uint8_t missing[3];
+		uint8_t *grey;
+		int greys;
+		bool by_mask, ngs;
+		double conversion, one_over_gamma;
+	};
+
+	struct renderBand {
+		renderTables *tables;
+		uint8_t *rgb;	/* the block of rows from origin */
+		int origin, first, last;
+		int *column;	/* [page * width + x], -1 off the page */
+	};
+
+	void buildTables(renderTables *t, int mode, unsigned char ngs)
+	{
+		int v, z, value, match;
+		unsigned terrain;
+		uint8_t *c;
+
+		/* Greyscale for land, as pow() gave it pixel by pixel */
+
+		t->one_over_gamma = 1.0 / GAMMA;
+		t->conversion = 255.0 / pow((double)(max_elevation - min_elevation),
+					    t->one_over_gamma);
+		t->greys = (max_elevation >= min_elevation ?
+			    max_elevation - min_elevation + 1 : 0);
+		t->grey = new uint8_t[t->greys + 1];
+
+		for (v = 0; v < t->greys; v++) {
+			terrain = (unsigned)(0.5 + pow((double)v, t->one_over_gamma) *
+					     t->conversion);
+			t->grey[v] = (uint8_t)terrain;
+		}
 
-void DoPathLoss(char *filename, unsigned char geo, unsigned char kml,
-		unsigned char ngs, struct site *xmtr, unsigned char txsites)
-{
-	/* This function generates a topographic map in Portable Pix Map
-	   (PPM) format based on the content of flags held in the mask[][]
-	   array (only).  The image created is rotated counter-clockwise
-	   90 degrees from its representation in dem[][] so that north
-	   points up and east points right in the image generated. */
+		t->ngs = (ngs != 0);
+		t->by_mask = (mode == RENDER_LOS);
+		t->county[0] = t->county[1] = t->county[2] = 0;
+		t->missing[0] = t->missing[1] = t->missing[2] =
+		    (mode == RENDER_LOSS ? 0 : 255);
+
+		if (mode == RENDER_LOS) {
+			/* Each transmitter's bit in the mask has a colour,
+			   as does each combination of them */
+
+			static const struct {
+				int mask;
+				uint8_t rgb[3];
+			} los[] = {
+				{1, {0, 255, 0}},	/* TX1: Green */
+				{8, {0, 255, 255}},	/* TX2: Cyan */
+				{9, {255, 255, 0}},	/* TX1 + TX2: Yellow */
+				{16, {147, 112, 219}},	/* TX3: Medium Violet */
+				{17, {255, 192, 203}},	/* TX1 + TX3: Pink */
+				{24, {255, 165, 0}},	/* TX2 + TX3: Orange */
+				{25, {0, 100, 0}},	/* TX1 + TX2 + TX3: Dark Green */
+				{32, {255, 130, 71}},	/* TX4: Sienna 1 */
+				{33, {173, 255, 47}},	/* TX1 + TX4: Green Yellow */
+				{40, {193, 255, 193}},	/* TX2 + TX4: Dark Sea Green 1 */
+				{41, {255, 235, 205}},	/* TX1 + TX2 + TX4: Blanched Almond */
+				{48, {0, 206, 209}},	/* TX3 + TX4: Dark Turquoise */
+				{49, {0, 250, 154}},	/* TX1 + TX3 + TX4: Medium Spring Green */
+				{56, {210, 180, 140}},	/* TX2 + TX3 + TX4: Tan */
+				{57, {238, 201, 0}}	/* TX1 + TX2 + TX3 + TX4: Gold2 */
+			};
+
+			t->county[0] = t->county[1] = 128;	/* Light Cyan */
+			t->county[2] = 255;
+
+			for (v = 0; v < 256; v++) {
+				t->label[v][0] = 255;		/* Red */
+				t->label[v][1] = t->label[v][2] = 0;
+				t->kind[v] = RENDER_TERRAIN;
+
+				for (z = 0; z < (int)(sizeof(los) / sizeof(los[0])); z++)
+					if ((v & 57) == los[z].mask) {
+						memcpy(t->colour[v], los[z].rgb, 3);
+						t->kind[v] = RENDER_COLOUR;
+					}
+			}
 
-	char mapfile[255];
-	unsigned red, green, blue, terrain = 0;
-	unsigned char found, mask, cityorcounty;
-	int indx, x, y, z, x0 = 0, y0 = 0, loss, match;
-	double lat, lon, conversion, one_over_gamma, minwest;
-	FILE *fd;
-	image_ctx_t ctx;
-	int success;
-
-	if( (success = image_init(&ctx, width, (kml ? height : height + 30), IMAGE_RGB, IMAGE_DEFAULT)) != 0 ){
-		fprintf(stderr,"Error initializing image: %s\n", strerror(success));
-		exit(success);
-	}
+			return;
+		}
 
-	one_over_gamma = 1.0 / GAMMA;
-	conversion =
-	    255.0 / pow((double)(max_elevation - min_elevation),
-			one_over_gamma);
+		for (v = 0; v < 256; v++) {
+			/* The region a signal byte falls in.  Path loss
+			   levels rise, signal and power levels fall. */
 
-	if( (success = LoadLossColors(xmtr[0])) != 0 ){
-		fprintf(stderr,"Error loading loss colors\n");
-		//exit(success);
-	}
+			value = (mode == RENDER_LOSS ? v : mode == RENDER_SIGNAL ?
+				 v - 100 : v - 200);
+			match = 255;
 
-	if( filename != NULL ) {
+			if (mode == RENDER_LOSS ? value <= region.level[0] :
+			    value >= region.level[0])
+				match = 0;
+			else {
+				for (z = 1; z < region.levels && match == 255; z++)
+					if (mode == RENDER_LOSS ?
+					    (value >= region.level[z - 1] &&
+					     value < region.level[z]) :
+					    (value < region.level[z - 1] &&
+					     value >= region.level[z]))
+						match = z;
+			}
 
-		if (filename[0] == 0) {
-			strncpy(filename, xmtr[0].filename, 254);
-			filename[strlen(filename) - 4] = 0;	/* Remove .qth */
-		}
+			c = t->colour[v];
+			c[0] = c[1] = c[2] = 0;
+
+			if (match < region.levels)
+				memcpy(c, region.color[match], 3);
 
-		if(image_get_filename(&ctx,mapfile,sizeof(mapfile),filename) != 0){
-			fprintf(stderr,"Error creating file name\n");
-			exit(1);
+			/* Text labels: red, or the inverse of a red region */
+
+			if (c[0] >= 180 && c[1] <= 75 && c[2] <= 75
+			    && (mode == RENDER_LOSS ? value == 0 :
+				mode == RENDER_POWER ? value != 0 : true)) {
+				t->label[v][0] = 255 ^ c[0];
+				t->label[v][1] = 255 ^ c[1];
+				t->label[v][2] = 255 ^ c[2];
+			} else {
+				t->label[v][0] = 255;
+				t->label[v][1] = t->label[v][2] = 0;
+			}
+
+			if (mode == RENDER_LOSS ? (value == 0 || (contour_threshold != 0
+				&& value > abs(contour_threshold))) :
+			    (contour_threshold != 0 && value < contour_threshold))
+				t->kind[v] = RENDER_TERRAIN;
+			else if (c[0] != 0 || c[1] != 0 || c[2] != 0)
+				t->kind[v] = RENDER_COLOUR;
+			else
+				t->kind[v] = (mode == RENDER_LOSS ? RENDER_GROUND :
+					      RENDER_TERRAIN);
 		}
+	}
 
-		fd = fopen(mapfile,"wb");
+	int addColour(uint8_t *palette, int colours, const uint8_t *c)
+	{
+		/* Adds c to the colours in palette unless it is there
+		   already.  Past 257 they are only counted. */
 
-	} else {
+		int i;
 
-		fprintf(stderr,"Writing to stdout\n");
-		fd = stdout;
+		for (i = 0; i < colours && i <= 256; i++)
+			if (memcmp(palette + i * 3, c, 3) == 0)
+				return colours;
 
-	}
+		if (colours <= 256)
+			memcpy(palette + colours * 3, c, 3);
 
-	minwest = ((double)min_west) + dpp;
+		return colours + 1;
+	}
 
-	if (minwest > 360.0)
-		minwest -= 360.0;
+	int paletteOf(renderTables *t, uint8_t *palette)
+	{
+		/* Every colour renderRows() can draw from t, into palette
+		   (room for 257), or 0 if there are more than 256 */
 
-	north = (double)max_north - dpp;
+		static const uint8_t black[3] = {0, 0, 0},
+			white[3] = {255, 255, 255}, sea[3] = {0, 0, 170};
+		uint8_t grey[3];
+		int v, colours = 0;
+		bool terrain = false;
 
-	if (kml || geo)
-		south = (double)min_north;	/* No bottom legend */
-	else
-		south = (double)min_north - (30.0 / ppd);	/* 30 pixels for bottom legend */
+		colours = addColour(palette, colours, black);	/* The legend rows */
+		colours = addColour(palette, colours, t->missing);
+		colours = addColour(palette, colours, t->county);
 
-	east = (minwest < 180.0 ? -minwest : 360.0 - min_west);
-	west = (double)(max_west < 180 ? -max_west : 360 - max_west);
+		for (v = 0; v < 256; v++) {
+			colours = addColour(palette, colours, t->label[v]);
 
-	if (debug) {
-		fprintf(stderr, "\nWriting \"%s\" (%ux%u pixmap image)...\n",
-			filename != NULL ? mapfile : "to stdout", width, (kml ? height : height + 30));
-		fflush(stderr);
-	}
+			if (t->kind[v] == RENDER_COLOUR)
+				colours = addColour(palette, colours, t->colour[v]);
+			else if (t->ngs && t->kind[v] == RENDER_TERRAIN)
+				colours = addColour(palette, colours, white);
+			else
+				terrain = true;
+		}
 
-	for (y = 0, lat = north; y < (int)height;
-	     y++, lat = north - (dpp * (double)y)) {
-		for (x = 0, lon = max_west; x < (int)width;
-		     x++, lon = max_west - (dpp * (double)x)) {
-			if (lon < 0.0)
-				lon += 360.0;
+		if (terrain) {
+			colours = addColour(palette, colours, sea);
 
-			for (indx = 0, found = 0;
-			     indx < MAXPAGES && found == 0;) {
-				x0 = (int)rint(ppd *
-					       (lat -
-						(double)dem[indx].min_north));
-				y0 = mpi -
-				    (int)rint(ppd *
-					      (LonDiff
-					       ((double)dem[indx].max_west,
-						lon)));
-				 // fix for multi-tile lidar
-                              /*  if(width==10000 && (indx==1 || indx==3)){
-                                        if(y0 >= 3432){ //3535
-                                                y0=y0-3432;
-                                        }
-                                }*/
-
-
-				if (x0 >= 0 && x0 <= mpi && y0 >= 0
-				    && y0 <= mpi)
-					found = 1;
-				else
-					indx++;
+			for (v = 0; v < t->greys && colours <= 256; v++) {
+				grey[0] = grey[1] = grey[2] = t->grey[v];
+				colours = addColour(palette, colours, grey);
 			}
+		}
 
-			if (found) {
-				mask = dem[indx].mask[x0][y0];
-				loss = (dem[indx].signal[x0][y0]);
-				cityorcounty = 0;
-
-				match = 255;
-
-				red = 0;
-				green = 0;
-				blue = 0;
-
-				if (loss <= region.level[0])
-					match = 0;
-				else {
-					for (z = 1;
-					     (z < region.levels
-					      && match == 255); z++) {
-						if (loss >= region.level[z - 1]
-						    && loss < region.level[z])
-							match = z;
-					}
-				}
+		return (colours <= 256 ? colours : 0);
+	}
 
-				if (match < region.levels) {
-					red = region.color[match][0];
-					green = region.color[match][1];
-					blue = region.color[match][2];
-				}
+	void shadePixel(const renderTables *t, uint8_t *out, unsigned char mask,
+			unsigned char signal, int d)
+	{
+		/* The colour of a pixel with the given mask, signal byte
+		   and elevation (metres) */
 
-				if (mask & 2) {
-					/* Text Labels: Red or otherwise */
+		const uint8_t *c;
+		int key = (t->by_mask ? mask : signal);
+		unsigned terrain;
 
-					if (red >= 180 && green <= 75
-					    && blue <= 75 && loss == 0)
-						ADD_PIXEL(&ctx, 255 ^ red,
-							255 ^ green,
-							255 ^ blue);
-					else
-						ADD_PIXEL(&ctx, 255, 0,
-							0);
+		if (mask & 2)
+			c = t->label[key];	/* Text Labels */
 
-					cityorcounty = 1;
-				}
+		else if (mask & 4)
+			c = t->county;		/* County Boundaries */
 
-				else if (mask & 4) {
-					/* County Boundaries: Black */
+		else if (t->kind[key] == RENDER_COLOUR)
+			c = t->colour[key];
 
-					ADD_PIXEL(&ctx, 0, 0, 0);
+		else if (t->ngs && t->kind[key] == RENDER_TERRAIN) {
+			out[0] = out[1] = out[2] = 255;	/* No terrain */
+			return;
+		}
 
-					cityorcounty = 1;
-				}
+		else if (d == 0) {
+			out[0] = out[1] = 0;		/* Sea-level: Medium Blue */
+			out[2] = 170;
+			return;
+		}
 
-				if (cityorcounty == 0) {
-					if (loss == 0
-					    || (contour_threshold != 0
-						&& loss >
-						abs(contour_threshold))) {
-						if (ngs)	/* No terrain */
-							ADD_PIXEL(&ctx, 
-								255, 255, 255);
-						else {
-							/* Display land or sea elevation */
-
-							if (dem[indx].
-							    data[x0][y0] == 0)
-								ADD_PIXEL(&ctx, 
-									0, 0,
-									170);
-							else {
-								terrain =
-								    (unsigned)
-								    (0.5 +
-								     pow((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-								ADD_PIXEL(&ctx, 
-									terrain,
-									terrain,
-									terrain);
-							}
-						}
-					}
+		else {
+			/* Elevation: Greyscale */
 
-					else {
-						/* Plot path loss in color */
-
-						if (red != 0 || green != 0
-						    || blue != 0)
-							ADD_PIXEL(&ctx, 
-								red, green,
-								blue);
-
-						else {	/* terrain / sea-level */
-
-							if (dem[indx].
-							    data[x0][y0] == 0)
-								ADD_PIXEL(&ctx, 
-									0, 0,
-									170);
-							else {
-								/* Elevation: Greyscale */
-								terrain =
-								    (unsigned)
-								    (0.5 +
-								     pow((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-								ADD_PIXEL(&ctx, 
-									terrain,
-									terrain,
-									terrain);
-							}
-						}
-					}
-				}
-			}
+			d -= min_elevation;
 
+			if (d >= 0 && d < t->greys)
+				out[0] = out[1] = out[2] = t->grey[d];
 			else {
-				/* We should never get here, but if */
-				/* we do, display the region as black */
-
-				ADD_PIXEL(&ctx, 0, 0, 0);
+				terrain = (unsigned)(0.5 + pow((double)d,
+					t->one_over_gamma) * t->conversion);
+				out[0] = out[1] = out[2] = (uint8_t)terrain;
 			}
+			return;
 		}
-	}
 
-	if((success = image_write(&ctx,fd)) != 0){
-		fprintf(stderr,"Error writing image\n");
-		exit(success);
+		out[0] = c[0];
+		out[1] = c[1];
+		out[2] = c[2];
 	}
 
-	image_free(&ctx);
+	void renderMetricRows(renderBand *b)
+	{
+		/* As renderRows(), for a metric grid, whose cells are
+		   the pixels of the map */
 
-	if( filename != NULL ) {
-		fclose(fd);
-		fd = NULL;
+		size_t cell = (size_t)b->first * tm_grid->size;
+		uint8_t *out = b->rgb + (size_t)(b->first - b->origin) * width * 3;
+
+		for (; cell < (size_t)b->last * tm_grid->size; cell++, out += 3) {
+			if (tm_grid->elevation[cell] == METRIC_NO_DEM &&
+			    tm_grid->signal[cell] == 0 && tm_grid->mask[cell] == 0)
+				memcpy(out, b->tables->missing, 3);
+			else
+				shadePixel(b->tables, out, tm_grid->mask[cell],
+					   tm_grid->signal[cell],
+					   tm_grid->elevation[cell]);
+		}
 	}
 
-}
+	void renderRows(renderBand *b)
+	{
+		/* Draws rows first to last of the map into rgb.  The
+		   page and pixel column of each map column were found
+		   once for the map, so a row only has to find which
+		   pages it crosses. */
+
+		renderTables *t = b->tables;
+		int indx, x, y, x0, y0, rowPage[MAXPAGES];
+		double lat;
+		uint8_t *out = b->rgb + (size_t)(b->first - b->origin) * width * 3;
+
+		if (tm_grid != NULL) {
+			renderMetricRows(b);
+			return;
+		}
 
-int DoSigStr(char *filename, unsigned char geo, unsigned char kml,
-	      unsigned char ngs, struct site *xmtr, unsigned char txsites)
-{
-	/* This function generates a topographic map in Portable Pix Map
-	   (PPM) format based on the signal strength values held in the
-	   signal[][] array.  The image created is rotated counter-clockwise
-	   90 degrees from its representation in dem[][] so that north
-	   points up and east points right in the image generated. */
+		for (y = b->first; y < b->last; y++) {
+			lat = (double)max_north - dpp - (dpp * (double)y);
 
-	char mapfile[255];
-	unsigned terrain, red, green, blue;
-	unsigned char found, mask, cityorcounty;
-	int indx, x, y, z = 1, x0 = 0, y0 = 0, signal, match;
-	double conversion, one_over_gamma, lat, lon, minwest;
-	FILE *fd;
-	image_ctx_t ctx;
-	int success;
-
-	if((success = image_init(&ctx, width, (kml ? height : height + 30), IMAGE_RGB, IMAGE_DEFAULT)) != 0){
-		fprintf(stderr,"Error initializing image: %s\n", strerror(success));
-		exit(success);
-	}
+			for (indx = 0; indx < MAXPAGES; indx++) {
+				x0 = (int)rint(ppd * (lat - (double)dem[indx].min_north));
+				rowPage[indx] = (x0 >= 0 && x0 <= mpi ? x0 : -1);
+			}
 
-	one_over_gamma = 1.0 / GAMMA;
-	conversion =
-	    255.0 / pow((double)(max_elevation - min_elevation),
-			one_over_gamma);
+			for (x = 0; x < (int)width; x++, out += 3) {
+				for (indx = 0; indx < MAXPAGES; indx++)
+					if (rowPage[indx] >= 0 &&
+					    b->column[indx * width + x] >= 0)
+						break;
 
-	if( (success = LoadSignalColors(xmtr[0])) != 0 ){
-		fprintf(stderr,"Error loading signal colors\n");
-		//exit(success);
-	}
+				if (indx == MAXPAGES) {
+					/* We should never get here, but if we do,
+					   display the region as black (or white) */
 
-	if( filename != NULL ) {
+					memcpy(out, t->missing, 3);
+					continue;
+				}
 
-		if (filename[0] == 0) {
-			strncpy(filename, xmtr[0].filename, 254);
-			filename[strlen(filename) - 4] = 0;	/* Remove .qth */
+				x0 = rowPage[indx];
+				y0 = b->column[indx * width + x];
+				shadePixel(t, out, dem[indx].mask[x0][y0],
+					   dem[indx].signal[x0][y0],
+					   dem[indx].data[x0][y0]);
+			}
 		}
+	}
 
-		if(image_get_filename(&ctx,mapfile,sizeof(mapfile),filename) != 0){
-			fprintf(stderr,"Error creating file name\n");
-			exit(1);
-		}
+	int *mapColumns(void)
+	{
+		/* The column of every page each map column falls on, as
+		   [page * width + x], -1 off the page */
 
-		fd = fopen(mapfile,"wb");
+		int indx, x, y0, *column = new int[(size_t)MAXPAGES * width];
+		double lon;
 
-	} else {
+		for (x = 0; x < (int)width; x++) {
+			lon = max_west - (dpp * (double)x);
 
-		fprintf(stderr,"Writing to stdout\n");
-		fd = stdout;
+			if (lon < 0.0)
+				lon += 360.0;
 
+			for (indx = 0; indx < MAXPAGES; indx++) {
+				y0 = mpi - (int)rint(ppd * (LonDiff((double)dem[indx].max_west, lon)));
+				column[indx * width + x] = (y0 >= 0 && y0 <= mpi ? y0 : -1);
+			}
+		}
+
+		return column;
 	}
 
-	minwest = ((double)min_west) + dpp;
+	int renderMap(image_ctx_t *ctx, int mode, unsigned char ngs)
+	{
+		/* Draws the map into ctx a block of rows at a time, a band
+		   of each block per thread, handing the rows on as each
+		   block is done so a streaming image never holds more.
+		   This is the one renderer behind DoPathLoss(), DoSigStr(),
+		   DoRxdPwr() and DoLOS(), which differ only in tables. */
 
-	if (minwest > 360.0)
-		minwest -= 360.0;
+		renderTables tables;
+		renderBand band[RENDER_THREADS];
+		HANDLE threads[RENDER_THREADS];
+		int y, i, rows, bands, started, *column, success = 0;
+		uint8_t *rgb, palette[257 * 3];
 
-	north = (double)max_north - dpp;
+		buildTables(&tables, mode, ngs);
 
-	south = (double)min_north;	/* No bottom legend */
+		/* A PNG can then hold indices rather than pixels */
 
-	east = (minwest < 180.0 ? -minwest : 360.0 - min_west);
-	west = (double)(max_west < 180 ? -max_west : 360 - max_west);
+		if ((i = paletteOf(&tables, palette)) > 0)
+			image_set_palette(ctx, palette, i);
 
-	if (debug) {
-		fprintf(stderr, "\nWriting \"%s\" (%ux%u pixmap image)...\n",
-			filename != NULL ? mapfile : "to stdout", width, (kml ? height : height + 30));
-		fflush(stderr);
-	}
+		column = (tm_grid != NULL ? NULL : mapColumns());
 
-	for (y = 0, lat = north; y < (int)height;
-	     y++, lat = north - (dpp * (double)y)) {
-		for (x = 0, lon = max_west; x < (int)width;
-		     x++, lon = max_west - (dpp * (double)x)) {
-			if (lon < 0.0)
-				lon += 360.0;
+		rgb = new uint8_t[(size_t)width * RENDER_BLOCK * 3];
+
+		for (y = 0; y < (int)height && success == 0; y += rows) {
+			rows = ((int)height - y < RENDER_BLOCK ? (int)height - y : RENDER_BLOCK);
+			bands = (rows >= 64 * RENDER_THREADS ? RENDER_THREADS : 1);
 
-			for (indx = 0, found = 0;
-			     indx < MAXPAGES && found == 0;) {
-				x0 = (int)rint(ppd *
-					       (lat -
-						(double)dem[indx].min_north));
-				y0 = mpi -
-				    (int)rint(ppd *
-					      (LonDiff
-					       ((double)dem[indx].max_west,
-						lon)));
-
-				 // fix for multi-tile lidar
-                           /*     if(width==10000 && (indx==1 || indx==3)){
-                                        if(y0 >= 3432){ //3535
-                                                y0=y0-3432;
-                                        }
-                                }
-				*/
-
-				if (x0 >= 0 && x0 <= mpi && y0 >= 0
-				    && y0 <= mpi)
-					found = 1;
+			for (i = 0; i < bands; i++) {
+				band[i].tables = &tables;
+				band[i].rgb = rgb;
+				band[i].column = column;
+				band[i].origin = y;
+				band[i].first = y + i * rows / bands;
+				band[i].last = y + (i + 1) * rows / bands;
+			}
+
+			for (i = 1, started = 0; i < bands; i++) {
+				threads[started] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ renderRows((renderBand*)arg); return 0; }, &band[i], 0, 0);
+				if (threads[started] == nullptr)
+					renderRows(&band[i]);
 				else
-					indx++;
+					++started;
 			}
 
-			if (found) {
-				mask = dem[indx].mask[x0][y0];
-				signal = (dem[indx].signal[x0][y0]) - 100;
-				cityorcounty = 0;
-				match = 255;
-
-				red = 0;
-				green = 0;
-				blue = 0;
-
-				if (signal >= region.level[0])
-					match = 0;
-				else {
-					for (z = 1;
-					     (z < region.levels
-					      && match == 255); z++) {
-						if (signal < region.level[z - 1]
-						    && signal >=
-						    region.level[z])
-							match = z;
-					}
-				}
+			renderRows(&band[0]);
 
-				if (match < region.levels) {
-					red = region.color[match][0];
-					green = region.color[match][1];
-					blue = region.color[match][2];
-				}
+			for (i = 0; i < started; i++) {
+				WaitForSingleObject(threads[i], INFINITE);
+				CloseHandle(threads[i]);
+			}
 
-				if (mask & 2) {
-					/* Text Labels: Red or otherwise */
+			for (i = 0; i < rows && success == 0; i++)
+				success = image_add_row(ctx, rgb + (size_t)i * width * 3, width);
+		}
 
-					if (red >= 180 && green <= 75
-					    && blue <= 75)
-						ADD_PIXEL(&ctx, 255 ^ red,
-							255 ^ green,
-							255 ^ blue);
-					else
-						ADD_PIXEL(&ctx, 255, 0,
-							0);
+		delete [] rgb;
+		delete [] column;
+		delete [] tables.grey;
 
-					cityorcounty = 1;
-				}
+		return success;
+	}
 
-				else if (mask & 4) {
-					/* County Boundaries: Black */
+	void loadColours(struct site *xmtr, int mode)
+	{
+		/* The region table for a map of the given kind */
 
-					ADD_PIXEL(&ctx, 0, 0, 0);
+		if (mode == RENDER_LOSS && LoadLossColors(xmtr[0]) != 0)
+			fprintf(stderr,"Error loading loss colors\n");
 
-					cityorcounty = 1;
-				}
+		if (mode == RENDER_SIGNAL && LoadSignalColors(xmtr[0]) != 0)
+			fprintf(stderr,"Error loading signal colors\n");
 
-				if (cityorcounty == 0) {
-					if (contour_threshold != 0
-					    && signal < contour_threshold) {
-						if (ngs)
-							ADD_PIXEL(&ctx, 
-								255, 255, 255);
-						else {
-							/* Display land or sea elevation */
-
-							if (dem[indx].
-							    data[x0][y0] == 0)
-								ADD_PIXEL(&ctx, 
-									0, 0,
-									170);
-							else {
-								terrain =
-								    (unsigned)
-								    (0.5 +
-								     pow((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-								ADD_PIXEL(&ctx, 
-									terrain,
-									terrain,
-									terrain);
-							}
-						}
-					}
+		if (mode == RENDER_POWER && LoadDBMColors(xmtr[0]) != 0)
+			fprintf(stderr,"Error loading DBM colors\n");
+	}
 
-					else {
-						/* Plot field strength regions in color */
-
-						if (red != 0 || green != 0
-						    || blue != 0)
-							ADD_PIXEL(&ctx, 
-								red, green,
-								blue);
-
-						else {	/* terrain / sea-level */
-
-							if (ngs)
-								ADD_PIXEL(&ctx, 
-									255,
-									255,
-									255);
-							else {
-								if (dem[indx].
-								    data[x0][y0]
-								    == 0)
-									ADD_PIXEL(&ctx, 
-									     0,
-									     0,
-									     170);
-								else {
-									/* Elevation: Greyscale */
-									terrain
-									    =
-									    (unsigned)
-									    (0.5
-									     +
-									     pow
-									     ((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-									ADD_PIXEL(&ctx, 
-									     terrain,
-									     terrain,
-									     terrain);
-								}
-							}
-						}
-					}
-				}
-			}
+	int drawMap(char *filename, unsigned char kml, unsigned char ngs,
+		    struct site *xmtr, int mode)
+	{
+		/* Opens the image for a map of the given kind, loads its
+		   colours, draws it and writes it out */
+
+		char mapfile[255];
+		double minwest;
+		FILE *fd;
+		image_ctx_t ctx;
+		int success;
+
+		if( (success = image_init(&ctx, width, (kml ? height : height + 30), IMAGE_RGB, IMAGE_DEFAULT)) != 0 ){
+			fprintf(stderr,"Error initializing image: %s\n", strerror(success));
+			exit(success);
+		}
 
-			else {
-				/* We should never get here, but if */
-				/* we do, display the region as black */
+		loadColours(xmtr, mode);
 
-				ADD_PIXEL(&ctx, 255, 255, 255);
+		if( filename != NULL ) {
+
+			if (filename[0] == 0) {
+				strncpy(filename, xmtr[0].filename, 254);
+				filename[strlen(filename) - 4] = 0;	/* Remove .qth */
 			}
-		}
-	}
 
-	if((success = image_write(&ctx,fd)) != 0){
-		fprintf(stderr,"Error writing image\n");
-		exit(success);
-	}
+			if(image_get_filename(&ctx,mapfile,sizeof(mapfile),filename) != 0){
+				fprintf(stderr,"Error creating file name\n");
+				exit(1);
+			}
 
-	image_free(&ctx);
+			fd = fopen(mapfile,"wb");
 
-	if( filename != NULL ) {
-		fclose(fd);
-		fd = NULL;
-	}
-	return 0;
-}
+		} else {
 
-void DoRxdPwr(char *filename, unsigned char geo, unsigned char kml,
-	      unsigned char ngs, struct site *xmtr, unsigned char txsites)
-{
-	/* This function generates a topographic map in Portable Pix Map
-	   (PPM) format based on the signal power level values held in the
-	   signal[][] array.  The image created is rotated counter-clockwise
-	   90 degrees from its representation in dem[][] so that north
-	   points up and east points right in the image generated. */
+			fprintf(stderr,"Writing to stdout\n");
+			fd = stdout;
 
-	char mapfile[255];
-	unsigned terrain, red, green, blue;
-	unsigned char found, mask, cityorcounty;
-	int indx, x, y, z = 1, x0 = 0, y0 = 0, dBm, match;
-	double conversion, one_over_gamma, lat, lon, minwest;
-	FILE *fd;
-	image_ctx_t ctx;
-	int success;
-
-	if( (success = image_init(&ctx, width, (kml ? height : height + 30), IMAGE_RGB, IMAGE_DEFAULT)) != 0 ){
-		fprintf(stderr,"Error initializing image: %s\n", strerror(success));
-		exit(success);
-	}
+		}
 
-	one_over_gamma = 1.0 / GAMMA;
-	conversion =
-	    255.0 / pow((double)(max_elevation - min_elevation),
-			one_over_gamma);
+		minwest = ((double)min_west) + dpp;
 
-	if( (success = LoadDBMColors(xmtr[0])) != 0 ){
-		fprintf(stderr,"Error loading DBM colors\n");
-		//exit(success);
-	}
+		if (minwest > 360.0)
+			minwest -= 360.0;
+
+		north = (double)max_north - dpp;
+
+		if (mode == RENDER_LOSS && !kml)
+			south = (double)min_north - (30.0 / ppd);	/* 30 pixels for bottom legend */
+		else
+			south = (double)min_north;	/* No bottom legend */
 
-	if( filename != NULL ) {
+		east = (minwest < 180.0 ? -minwest : 360.0 - min_west);
+		west = (double)(max_west < 180 ? -max_west : 360 - max_west);
 
-		if (filename[0] == 0) {
-			strncpy(filename, xmtr[0].filename, 254);
-			filename[strlen(filename) - 4] = 0;	/* Remove .qth */
+		if (debug) {
+			fprintf(stderr, "\nWriting \"%s\" (%ux%u pixmap image)...\n",
+				filename != NULL ? mapfile : "to stdout", width, (kml ? height : height + 30));
+			fflush(stderr);
 		}
 
-		if(image_get_filename(&ctx,mapfile,sizeof(mapfile),filename) != 0){
-			fprintf(stderr,"Error creating file name\n");
-			exit(1);
+		/* Rows go out as they are drawn, where the format allows */
+
+		image_stream(&ctx, fd);
+
+		if((success = renderMap(&ctx, mode, ngs)) != 0 ||
+		   (success = image_write(&ctx,fd)) != 0){
+			fprintf(stderr,"Error writing image\n");
+			exit(success);
 		}
 
-		fd = fopen(mapfile,"wb");
+		fflush(fd);
 
-	} else {
+		image_free(&ctx);
 
-		fprintf(stderr,"Writing to stdout\n");
-		fd = stdout;
+		if( filename != NULL ) {
+			fclose(fd);
+			fd = NULL;
 
+			/* A metric grid is placed by a world file */
+
+			if (tm_grid != NULL && (success = WriteMetricWorld(mapfile)) != 0)
+				fprintf(stderr, "Error writing world file: %s\n", strerror(success));
+		}
+
+		return 0;
 	}
 
-	minwest = ((double)min_west) + dpp;
+	/* An XYZ tile: the signal byte (mask for LOS maps) under each
+	   of its pixels, 0 where there is none */
+	struct xyzTile {
+		int x, y;
+		uint8_t *keys;
+	};
+
+	struct xyzLevel {
+		renderTables *tables;
+		int mode, z, count, *column;
+		xyzTile *tiles;		/* this zoom's */
+		xyzTile *finer;		/* the next zoom's, by y then x */
+		int finer_count;
+		uint8_t palette[257 * 4];
+		int colours;
+		char *dir;
+	};
+
+	struct xyzShare {
+		xyzLevel *level;
+		int first, success;
+	};
+
+	int compareTiles(const void *a, const void *b)
+	{
+		const xyzTile *p = (const xyzTile *)a, *q = (const xyzTile *)b;
+
+		return (p->y != q->y ? (p->y < q->y ? -1 : 1) :
+			p->x != q->x ? (p->x < q->x ? -1 : 1) : 0);
+	}
 
-	if (minwest > 360.0)
-		minwest -= 360.0;
+	uint8_t strongerKey(int mode, uint8_t a, uint8_t b)
+	{
+		/* The key of the two to show when zooming out: coverage
+		   never shrinks, and the stronger signal wins */
 
-	north = (double)max_north - dpp;
+		if (a == 0 || b == 0)
+			return (uint8_t)(a | b);
 
-	south = (double)min_north;	/* No bottom legend */
+		if (mode == RENDER_LOS)
+			return (uint8_t)(a | b);
 
-	east = (minwest < 180.0 ? -minwest : 360.0 - min_west);
-	west = (double)(max_west < 180 ? -max_west : 360 - max_west);
+		if (mode == RENDER_LOSS)
+			return (a < b ? a : b);
 
-	if (debug) {
-		fprintf(stderr, "\nWriting \"%s\" (%ux%u pixmap image)...\n",
-			(filename != NULL ? mapfile : "to stdout"), width, (kml ? height : height));
-		fflush(stderr);
+		return (a > b ? a : b);
 	}
 
-	// Draw image of x by y pixels
-	for (y = 0, lat = north; y < (int)height;
-	     y++, lat = north - (dpp * (double)y)) {
-		for (x = 0, lon = max_west; x < (int)width;
-		     x++, lon = max_west - (dpp * (double)x)) {
-			if (lon < 0.0)
-				lon += 360.0;
+	double mercatorRow(double lat, int z)
+	{
+		/* The global pixel row of lat at zoom z, from the north */
 
-			for (indx = 0, found = 0;
-			     indx < MAXPAGES && found == 0;) {
+		lat = (lat > 85.05112878 ? 85.05112878 :
+		       lat < -85.05112878 ? -85.05112878 : lat) * DEG2RAD;
 
-				x0 = (int)rint((ppd *
-					      (lat -
-						(double)dem[indx].min_north))); 
-				y0 = mpi -
-				    (int)rint(ppd * 
-					      (LonDiff
-					       ((double)dem[indx].max_west,lon)));
+		return (1.0 - log(tan(lat) + 1.0 / cos(lat)) / PI) / 2.0 *
+		    XYZ_TILE * (double)(1 << z);
+	}
 
+	void sampleTile(xyzLevel *l, xyzTile *tile)
+	{
+		/* Takes each pixel of a tile at the finest zoom from the
+		   map pixel it falls in, as the map would draw it.  Map
+		   row y and column x are centred on max_north - dpp - dpp
+		   * y and max_west - dpp * x. */
+
+		int indx, px, py, x, y, x0, rowPage[MAXPAGES], mapX[XYZ_TILE];
+		double world = XYZ_TILE * (double)(1 << l->z), lat, lon;
+		unsigned char mask;
+
+		for (px = 0; px < XYZ_TILE; px++) {
+			lon = ((tile->x * XYZ_TILE + px + 0.5) / world) * 360.0 - 180.0;
+			x = (int)rint(LonDiff(max_west, lon < 0.0 ? -lon : 360.0 - lon) / dpp);
+			mapX[px] = (x >= 0 && x < (int)width ? x : -1);
+		}
 
-				if (x0 >= 0 && x0 <= mpi && y0 >= 0
-				    && y0 <= mpi)
-					found = 1;
-				else
-					indx++;
+		for (py = 0; py < XYZ_TILE; py++) {
+			lat = atan(sinh(PI * (1.0 - 2.0 * (tile->y * XYZ_TILE + py + 0.5) /
+					       world))) / DEG2RAD;
+			y = (int)rint((max_north - dpp - lat) / dpp);
 
+			if (y < 0 || y >= (int)height) {
+				memset(tile->keys + py * XYZ_TILE, 0, XYZ_TILE);
+				continue;
+			}
+
+			lat = (double)max_north - dpp - (dpp * (double)y);
 
+			for (indx = 0; indx < MAXPAGES; indx++) {
+				x0 = (int)rint(ppd * (lat - (double)dem[indx].min_north));
+				rowPage[indx] = (x0 >= 0 && x0 <= mpi ? x0 : -1);
 			}
 
-			if (found) {
-				mask = dem[indx].mask[x0][y0];
-				dBm = (dem[indx].signal[x0][y0]) - 200;
-				cityorcounty = 0;
-				match = 255;
-
-				red = 0;
-				green = 0;
-				blue = 0;
-
-				if (dBm >= region.level[0])
-					match = 0;
-				else {
-					for (z = 1;
-					     (z < region.levels
-					      && match == 255); z++) {
-						if (dBm < region.level[z - 1]
-						    && dBm >= region.level[z])
-							match = z;
-					}
-				}
+			for (px = 0; px < XYZ_TILE; px++) {
+				tile->keys[py * XYZ_TILE + px] = 0;
 
-				if (match < region.levels) {
-					red = region.color[match][0];
-					green = region.color[match][1];
-					blue = region.color[match][2];
-				}
+				if ((x = mapX[px]) < 0)
+					continue;
 
-				if (mask & 2) {
-					/* Text Labels: Red or otherwise */
+				for (indx = 0; indx < MAXPAGES; indx++)
+					if (rowPage[indx] >= 0 && l->column[indx * width + x] >= 0)
+						break;
 
-					if (red >= 180 && green <= 75
-					    && blue <= 75 && dBm != 0)
-						ADD_PIXEL(&ctx, 255 ^ red,
-							255 ^ green,
-							255 ^ blue);
-					else
-						ADD_PIXEL(&ctx, 255, 0,
-							0);
+				if (indx == MAXPAGES)
+					continue;
 
-					cityorcounty = 1;
-				}
+				x0 = rowPage[indx];
+				mask = dem[indx].mask[x0][l->column[indx * width + x]];
+				tile->keys[py * XYZ_TILE + px] = (l->mode == RENDER_LOS ?
+					mask & 57 : dem[indx].signal[x0][l->column[indx * width + x]]);
+			}
+		}
+	}
 
-				else if (mask & 4) {
-					/* County Boundaries: Black */
-					ADD_PIXEL(&ctx, 0, 0, 0);
-					cityorcounty = 1;
-				}
+	void shrinkTile(xyzLevel *l, xyzTile *tile)
+	{
+		/* Builds a tile from its (up to) four children a zoom in,
+		   each pixel from the strongest of the four under it */
 
-				if (cityorcounty == 0) {
-					if (contour_threshold != 0
-					    && dBm < contour_threshold) {
-						if (ngs)	/* No terrain */
-							ADD_PIXEL(&ctx,
-								255, 255, 255);
-						else {
-							/* Display land or sea elevation */
-
-							if (dem[indx].
-							    data[x0][y0] == 0)
-								ADD_PIXEL(&ctx,
-									0, 0,
-									170);
-							else {
-								terrain =
-								    (unsigned)
-								    (0.5 +
-								     pow((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-								ADD_PIXEL(&ctx,
-									terrain,
-									terrain,
-									terrain);
-							}
-						}
-					}
+		xyzTile key, *child;
+		int cx, cy, px, py, x, y;
+		uint8_t *out, *in;
 
-					else {
-						/* Plot signal power level regions in color */
-
-						if (red != 0 || green != 0
-						    || blue != 0)
-							ADD_PIXEL(&ctx,
-								red, green,
-								blue);
-
-						else {	/* terrain / sea-level */
-
-							if (ngs)
-								ADD_PIXEL(&ctx, 
-									255,
-									255,
-									255); // WHITE
-							else {
-								if (dem[indx].
-								    data[x0][y0]
-								    == 0)
-									ADD_PIXEL(&ctx, 
-									     0,
-									     0,
-									     170); // BLUE
-								else {
-									/* Elevation: Greyscale */
-									terrain
-									    =
-									    (unsigned)
-									    (0.5
-									     +
-									     pow
-									     ((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-									ADD_PIXEL(&ctx, 
-									     terrain,
-									     terrain,
-									     terrain);
-								}
-							}
-						}
+		memset(tile->keys, 0, XYZ_TILE * XYZ_TILE);
+
+		for (cy = 0; cy < 2; cy++)
+			for (cx = 0; cx < 2; cx++) {
+				key.x = tile->x * 2 + cx;
+				key.y = tile->y * 2 + cy;
+				child = (xyzTile *)bsearch(&key, l->finer, l->finer_count,
+							   sizeof(xyzTile), compareTiles);
+
+				if (child == NULL)
+					continue;
+
+				for (py = 0; py < XYZ_TILE / 2; py++) {
+					out = tile->keys + (cy * XYZ_TILE / 2 + py) * XYZ_TILE + cx * XYZ_TILE / 2;
+					in = child->keys + py * 2 * XYZ_TILE;
+
+					for (px = 0; px < XYZ_TILE / 2; px++) {
+						x = px * 2;
+						y = strongerKey(l->mode, in[x], in[x + 1]);
+						y = strongerKey(l->mode, (uint8_t)y, in[XYZ_TILE + x]);
+						out[px] = strongerKey(l->mode, (uint8_t)y, in[XYZ_TILE + x + 1]);
 					}
 				}
 			}
+	}
 
-			else {
-				/* We should never get here, but if */
-				/* we do, display the region as black */
+	int writeTile(xyzLevel *l, xyzTile *tile)
+	{
+		/* Writes a tile as dir/z/x/y.png, clear where it shows
+		   nothing, unless that is all of it */
+
+		renderTables *t = l->tables;
+		char name[320];
+		uint8_t row[XYZ_TILE * 4], *c;
+		image_ctx_t ctx;
+		int i, x, y, success;
+		bool empty = true;
+		FILE *fd;
+
+		for (i = 0; i < XYZ_TILE * XYZ_TILE && empty; i++)
+			if (tile->keys[i] != 0 && t->kind[tile->keys[i]] == RENDER_COLOUR)
+				empty = false;
+
+		if (empty)
+			return 0;
+
+		snprintf(name, sizeof(name), "%s/%d", l->dir, l->z);
+		CreateDirectoryA(name, NULL);
+		snprintf(name, sizeof(name), "%s/%d/%d", l->dir, l->z, tile->x);
+		CreateDirectoryA(name, NULL);
+		snprintf(name, sizeof(name), "%s/%d/%d/%d.png", l->dir, l->z, tile->x, tile->y);
+
+		if ((fd = fopen(name, "wb")) == NULL)
+			return errno;
+
+		if ((success = image_init(&ctx, XYZ_TILE, XYZ_TILE, IMAGE_RGBA, IMAGE_PNG)) != 0) {
+			fclose(fd);
+			return success;
+		}
+
+		if (l->colours > 0)
+			image_set_palette(&ctx, l->palette, l->colours);
 
-				ADD_PIXEL(&ctx, 255, 255, 255);
+		image_stream(&ctx, fd);
+
+		for (y = 0; y < XYZ_TILE && success == 0; y++) {
+			for (x = 0; x < XYZ_TILE; x++) {
+				i = tile->keys[y * XYZ_TILE + x];
+				c = t->colour[i];
+
+				if (i != 0 && t->kind[i] == RENDER_COLOUR) {
+					memcpy(row + x * 4, c, 3);
+					row[x * 4 + 3] = 255;
+				} else
+					memset(row + x * 4, 0, 4);
 			}
+
+			success = image_add_row(&ctx, row, XYZ_TILE);
 		}
-	}
 
-	if((success = image_write(&ctx,fd)) != 0){
-		fprintf(stderr,"Error writing image\n");
-		exit(success);
+		if (success == 0)
+			success = image_write(&ctx, fd);
+
+		image_free(&ctx);
+		fclose(fd);
+
+		return success;
 	}
 
-	fflush(fd);
+	void xyzTiles(xyzShare *share)
+	{
+		/* One thread's share of a zoom: every RENDER_THREADS'th
+		   tile from first.  Tiles that show nothing are dropped. */
 
-	image_free(&ctx);
+		xyzLevel *l = share->level;
+		int i;
 
-	if( filename != NULL ) {
-		fclose(fd);
-		fd = NULL;
+		for (i = share->first; i < l->count; i += RENDER_THREADS) {
+			l->tiles[i].keys = new uint8_t[XYZ_TILE * XYZ_TILE];
+
+			if (l->finer == NULL)
+				sampleTile(l, &l->tiles[i]);
+			else
+				shrinkTile(l, &l->tiles[i]);
+
+			if (share->success == 0)
+				share->success = writeTile(l, &l->tiles[i]);
+		}
 	}
 
-}
+	int drawTiles(char *dir, int zmin, int zmax, int mode)
+	{
+		/* Writes the tiles from zmax out to zmin, each zoom from
+		   the one before, a zoom's tiles split between threads */
 
-void DoLOS(char *filename, unsigned char geo, unsigned char kml,
-	   unsigned char ngs, struct site *xmtr, unsigned char txsites)
-{
-	/* This function generates a topographic map in Portable Pix Map
-	   (PPM) format based on the signal power level values held in the
-	   signal[][] array.  The image created is rotated counter-clockwise
-	   90 degrees from its representation in dem[][] so that north
-	   points up and east points right in the image generated. */
+		renderTables tables;
+		xyzLevel level;
+		xyzShare share[RENDER_THREADS];
+		HANDLE threads[RENDER_THREADS];
+		int z, x, y, x0, x1, y0, y1, i, n, started, success = 0;
+		double west = -max_west - dpp / 2.0, east, north = max_north - dpp / 2.0;
 
-	char mapfile[255];
-	unsigned terrain;
-	unsigned char found, mask;
-	int indx, x, y, x0 = 0, y0 = 0;
-	double conversion, one_over_gamma, lat, lon, minwest;
-	FILE *fd;
-	image_ctx_t ctx;
-	int success;
-
-	if((success = image_init(&ctx, width, (kml ? height : height + 30), IMAGE_RGB, IMAGE_DEFAULT)) != 0){
-		fprintf(stderr,"Error initializing image: %s\n", strerror(success));
-		exit(success);
-	}
+		buildTables(&tables, mode, 0);
 
-	one_over_gamma = 1.0 / GAMMA;
-	conversion =
-	    255.0 / pow((double)(max_elevation - min_elevation),
-			one_over_gamma);
+		memset(&level, 0, sizeof(level));
+		level.tables = &tables;
+		level.mode = mode;
+		level.dir = dir;
+		level.column = mapColumns();
 
-	if( filename != NULL ){
+		/* Clear, then every colour a tile can show */
 
-		if (filename[0] == 0) {
-			strncpy(filename, xmtr[0].filename, 254);
-			filename[strlen(filename) - 4] = 0;	/* Remove .qth */
-		}
+		for (i = 0, level.colours = 1; i < 256; i++)
+			if (tables.kind[i] == RENDER_COLOUR && level.colours <= 256) {
+				for (n = 1; n < level.colours; n++)
+					if (memcmp(level.palette + n * 4, tables.colour[i], 3) == 0)
+						break;
 
-		if(image_get_filename(&ctx,mapfile,sizeof(mapfile),filename) != 0){
-			fprintf(stderr,"Error creating file name\n");
-			exit(1);
-		}
+				if (n == level.colours) {
+					memcpy(level.palette + n * 4, tables.colour[i], 3);
+					level.palette[n * 4 + 3] = 255;
+					level.colours++;
+				}
+			}
 
-		fd = fopen(mapfile,"wb");
+		if (level.colours > 256)
+			level.colours = 0;
 
-	} else {
-		
-		fprintf(stderr,"Writing to stdout\n");
-		fd = stdout;
+		/* The map's outer edges lie half a pixel out from the
+		   centres of its outer rows and columns */
 
-	}
+		if (west < -180.0)
+			west += 360.0;
 
-	minwest = ((double)min_west) + dpp;
+		east = west + width * dpp;
 
-	if (minwest > 360.0)
-		minwest -= 360.0;
+		CreateDirectoryA(dir, NULL);
 
-	north = (double)max_north - dpp;
+		for (z = zmax; z >= zmin && success == 0; z--) {
+			level.z = z;
 
-	south = (double)min_north;	/* No bottom legend */
+			if (z == zmax) {
+				/* Every tile the map overlaps */
 
-	east = (minwest < 180.0 ? -minwest : 360.0 - min_west);
-	west = (double)(max_west < 180 ? -max_west : 360 - max_west);
+				n = 1 << z;
+				x0 = (int)floor((west + 180.0) / 360.0 * n);
+				x1 = (int)floor((east + 180.0) / 360.0 * n);
+				y0 = (int)floor(mercatorRow(north, z) / XYZ_TILE);
+				y1 = (int)floor(mercatorRow(north - height * dpp, z) / XYZ_TILE);
+				y0 = (y0 < 0 ? 0 : y0);
+				y1 = (y1 >= n ? n - 1 : y1);
 
-	if (debug) {
-		fprintf(stderr, "\nWriting \"%s\" (%ux%u pixmap image)...\n",
-			filename != NULL ? mapfile : "to stdout", width, (kml ? height : height + 30));
-		fflush(stderr);
-	}
+				level.count = (y1 - y0 + 1) * (x1 - x0 + 1);
+				level.tiles = new xyzTile[level.count];
 
-	for (y = 0, lat = north; y < (int)height;
-	     y++, lat = north - (dpp * (double)y)) {
-		for (x = 0, lon = max_west; x < (int)width;
-		     x++, lon = max_west - (dpp * (double)x)) {
-			if (lon < 0.0)
-				lon += 360.0;
+				for (y = y0, i = 0; y <= y1; y++)
+					for (x = x0; x <= x1; x++, i++) {
+						level.tiles[i].x = (x % n + n) % n;
+						level.tiles[i].y = y;
+					}
+			} else {
+				/* The parents of the tiles kept a zoom in */
+
+				level.tiles = new xyzTile[level.finer_count + 1];
+
+				for (i = 0, level.count = 0; i < level.finer_count; i++) {
+					x = level.finer[i].x / 2;
+					y = level.finer[i].y / 2;
+
+					for (n = level.count - 1; n >= 0 && level.tiles[n].y == y; n--)
+						if (level.tiles[n].x == x)
+							break;
+
+					if (n < 0 || level.tiles[n].y != y) {
+						level.tiles[level.count].x = x;
+						level.tiles[level.count].y = y;
+						level.count++;
+					}
+				}
 
-			for (indx = 0, found = 0;
-			     indx < MAXPAGES && found == 0;) {
-				x0 = (int)rint(ppd *
-					       (lat -
-						(double)dem[indx].min_north));
-				y0 = mpi -
-				    (int)rint(ppd *
-					      (LonDiff
-					       ((double)dem[indx].max_west,
-						lon)));
-
-				if (x0 >= 0 && x0 <= mpi && y0 >= 0
-				    && y0 <= mpi)
-					found = 1;
+				qsort(level.tiles, level.count, sizeof(xyzTile), compareTiles);
+			}
+
+			for (i = 0; i < RENDER_THREADS; i++) {
+				share[i].level = &level;
+				share[i].first = i;
+				share[i].success = 0;
+			}
+
+			for (i = 1, started = 0; i < RENDER_THREADS; i++) {
+				threads[started] = CreateThread(nullptr, 0, [](LPVOID arg) -> DWORD{ xyzTiles((xyzShare*)arg); return 0; }, &share[i], 0, 0);
+				if (threads[started] == nullptr)
+					xyzTiles(&share[i]);
 				else
-					indx++;
+					++started;
 			}
 
-			if (found) {
-				mask = dem[indx].mask[x0][y0];
+			xyzTiles(&share[0]);
 
-				if (mask & 2)
-					/* Text Labels: Red */
-					ADD_PIXEL(&ctx, 255, 0, 0);
+			for (i = 0; i < started; i++) {
+				WaitForSingleObject(threads[i], INFINITE);
+				CloseHandle(threads[i]);
+			}
 
-				else if (mask & 4)
-					/* County Boundaries: Light Cyan */
-					ADD_PIXEL(&ctx, 128, 128, 255);
+			for (i = 0; i < RENDER_THREADS; i++)
+				if (success == 0)
+					success = share[i].success;
 
-				else
-					switch (mask & 57) {
-					case 1:
-						/* TX1: Green */
-						ADD_PIXEL(&ctx, 0, 255,
-							0);
-						break;
+			/* Only tiles with a signal are needed further out */
 
-					case 8:
-						/* TX2: Cyan */
-						ADD_PIXEL(&ctx, 0, 255,
-							255);
-						break;
+			for (i = 0; i < level.finer_count; i++)
+				delete [] level.finer[i].keys;
+			delete [] level.finer;
 
-					case 9:
-						/* TX1 + TX2: Yellow */
-						ADD_PIXEL(&ctx, 255, 255,
-							0);
+			for (i = 0, n = 0; i < level.count; i++) {
+				for (x = 0; x < XYZ_TILE * XYZ_TILE; x++)
+					if (level.tiles[i].keys[x] != 0)
 						break;
 
-					case 16:
-						/* TX3: Medium Violet */
-						ADD_PIXEL(&ctx, 147, 112,
-							219);
-						break;
+				if (x < XYZ_TILE * XYZ_TILE)
+					level.tiles[n++] = level.tiles[i];
+				else
+					delete [] level.tiles[i].keys;
+			}
 
-					case 17:
-						/* TX1 + TX3: Pink */
-						ADD_PIXEL(&ctx, 255, 192,
-							203);
-						break;
+			qsort(level.tiles, n, sizeof(xyzTile), compareTiles);
+			level.finer = level.tiles;
+			level.finer_count = n;
+			level.tiles = NULL;
 
-					case 24:
-						/* TX2 + TX3: Orange */
-						ADD_PIXEL(&ctx, 255, 165,
-							0);
-						break;
+			if (debug)
+				fprintf(stderr, "Zoom %d: %d tiles\n", z, level.count);
+		}
 
-					case 25:
-						/* TX1 + TX2 + TX3: Dark Green */
-						ADD_PIXEL(&ctx, 0, 100,
-							0);
-						break;
+		for (i = 0; i < level.finer_count; i++)
+			delete [] level.finer[i].keys;
+		delete [] level.finer;
+		delete [] level.column;
+		delete [] tables.grey;
 
-					case 32:
-						/* TX4: Sienna 1 */
-						ADD_PIXEL(&ctx, 255, 130,
-							71);
-						break;
+		return success;
+	}
+}
 
-					case 33:
-						/* TX1 + TX4: Green Yellow */
-						ADD_PIXEL(&ctx, 173, 255,
-							47);
-						break;
+void DoPathLoss(char *filename, unsigned char geo, unsigned char kml,
+		unsigned char ngs, struct site *xmtr, unsigned char txsites)
+{
+	/* This function generates a topographic map in Portable Pix Map
+	   (PPM) format based on the path loss values held in the
+	   signal[][] array.  The image created is rotated counter-clockwise
+	   90 degrees from its representation in dem[][] so that north
+	   points up and east points right in the image generated. */
 
-					case 40:
-						/* TX2 + TX4: Dark Sea Green 1 */
-						ADD_PIXEL(&ctx, 193, 255,
-							193);
-						break;
+	drawMap(filename, kml, ngs, xmtr, RENDER_LOSS);
+}
 
-					case 41:
-						/* TX1 + TX2 + TX4: Blanched Almond */
-						ADD_PIXEL(&ctx, 255, 235,
-							205);
-						break;
+int DoSigStr(char *filename, unsigned char geo, unsigned char kml,
+	      unsigned char ngs, struct site *xmtr, unsigned char txsites)
+{
+	/* As DoPathLoss(), for the field strength values held in
+	   the signal[][] array. */
 
-					case 48:
-						/* TX3 + TX4: Dark Turquoise */
-						ADD_PIXEL(&ctx, 0, 206,
-							209);
-						break;
+	return drawMap(filename, kml, ngs, xmtr, RENDER_SIGNAL);
+}
 
-					case 49:
-						/* TX1 + TX3 + TX4: Medium Spring Green */
-						ADD_PIXEL(&ctx, 0, 250,
-							154);
-						break;
+void DoRxdPwr(char *filename, unsigned char geo, unsigned char kml,
+	      unsigned char ngs, struct site *xmtr, unsigned char txsites)
+{
+	/* As DoPathLoss(), for the signal power level values held in
+	   the signal[][] array. */
 
-					case 56:
-						/* TX2 + TX3 + TX4: Tan */
-						ADD_PIXEL(&ctx, 210, 180,
-							140);
-						break;
+	drawMap(filename, kml, ngs, xmtr, RENDER_POWER);
+}
 
-					case 57:
-						/* TX1 + TX2 + TX3 + TX4: Gold2 */
-						ADD_PIXEL(&ctx, 238, 201,
-							0);
-						break;
+void DoLOS(char *filename, unsigned char geo, unsigned char kml,
+	   unsigned char ngs, struct site *xmtr, unsigned char txsites)
+{
+	/* As DoPathLoss(), for the line of sight coverage of up to
+	   four transmitters held in the mask[][] array. */
 
-					default:
-						if (ngs)	/* No terrain */
-							ADD_PIXEL(&ctx, 
-								255, 255, 255);
-						else {
-							/* Sea-level: Medium Blue */
-							if (dem[indx].
-							    data[x0][y0] == 0)
-								ADD_PIXEL(&ctx, 
-									0, 0,
-									170);
-							else {
-								/* Elevation: Greyscale */
-								terrain =
-								    (unsigned)
-								    (0.5 +
-								     pow((double)(dem[indx].data[x0][y0] - min_elevation), one_over_gamma) * conversion);
-								ADD_PIXEL(&ctx, 
-									terrain,
-									terrain,
-									terrain);
-							}
-						}
-					}
-			}
+	drawMap(filename, kml, ngs, xmtr, RENDER_LOS);
+}
 
-			else {
-				/* We should never get here, but if */
-				/* we do, display the region as black */
+int DoXYZ(char *dir, int zmin, int zmax, unsigned char los, struct site *xmtr)
+{
+	/* Writes the map as web map (XYZ) tiles, dir/z/x/y.png, in
+	   Web Mercator from zoom zmax out to zmin: the line of sight
+	   coverage if los is set, or else what DoPathLoss(), DoSigStr()
+	   or DoRxdPwr() would draw.  Pixels without coverage are
+	   clear, and tiles without any are not written. */
 
-				ADD_PIXEL(&ctx, 255, 255, 255);
-			}
-		}
-	}
+	int mode = (los ? RENDER_LOS : LR.erp == 0.0 ? RENDER_LOSS :
+		    dbm ? RENDER_POWER : RENDER_SIGNAL), success;
 
-	if((success = image_write(&ctx,fd)) != 0){
-		fprintf(stderr,"Error writing image\n");
-		exit(success);
-	}
+	loadColours(xmtr, mode);
 
-	image_free(&ctx);
+	if (zmax < 0)
+		zmax = (int)ceil(log(360.0 / (XYZ_TILE * dpp)) / log(2.0));
 
-	if( filename != NULL) {
-		fclose(fd);
-		fd = NULL;
+	if (zmin < 0)
+		zmin = (zmax > 4 ? zmax - 4 : 0);
+
+	if (zmax > 24 || zmin > zmax) {
+		fprintf(stderr, "Error: bad zoom range %d to %d\n", zmin, zmax);
+		return EINVAL;
 	}
 
+	if (debug)
+		fprintf(stderr, "\nWriting zooms %d to %d to \"%s\"...\n", zmin, zmax, dir);
+
+	if ((success = drawTiles(dir, zmin, zmax, mode)) != 0)
+		fprintf(stderr, "Error writing tiles: %s\n", strerror(success));
+
+	return success;
 }
 
 void PathReport(struct site source, struct site destination, char *name,
@@ -1500,16 +1503,8 @@ void PathReport(struct site source, struct site destination, char *name,
 
 			x = (int)rint(10.0 * (10.0 - elevation));
 
-			if (x >= 0 && x <= 1000) {
-				pattern =
-				    (double)LR.antenna_pattern[(int)azimuth][x];
-
-				if (pattern != 0.0){
-					patterndB = 20.0 * log10(pattern);
-				}else{
-					patterndB = 0.0;
-				}
-			}
+			if (x >= 0 && x <= 1000)
+				patterndB = PATTERN_DB((int)azimuth, x);
 
 			else
 				patterndB = 0.0;
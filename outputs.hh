@@ -9,6 +9,7 @@ void DoRxdPwr(char *filename, unsigned char geo, unsigned char kml,
 	      unsigned char ngs, struct site *xmtr, unsigned char txsites);
 void DoLOS(char *filename, unsigned char geo, unsigned char kml,
 	   unsigned char ngs, struct site *xmtr, unsigned char txsites);
+int DoXYZ(char *dir, int zmin, int zmax, unsigned char los, struct site *xmtr);
 void PathReport(struct site source, struct site destination, char *name,
 		char graph_it, int propmodel, int pmenv, double rxGain);
 void SeriesData(struct site source, struct site destination, char *name,